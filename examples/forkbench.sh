@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compare runs per second of plain lanvm invocations and lanrun runs through
+# a fork server:
+#
+#     examples/forkbench.sh build program.lc 1000
+#
+# Both run the program the given number of times (default 500) one after
+# the other, with output discarded.
+BUILD=${1:?usage: forkbench.sh <build directory> <program> [runs]}
+PROGRAM=${2:?usage: forkbench.sh <build directory> <program> [runs]}
+RUNS=${3:-500}
+SOCKET=${TMPDIR:-/tmp}/lanvm-forkbench.$$
+
+rate() { # rate <start> <end>
+    awk -v runs="$RUNS" -v start="$1" -v end="$2" 'BEGIN { printf "%.0f runs/s\n", runs / (end - start) }'
+}
+
+start=$(date +%s.%N)
+i=0; while [ $i -lt "$RUNS" ]; do "$BUILD/lanvm" "$PROGRAM" >/dev/null </dev/null; i=$((i + 1)); done
+end=$(date +%s.%N)
+echo "lanvm:         $(rate "$start" "$end")"
+
+"$BUILD/lanvm" --fork-server="$SOCKET" "$PROGRAM" >/dev/null &
+server=$!
+while [ ! -S "$SOCKET" ]; do sleep 0.01; done
+start=$(date +%s.%N)
+i=0; while [ $i -lt "$RUNS" ]; do "$BUILD/lanrun" "$SOCKET" >/dev/null </dev/null; i=$((i + 1)); done
+end=$(date +%s.%N)
+echo "lanrun:        $(rate "$start" "$end")"
+kill $server
+rm -f "$SOCKET"
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Generate a large straight-line program, for measuring how load time scales:
+#
+#     examples/genlarge.sh 60000 > large.s
+#     ./build/lasm large.s large.lc
+#     ./build/lanvm --stats large.lc
+#
+# The argument is roughly the size of the assembled program in bytes
+# (default 60000). It runs in 65535 bytes of memory, so keep it below that
+# to leave room for the stack.
+awk -v size="${1:-60000}" 'BEGIN {
+    print ".memsize 65535"
+    print "start:"
+    for (i = 0; i < size / 14; i++) { # 14 bytes per group
+        printf "\tld r0, %d\n", i % 65536
+        print "\tadd r0, r1"
+        print "\txor r1, r0"
+        print "\tinc r2"
+        print "\tpush r0"
+        print "\tpop r1"
+    }
+    print "\tvmexit 0"
+}'
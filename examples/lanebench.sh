@@ -0,0 +1,23 @@
+#!/bin/sh
+# Run a program on many inputs in lockstep, then the same number of copies
+# one after the other on a single worker with the JIT and without, printing
+# the throughput of each:
+#
+#     examples/lanebench.sh build lanes.lc 1000
+#
+# Lane i starts with r0 = i * 7919, lanes (default 256) print their results
+# and those are discarded. examples/lanes.s is an ALU-heavy kernel for it.
+BUILD=${1:?usage: lanebench.sh <build directory> <program> [lanes]}
+PROGRAM=${2:?usage: lanebench.sh <build directory> <program> [lanes]}
+LANES=${3:-256}
+SEEDS=$(mktemp)
+trap 'rm -f "$SEEDS"' EXIT
+
+i=1
+while [ $i -le "$LANES" ]; do
+    echo $((i * 7919 % 65536)) >>"$SEEDS"
+    i=$((i + 1))
+done
+"$BUILD/lanvm" --stats --lanes="$SEEDS" "$PROGRAM" </dev/null | grep '^Ran'
+"$BUILD/lanvm" --stats --jit --guests="$LANES" --workers=1 "$PROGRAM" </dev/null | grep '^Ran'
+"$BUILD/lanvm" --stats --no-jit --guests="$LANES" --workers=1 "$PROGRAM" </dev/null | grep '^Ran'
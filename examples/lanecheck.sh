@@ -0,0 +1,65 @@
+#!/bin/sh
+# Check lockstep against running each lane alone on random register and
+# branch programs, printing every program whose lanes end differently:
+#
+#     examples/lanecheck.sh build 100
+#
+# Each program (default 50) loops a few times over random ALU instructions,
+# PUSHF/POPF pairs and forward jumps on r0, r1, r3 and r4, with r2 counting
+# the iterations, and runs on 16 lanes with random starting registers. A
+# differing program is kept as lanecheck-SEED.s next to its lanes file.
+BUILD=${1:?usage: lanecheck.sh <build directory> [programs]}
+PROGRAMS=${2:-50}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+fails=0
+seed=1
+while [ $seed -le "$PROGRAMS" ]; do
+    awk -v seed=$seed -v lanes="$DIR/lanes.txt" 'BEGIN {
+        srand(seed)
+        split("r0 r1 r3 r4", reg, " ")
+        split("add sub and or xor mul cmp", binary, " ")
+        split("not inc dec", unary, " ")
+        split("jz jnz jc jnc jle jge jl jg jmp", jump, " ")
+        for (i = 0; i < 16; i++)
+            printf "%d %d 0 %d %d\n", rand() * 65536, rand() * 65536,
+                rand() * 65536, rand() * 65536 > lanes
+        print "start:"
+        printf "\tld r2, %d\n", 2 + int(rand() * 4)
+        print "loop:"
+        n = 8 + int(rand() * 24)
+        for (i = 0; i < n; i++) {
+            k = rand()
+            if (k < 0.45)
+                printf "\t%s %s, %s\n", binary[1 + int(rand() * 7)],
+                    reg[1 + int(rand() * 4)], reg[1 + int(rand() * 4)]
+            else if (k < 0.55)
+                printf "\tld %s, %d\n", reg[1 + int(rand() * 4)], rand() * 65536
+            else if (k < 0.7)
+                printf "\t%s %s\n", unary[1 + int(rand() * 3)], reg[1 + int(rand() * 4)]
+            else if (k < 0.8)
+                print "\tpushf\n\tpopf"
+            else {
+                printf "\t%s l%d\n", jump[1 + int(rand() * 9)], i
+                for (j = int(rand() * 3); j > 0; j--)
+                    printf "\tinc %s\n", reg[1 + int(rand() * 4)]
+                printf "l%d:\n", i
+            }
+        }
+        print "\tdec r2\n\tjnz loop\n\tvmexit 0"
+    }' >"$DIR/check.s"
+    "$BUILD/lasm" "$DIR/check.s" "$DIR/check.lc" >/dev/null || exit 1
+    "$BUILD/lanvm" --lanes="$DIR/lanes.txt" "$DIR/check.lc" </dev/null | grep '^Lane' >"$DIR/lockstep.txt"
+    "$BUILD/lanvm" --lanes="$DIR/lanes.txt" --no-lockstep "$DIR/check.lc" </dev/null | grep '^Lane' >"$DIR/alone.txt"
+    if ! cmp -s "$DIR/lockstep.txt" "$DIR/alone.txt"; then
+        echo "Program $seed differs:"
+        diff "$DIR/lockstep.txt" "$DIR/alone.txt" | grep '^[<>]'
+        cp "$DIR/check.s" "lanecheck-$seed.s"
+        cp "$DIR/lanes.txt" "lanecheck-$seed.txt"
+        fails=$((fails + 1))
+    fi
+    seed=$((seed + 1))
+done
+echo "$fails of $PROGRAMS programs differ"
+[ $fails -eq 0 ]
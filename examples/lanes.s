@@ -0,0 +1,17 @@
+start:
+	ld r2, 0
+	ld r4, 20
+outer:
+	ld r3, 10000
+inner:
+	mul r0, 25173
+	add r0, 13849
+	ld r1, r0
+	and r1, 255
+	xor r2, r1
+	add r2, r0
+	dec r3
+	jnz inner
+	dec r4
+	jnz outer
+	vmexit 0
@@ -0,0 +1,44 @@
+start:
+	ld r3, 768
+	ld [r3], 112
+	ld r0, 768
+	ld r1, 1
+	vmchopen
+	jnz producer
+	ld r0, 768
+	ld r1, 0
+	vmchopen
+	jz fail
+	ld bp, r0
+	ld r3, 0
+	ld r4, 512
+receive:
+	ld r0, bp
+	ld r1, 512
+	ld r2, 2
+	vmchrecv
+	jz closed
+	add r3, [r4]
+	jmp receive
+closed:
+	or r2, r2
+	jnz fail
+	cmp r3, 41748
+	jnz fail
+	vmexit 0
+producer:
+	ld bp, r0
+	ld r3, 1000
+	ld r4, 512
+send:
+	ld [r4], r3
+	ld r0, bp
+	ld r1, 512
+	ld r2, 2
+	vmchsend
+	jz fail
+	dec r3
+	jnz send
+	vmexit 0
+fail:
+	vmexit 1
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Run many copies of a program on the scheduler with 1 worker, 2, and so on
+# up to one per core, printing throughput and latency for each:
+#
+#     examples/schedbench.sh build program.lc 1000
+#
+# All guests (default 256) start together, output is discarded.
+BUILD=${1:?usage: schedbench.sh <build directory> <program> [guests]}
+PROGRAM=${2:?usage: schedbench.sh <build directory> <program> [guests]}
+GUESTS=${3:-256}
+CORES=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+
+workers=1
+while [ $workers -le "$CORES" ]; do
+    "$BUILD/lanvm" --stats --guests="$GUESTS" --workers=$workers "$PROGRAM" </dev/null | grep -E '^(Ran|Latency)'
+    workers=$((workers * 2))
+    [ $workers -gt "$CORES" ] && [ $((workers / 2)) -lt "$CORES" ] && workers=$CORES
+done
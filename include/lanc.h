@@ -0,0 +1,52 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LANC_H
+#define LANC_H
+
+#define LANC_VERSION 100
+#define LANC_VERSION_STR "1.0.0"
+
+// Instruction formats, as decoded by the VM
+enum {
+    FMT_INVALID,
+    FMT_NONE, // opcode
+    FMT_DEST, // opcode DS [off8]
+    FMT_SRC, // opcode DS [off8]
+    FMT_DEST_SRC, // opcode DS [off8] [off8]
+    FMT_DEST_IMM16, // opcode DS [off8] imm16
+    FMT_DEST_IMM8, // opcode DS [off8] imm8
+    FMT_IMM16, // opcode imm16
+    FMT_IMM8 // opcode imm8
+};
+
+typedef struct {
+    const char *mnemonic;
+    uint8_t format;
+} Opcode;
+
+// Decoded instruction
+typedef struct {
+    uint8_t opcode;
+    uint8_t dest, src; // Operand modes from the DS byte
+    int8_t doff, soff; // [bp+off8]/[sp+off8] offsets
+    uint16_t imm;
+    uint16_t next; // Fall-through address
+} Op;
+
+#endif
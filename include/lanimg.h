@@ -0,0 +1,235 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef LANIMG_H
+#define LANIMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * LanCode image, the binary program format lasm writes and lanvm and lanc
+ * load. Every field is little-endian:
+ *
+ *     0  magic "LBCI"
+ *     4  u16 version
+ *     6  u16 entry point
+ *     8  u16 memory size, 0 for the VM default
+ *    10  u16 section count
+ *    12  u32 flags, IMG_HARVARD and IMG_WIDE or 0
+ *    16  section table, 12 bytes per section:
+ *          u8 type, u8 reserved, u16 load address, u32 file offset, u32 size
+ *
+ * Images flagged IMG_WIDE hold 32-bit LanCode, which only lanvm32 runs.
+ * Their entry point and memory size don't fit the fields above, which are
+ * 0, so the header goes on with
+ *
+ *    16  u32 entry point
+ *    20  u32 memory size, 0 for the VM default
+ *    24  section table, 16 bytes per section:
+ *          u8 type, u8 reserved, u16 reserved, u32 file offset, u32 size,
+ *          u32 load address
+ *
+ * Code and data sections are copied to their load address in guest memory.
+ * Images flagged IMG_HARVARD run with code in an address space of its own,
+ * where code sections go, and data sections in memory (see loadImage()).
+ * Debug sections, and types a loader doesn't know, are never loaded. The
+ * debug section lasm writes lists the labels, each a u16 address (u32 in
+ * wide images) followed by the NUL-terminated name.
+ *
+ * Files that don't start with the magic are the older hex text format, two
+ * hex digits per byte up to the first newline.
+ *
+ * A VM snapshot is an image with the memory size, entry point and flags of
+ * the running VM and these sections, along with a code section holding the
+ * code space in Harvard mode:
+ *
+ *   state        r0-r4, bp, sp, pc, iv as u16, u8 flags, u8 reserved,
+ *                u16 loaded memory size, u16 program size, u64 instructions
+ *                retired (32 bytes; the words are u32 in wide snapshots,
+ *                54 bytes)
+ *   memory       memory contents, stored sparsely: a bitmap of the 256-byte
+ *                pages that are not all zero (bit n of byte n / 8 for the
+ *                page at n * 256), followed by those pages in address order.
+ *                The bitmap covers the 16-bit address space, or in wide
+ *                snapshots the memory size and slack
+ *   pristine     memory as the program was loaded, in the same form
+ *   framebuffer  u16 width, u16 height, u32 color, width * height u32 pixels
+ *   banks        extended memory: the bank shown in each 4 KiB window of the
+ *                address space as u16 (16 of them, 0xFFFF for none), a
+ *                bitmap of the allocated banks (1024 bits, as for pages),
+ *                then those banks in order, 4096 bytes and the 2 bytes of
+ *                slack a word access at the end reaches
+ */
+
+#define IMG_MAGIC "LBCI"
+#define IMG_VERSION 1
+#define IMG_HEADER_SIZE 16
+#define IMG_SECTION_SIZE 12
+#define IMG_WIDE_HEADER_SIZE 24
+#define IMG_WIDE_SECTION_SIZE 16
+#define IMG_MAX_SECTIONS 16
+
+#define IMG_PAGE_SIZE 256 // Granularity of sparse memory sections
+#define IMG_PAGE_BITMAP (0x10000 / IMG_PAGE_SIZE / 8)
+#define IMG_STATE_SIZE 32
+#define IMG_WIDE_STATE_SIZE 54
+
+#define IMG_HARVARD 0x1 // Header flag, code and data in separate address spaces
+#define IMG_WIDE 0x2 // Header flag, 32-bit LanCode
+
+enum {
+    IMG_CODE = 1,
+    IMG_DATA,
+    IMG_DEBUG,
+    IMG_STATE,
+    IMG_MEMORY,
+    IMG_PRISTINE,
+    IMG_FRAMEBUFFER,
+    IMG_BANKS
+};
+
+typedef struct {
+    uint8_t type;
+    uint32_t addr; // Load address, unused for debug sections
+    uint32_t size;
+    const uint8_t *data; // Contents, inside the parsed file
+} ImgSection;
+
+typedef struct {
+    uint16_t version;
+    uint32_t entry;
+    uint32_t memSize; // 0 if the image doesn't declare one
+    uint16_t sectionCount;
+    uint32_t flags;
+    ImgSection sections[IMG_MAX_SECTIONS];
+} Image;
+
+static inline uint16_t imgGet16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t imgGet32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void imgPut16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static inline void imgPut32(uint8_t *p, uint32_t value) {
+    imgPut16(p, value & 0xFFFF);
+    imgPut16(p + 2, value >> 16);
+}
+
+static inline size_t imgHeaderSize(uint32_t flags) {
+    return flags & IMG_WIDE ? IMG_WIDE_HEADER_SIZE : IMG_HEADER_SIZE;
+}
+
+static inline size_t imgSectionSize(uint32_t flags) {
+    return flags & IMG_WIDE ? IMG_WIDE_SECTION_SIZE : IMG_SECTION_SIZE;
+}
+
+// Fill in the header of an image with count sections, imgHeaderSize(flags) bytes
+static inline void imgPutHeader(uint8_t *header, uint32_t flags, uint32_t entry, uint32_t memSize, uint16_t count) {
+    memcpy(header, IMG_MAGIC, 4);
+    imgPut16(header + 4, IMG_VERSION);
+    imgPut16(header + 6, flags & IMG_WIDE ? 0 : entry);
+    imgPut16(header + 8, flags & IMG_WIDE ? 0 : memSize);
+    imgPut16(header + 10, count);
+    imgPut32(header + 12, flags);
+    if (!(flags & IMG_WIDE)) return;
+    imgPut32(header + 16, entry);
+    imgPut32(header + 20, memSize);
+}
+
+// Fill in entry i of the section table following header
+static inline void imgPutSection(uint8_t *header, uint32_t flags, int i, uint8_t type, uint32_t addr,
+    uint32_t offset, uint32_t size) {
+    uint8_t *entry = header + imgHeaderSize(flags) + i * imgSectionSize(flags);
+    memset(entry, 0, imgSectionSize(flags));
+    entry[0] = type;
+    imgPut32(entry + 4, offset);
+    imgPut32(entry + 8, size);
+    if (flags & IMG_WIDE) imgPut32(entry + 12, addr);
+    else imgPut16(entry + 2, addr);
+}
+
+static inline int imgLoaded(const ImgSection *s) {
+    return s->type == IMG_CODE || s->type == IMG_DATA;
+}
+
+static inline int imgIsImage(const uint8_t *file, size_t size) {
+    return size >= 4 && memcmp(file, IMG_MAGIC, 4) == 0;
+}
+
+// Parse the image in file, returns NULL or what is wrong with it
+static inline const char *imgParse(const uint8_t *file, size_t size, Image *img) {
+    if (size < IMG_HEADER_SIZE || !imgIsImage(file, size)) return "not a LanCode image";
+    img->version = imgGet16(file + 4);
+    img->entry = imgGet16(file + 6);
+    img->memSize = imgGet16(file + 8);
+    img->sectionCount = imgGet16(file + 10);
+    img->flags = imgGet32(file + 12);
+    if (img->version == 0 || img->version > IMG_VERSION) return "unsupported image version";
+    int wide = img->flags & IMG_WIDE;
+    if (wide) {
+        if (size < IMG_WIDE_HEADER_SIZE) return "truncated header";
+        img->entry = imgGet32(file + 16);
+        img->memSize = imgGet32(file + 20);
+    }
+    size_t headerSize = imgHeaderSize(img->flags), sectionSize = imgSectionSize(img->flags);
+    if (img->sectionCount > IMG_MAX_SECTIONS) return "too many sections";
+    if (size < headerSize + (size_t)img->sectionCount * sectionSize) return "truncated section table";
+
+    for (int i = 0; i < img->sectionCount; i++) {
+        const uint8_t *entry = file + headerSize + i * sectionSize;
+        ImgSection *s = &img->sections[i];
+        uint32_t offset = imgGet32(entry + 4);
+        s->type = entry[0];
+        s->addr = wide ? imgGet32(entry + 12) : imgGet16(entry + 2);
+        s->size = imgGet32(entry + 8);
+        if (offset > size || s->size > size - offset) return "section past the end of the file";
+        if (imgLoaded(s) && (uint64_t)s->addr + s->size > (wide ? 1ULL << 32 : 0x10000)) {
+            return wide ? "section past the 32-bit address space" : "section past the 16-bit address space";
+        }
+        s->data = file + offset;
+    }
+    return NULL;
+}
+
+// End of the sections of type, or of every loaded section for type 0
+static inline uint64_t imgExtentOf(const Image *img, uint8_t type) {
+    uint64_t end = 0;
+    for (int i = 0; i < img->sectionCount; i++) {
+        const ImgSection *s = &img->sections[i];
+        uint64_t sectionEnd = (uint64_t)s->addr + s->size;
+        if ((type ? s->type == type : imgLoaded(s)) && sectionEnd > end) end = sectionEnd;
+    }
+    return end;
+}
+
+// End of the loaded sections, the memory a program needs at least
+static inline uint64_t imgExtent(const Image *img) {
+    return imgExtentOf(img, 0);
+}
+
+#endif
@@ -0,0 +1,345 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef LANRT_H
+#define LANRT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+/*
+ * Runtime for the C translations written by lanc. It is header-only so a
+ * translation builds with nothing but a C compiler:
+ *
+ *     cc -O2 -I include program.c -o program
+ *
+ * The generated main() keeps the guest registers and flags in locals, so the
+ * compiler can hold them in host registers, and spills them into a Runtime
+ * with RT_SAVE() before calling a function below that reads or changes the
+ * VM state. The translation defines RT_MEMORY_SIZE, RT_IMAGE_SIZE and
+ * RT_VERSION_STR before including this header, and the
+ * image[] and code[] arrays and the locals the macros below refer to.
+ *
+ * Behaviour and messages follow lanvm.
+ */
+
+// Same codes as lanvm.h
+#define RT_ERR_OOB_OFF -1
+#define RT_ERR_OOB_REG -2
+#define RT_ERR_STACK_OVERFLOW -3
+#define RT_ERR_STACK_UNDERFLOW -4
+#define RT_ERR_INVALID_OPCODE -5
+#define RT_ERR_PC_OOB -6
+#define RT_ERR_MALLOC -7
+#define RT_ERR_FREE -8
+#define RT_ERR_DBZ -9
+#define RT_ERR_NULL_PTR -10
+#define RT_ERR_CODE_WRITE -13 // Translated programs can't modify their code
+
+#define RT_EXC_SEVERE 0
+#define RT_EXC_WARNING 1
+
+// Flag indices, as in lanvm.h
+enum {
+    RT_CARRY,
+    RT_ZERO,
+    RT_OVERFLOW,
+    RT_SIGN,
+    RT_HALT,
+    RT_IE,
+    RT_IA
+};
+
+// Two bytes of slack past memSize, lanvm allows a 16-bit store at memSize
+#define RT_SLACK 2
+
+typedef struct {
+    uint8_t *memory;
+    uint16_t memSize;
+    uint16_t pc;
+    uint16_t iv;
+    uint16_t r[5];
+    bool flags[8];
+    uint16_t sp, bp;
+    const uint8_t *image; // Program as loaded
+    const uint8_t *code; // Nonzero for every byte of a translated instruction
+    uint16_t imageSize;
+} Runtime;
+
+// Spill the locals of the generated main() into rt, with PC at
+#define RT_SAVE(at) (rt.pc = (at), rt.r[0] = r0, rt.r[1] = r1, rt.r[2] = r2, rt.r[3] = r3, rt.r[4] = r4, \
+    rt.bp = bp, rt.sp = sp, rt.iv = iv, rt.flags[RT_CARRY] = fC, rt.flags[RT_ZERO] = fZ, \
+    rt.flags[RT_OVERFLOW] = fO, rt.flags[RT_SIGN] = fS, rt.flags[RT_HALT] = fH, rt.flags[RT_IE] = fIE, \
+    rt.flags[RT_IA] = fIA, rt.flags[7] = f7)
+
+// Reload them after a call that may have changed the state or moved memory
+#define RT_LOAD() (r0 = rt.r[0], r1 = rt.r[1], r2 = rt.r[2], r3 = rt.r[3], r4 = rt.r[4], \
+    bp = rt.bp, sp = rt.sp, iv = rt.iv, fC = rt.flags[RT_CARRY], fZ = rt.flags[RT_ZERO], \
+    fO = rt.flags[RT_OVERFLOW], fS = rt.flags[RT_SIGN], fH = rt.flags[RT_HALT], fIE = rt.flags[RT_IE], \
+    fIA = rt.flags[RT_IA], f7 = rt.flags[7], mem = rt.memory, memSize = rt.memSize)
+
+// modifyFlags() of a 16-bit result
+#define RT_FLAGS(res) (fZ = (res) == 0, fO = (res) >> 15, fS = 0, fC = 0)
+
+// Report a warning with the state as it is at PC at
+#define RT_WARN(at, code, ...) (RT_SAVE(at), rtException(&rt, (code), RT_EXC_WARNING, __VA_ARGS__))
+#define RT_FATAL(at, code, ...) (RT_SAVE(at), rtException(&rt, (code), RT_EXC_SEVERE, __VA_ARGS__))
+
+// Address of [bp+off8]/[sp+off8] or [r3]/[r4], -1 once an out of bounds access was reported
+#define RT_OFF(base, off, at) ((unsigned)((base) + (off)) <= memSize ? (int)((base) + (off)) : \
+    (RT_WARN(at, RT_ERR_OOB_OFF, NULL), -1))
+#define RT_IND(reg, at) ((reg) <= memSize ? (int)(reg) : \
+    (RT_WARN(at, RT_ERR_OOB_REG, "Indirect address: 0x%04x\n", (reg)), -1))
+
+// Memory operands are 16-bit little-endian words, stored in host byte order like lanvm's uint16_t pointers
+static inline uint16_t rtLoad16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static inline void rtStore16(uint8_t *p, uint16_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+// Stores that reach a translated instruction stop the program
+#define RT_CHECK_CODE(addr, at) do { \
+    if ((addr) < RT_IMAGE_SIZE && (code[(addr)] | code[(addr) + 1])) \
+      RT_FATAL(at, RT_ERR_CODE_WRITE, "Address: 0x%04x\n", (addr)); \
+  } while (0)
+
+#define RT_STORE(addr, value, at) do { \
+    RT_CHECK_CODE(addr, at); \
+    rtStore16(mem + (addr), (value)); \
+  } while (0)
+
+// push16/pop16 and push8/pop8, high byte at the lower address
+#define RT_PUSH16(value, at) do { \
+    uint16_t v_ = (value); \
+    if (sp > memSize) RT_FATAL(at, RT_ERR_STACK_OVERFLOW, NULL); \
+    mem[--sp] = v_ & 0xff; \
+    mem[--sp] = v_ >> 8; \
+    RT_CHECK_CODE(sp, at); \
+  } while (0)
+
+#define RT_POP16(dest, at) do { \
+    if (sp > memSize) RT_FATAL(at, RT_ERR_STACK_UNDERFLOW, NULL); \
+    uint16_t v_ = mem[sp++] << 8; \
+    v_ |= mem[sp++]; \
+    (dest) = v_; \
+  } while (0)
+
+#define RT_PUSH8(value, at) do { \
+    if (sp > memSize || sp == 0) RT_FATAL(at, RT_ERR_STACK_OVERFLOW, NULL); \
+    mem[--sp] = (value); \
+    RT_CHECK_CODE(sp, at); \
+  } while (0)
+
+#define RT_POP8(dest, at) do { \
+    if (sp > memSize) RT_FATAL(at, RT_ERR_STACK_UNDERFLOW, NULL); \
+    (dest) = mem[sp++]; \
+  } while (0)
+
+static inline void rtPrintState(Runtime *rt) {
+  printf("Current state: \n"
+      "r0=0x%04x r1=0x%04x r2=0x%04x r3=0x%04x r4=0x%04x\nSP=0x%04x BP=0x%04x PC=0x%04x F=0x%d%d%d%d%d%d%d%d\n",
+      rt->r[0], rt->r[1], rt->r[2], rt->r[3], rt->r[4], rt->sp, rt->bp, rt->pc, rt->flags[7], rt->flags[6],
+      rt->flags[5], rt->flags[4], rt->flags[3], rt->flags[2], rt->flags[1], rt->flags[0]
+  );
+}
+
+static inline void rtExit(Runtime *rt, int8_t code) {
+  free(rt->memory);
+  printf("VM exited with code %d\n", code);
+  exit(code);
+}
+
+static inline int rtException(Runtime *rt, int code, int severity, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  printf("======================================================\nVM Runtime Exception: code %d severity %d at PC 0x%04x:\n", code, severity, rt->pc);
+  switch (code) {
+      case RT_ERR_OOB_OFF:
+          printf("Offset out of bounds\n");
+          printf("BP: %d\n", rt->bp);
+          printf("Offset: %d\n", 0); // lanvm prints a byte of vm->program, which the loader never fills in
+          printf("BP+Offset: %d\n", rt->bp);
+          printf("Valid address range: 0x0000 - 0x%04x\n", rt->memSize);
+          break;
+      case RT_ERR_OOB_REG:
+          printf("Register indirect address out of bounds\nValid address range: 0x0000 - 0x%04x\n", rt->memSize);
+          break;
+      case RT_ERR_STACK_OVERFLOW:
+          printf("Stack overflow\n");
+          break;
+      case RT_ERR_STACK_UNDERFLOW:
+          printf("Stack underflow\n");
+          break;
+      case RT_ERR_INVALID_OPCODE:
+          printf("Unknown opcode\n");
+          break;
+      case RT_ERR_PC_OOB:
+          printf("Program counter out of bounds\n");
+          break;
+      case RT_ERR_MALLOC:
+          printf("Memory allocation failed\n");
+          break;
+      case RT_ERR_FREE:
+          printf("Memory free failed\n");
+          break;
+      case RT_ERR_DBZ:
+          printf("Division by zero\n");
+          break;
+      case RT_ERR_NULL_PTR:
+          printf("Null pointer\n");
+          break;
+      case RT_ERR_CODE_WRITE:
+          printf("Store into translated code\n");
+          break;
+      default:
+          printf("Unknown error\n");
+          break;
+  }
+  printf("Additional information:\n");
+  if (fmt) vprintf(fmt, args);
+  rtPrintState(rt);
+  printf("======================================================\n");
+  va_end(args);
+  if (severity == RT_EXC_SEVERE) {
+      rtExit(rt, code);
+  }
+  return code;
+}
+
+static inline void rtInit(Runtime *rt, const uint8_t *image, const uint8_t *code, uint16_t imageSize) {
+  printf("LanVM v%s\n", RT_VERSION_STR);
+  memset(rt, 0, sizeof(*rt));
+  rt->memSize = RT_MEMORY_SIZE;
+  rt->memory = calloc(rt->memSize + RT_SLACK, sizeof(uint8_t));
+  if (!rt->memory) {
+      rtExit(rt, RT_ERR_MALLOC);
+  }
+  memcpy(rt->memory, image, imageSize);
+  rt->sp = RT_MEMORY_SIZE; // Top of the stack
+  rt->image = image;
+  rt->code = code;
+  rt->imageSize = imageSize;
+}
+
+static inline int rtResize(Runtime *rt, uint16_t size) {
+  uint8_t *memory = realloc(rt->memory, size + RT_SLACK);
+  if (!memory) {
+      rtException(rt, RT_ERR_MALLOC, RT_EXC_SEVERE, NULL);
+      return 1;
+  }
+  if (size > rt->memSize) memset(memory + rt->memSize + RT_SLACK, 0, size - rt->memSize);
+  rt->memory = memory;
+  rt->memSize = size;
+  return 0;
+}
+
+// VMRESTART, memory goes back to the program as loaded
+static inline void rtRestart(Runtime *rt) {
+  memset(rt->flags, 0, sizeof(rt->flags));
+  memset(rt->r, 0, sizeof(rt->r));
+  rt->sp = RT_MEMORY_SIZE;
+  rt->bp = 0;
+  rt->pc = 0;
+  rt->iv = 0;
+  if (rt->memSize != RT_MEMORY_SIZE) rtResize(rt, RT_MEMORY_SIZE);
+  memcpy(rt->memory, rt->image, rt->imageSize);
+  memset(rt->memory + rt->imageSize, 0, RT_MEMORY_SIZE + RT_SLACK - rt->imageSize);
+}
+
+// VMMALLOC, 0 = success, 1 = failure
+static inline int rtMalloc(Runtime *rt, uint16_t size) {
+  if (rt->memSize + size > 0xFFFF) {
+      rtException(rt, RT_ERR_MALLOC, RT_EXC_WARNING, "Stack allocation exceeds maximum size\n");
+      return 1;
+  }
+  return rtResize(rt, rt->memSize + size);
+}
+
+// VMFREE, 0 = success, 1 = failure
+static inline int rtFree(Runtime *rt, uint16_t size) {
+  if (size >= rt->memSize) {
+      rtException(rt, RT_ERR_FREE, RT_EXC_WARNING, "Cannot free more memory than allocated\n");
+      return 1;
+  }
+  if (rtResize(rt, rt->memSize - size)) return 1;
+  if (rt->sp > rt->memSize) { // Reset stack pointer if out of bounds
+      rt->sp = rt->memSize;
+  }
+  return 0;
+}
+
+// GETS, reads a line into 16-bit cells at [r4] and counts them in r3
+static inline void rtGets(Runtime *rt) {
+  char c;
+  if (rt->r[4] > rt->memSize) {
+      rtException(rt, RT_ERR_OOB_REG, RT_EXC_WARNING, "Indirect address: 0x%04x\n", rt->r[4]);
+      rtException(rt, RT_ERR_NULL_PTR, RT_EXC_WARNING, "Null ptr passed to GETS\n");
+      return;
+  }
+  uint16_t addr = rt->r[4];
+  rtStore16(rt->memory + addr, '\0');
+  while ((c = getchar()) != '\n') {
+      if (addr < rt->imageSize && (rt->code[addr] | rt->code[addr + 1])) {
+          rtException(rt, RT_ERR_CODE_WRITE, RT_EXC_SEVERE, "Address: 0x%04x\n", addr);
+      }
+      rtStore16(rt->memory + addr, (uint16_t)c);
+      addr += 2;
+      rt->r[3]++;
+  }
+}
+
+// PRINTS, prints the low bytes of the 16-bit cells at [r3] up to a zero, counting them in r3
+static inline void rtPrints(Runtime *rt) {
+  char c;
+  if (rt->r[3] > rt->memSize) {
+      rtException(rt, RT_ERR_OOB_REG, RT_EXC_WARNING, "Indirect address: 0x%04x\n", rt->r[3]);
+      rtException(rt, RT_ERR_NULL_PTR, RT_EXC_WARNING, "Null ptr passed to PRINTS\n");
+      return;
+  }
+  const uint8_t *src = rt->memory + rt->r[3];
+  while ((c = rtLoad16(src)) != '\0') {
+      printf("%c", c);
+      src += 2;
+      rt->r[3]++;
+  }
+}
+
+/*
+ * PC has no translated code. Zeroed memory decodes as NOP, so lanvm slides
+ * to the end of memory and traps there if nothing but zeros follow.
+ * Anything else is code the translator never saw.
+ */
+static inline void rtUntranslated(Runtime *rt) {
+  for (uint32_t addr = rt->pc; addr < rt->memSize; addr++) {
+      if (rt->memory[addr]) {
+          rtException(rt, RT_ERR_PC_OOB, RT_EXC_SEVERE, "No translated code at 0x%04x\n", rt->pc);
+      }
+  }
+  if (rt->pc < rt->memSize) rt->pc = rt->memSize;
+  rtException(rt, RT_ERR_PC_OOB, RT_EXC_SEVERE, "Memory ends at 0x%04x\n", rt->memSize);
+}
+
+#endif
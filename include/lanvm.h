@@ -20,9 +20,6 @@
 #ifndef LANVM_H
 #define LANVM_H
 
-#define VM_VERSION 111
-#define VM_VERSION_STR "1.1.1"
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,24 +28,216 @@
 #include <stdarg.h>
 #include <math.h>
 
+#include <setjmp.h>
+#include <stdatomic.h>
+
 #include "GLFW/glfw3.h"
+#include "liblanvm.h"
+
+// Computed-goto dispatch needs the GNU labels-as-values extension
+#if defined(LANVM_THREADED) && !defined(__GNUC__)
+#undef LANVM_THREADED
+#endif
+
+/*
+ * Word width. lanvm runs 16-bit LanCode. Built with LANVM_WORD32, as
+ * lanvm32, it runs the 32-bit variant of the ISA instead: registers,
+ * addresses and the imm16/addr16 operands are 32 bits wide and memory can
+ * grow to 4 GiB. The VM is written against these types, so both are
+ * compiled from the same sources.
+ */
+#ifdef LANVM_WORD32
+#if defined(LANVM_JIT) || defined(LANVM_GUARDED)
+#error "The JIT and guarded memory need 16-bit words"
+#endif
+typedef uint32_t word_t;
+typedef int32_t sword_t;
+typedef int64_t saddr_t; // Effective address, before the bounds check
+#define WORD_BITS 32
+#define DIRTY_PAGE_SHIFT 16 // VMRESTART restores memory in 64 KiB pages
+#else
+typedef uint16_t word_t;
+typedef int16_t sword_t;
+typedef int32_t saddr_t;
+#define WORD_BITS 16
+#define DIRTY_PAGE_SHIFT 8 // VMRESTART restores memory in 256-byte pages
+#endif
+#define WORD_BYTES (WORD_BITS / 8)
+#define WORD_MAX ((word_t)-1) // Largest memory size
+
+#define DEFAULT_MEMORY_SIZE 1024 // Memory a program gets unless it asks for more, up to WORD_MAX
+#define MEMORY_SLACK WORD_BYTES // Allocated past memSize, a word access at the bound reaches past it
+#define ADDRESS_SPACE (1ULL << WORD_BITS) // All an address can reach, reserved for guarded memory
+#define DIRTY_PAGES (ADDRESS_SPACE >> DIRTY_PAGE_SHIFT)
+#define BANK_SHIFT 12 // Extended memory banks and the windows showing them are 4 KiB
+#define BANK_SIZE (1 << BANK_SHIFT)
+#define BANK_WINDOWS (0x10000 >> BANK_SHIFT) // Window slots, one per 4 KiB of the 16-bit address space
+#define MAX_BANKS 1024 // 4 MiB of extended memory
+#define NO_BANK 0xFFFF // VMBANK bank number that puts memory back in a window
+
+#define MAX_BLOCK_INSNS 64 // Longest decoded basic block
+#define MAX_INSN_SIZE (3 + WORD_BYTES) // opcode, DS, offset and imm16
+#define CODE_PAGE_SHIFT 16 // 32-bit decoded block tables are split in 64 Ki-entry pages
+#define CODE_PAGE (1 << CODE_PAGE_SHIFT)
+#define MAX_RETIRED_BLOCKS 256 // Invalidated blocks kept until the cache is flushed
+
+// ALU instructions with register forms, X(name, C operator)
+#define REG_ALU_OPS(X) X(ADD, +) X(SUB, -) X(AND, &) X(OR, |) X(XOR, ^) X(MUL, *)
+#define REG_ALU_ENUM(name, op) OP_##name##_RR, OP_##name##_RI,
+
+// Handler indices past the opcodes
+enum {
+    OP_END = 0x100, // Block terminator
+    OP_PC_OOB, // Decoded at or past the end of memory, raises ERR_PC_OOB
+    OP_CMP_JZ, // cmp reg, imm16 + jz
+    OP_CMP_JNZ, // cmp reg, imm16 + jnz
+    OP_DEC_JNZ, // dec reg + jnz
+    OP_OR_JZ, // or reg, reg + jz
+    OP_OR_JNZ, // or reg, reg + jnz
+    // Register forms, chosen at decode time when no operand is in memory
+    OP_LD_RR, // ld reg, reg
+    OP_LD_RI, // ld reg, imm16
+    OP_CMP_RR, // cmp reg, reg
+    OP_CMP_RI, // cmp reg, imm16
+    REG_ALU_OPS(REG_ALU_ENUM) // add/sub/and/or/xor/mul reg, reg and reg, imm16
+    OP_NOT_R, // not reg
+    OP_INC_R, // inc reg
+    OP_DEC_R, // dec reg
+    OP_PUSH_R, // push reg
+    OP_POP_R, // pop reg
+    OP_COUNT // Size of the handler table
+};
+
+// Fused idioms, counted in VM.fusions each time one executes
+enum {
+    FUSE_CMP_JCC,
+    FUSE_DEC_JNZ,
+    FUSE_OR_JCC,
+    FUSE_COUNT
+};
+
+// Predecoded instruction, see decode.c
+typedef struct {
+    const void *handler; // Threaded dispatch label of the handler
+    uint16_t op; // Handler index, the opcode for plain instructions
+    uint8_t opcode; // Guest opcode, the first one of a fused pair
+    uint8_t dest, src; // Operand modes from the DS byte
+    int8_t doff, soff; // [bp+off8]/[sp+off8] offsets
+    word_t imm; // imm16/addr16 operand (a word), VMEXIT code or LEA offset
+    word_t target; // Branch target of a fused compare-and-branch
+    word_t next; // Fall-through PC
+} Insn;
+
+struct VM;
+
+// Basic block of predecoded instructions
+typedef struct Block {
+    word_t start, end; // Decoded address range [start, end)
+    uint16_t count; // Decoded records, not counting the terminator
+    uint16_t length; // Guest instructions, a fused pair counts twice
+    bool valid; // Cleared once a store hits the range
+    bool noJit; // Compilation was attempted and gave nothing
+    uint32_t entries; // Times the block was entered, for the JIT
+    void (*native)(struct VM *vm); // Compiled prefix, see jit.c
+    int16_t nativeResume; // First record left to the interpreter, -1 if the native code sets PC
+    struct Block *succ[2]; // Chained successors: branch target, fall-through
+    struct Block *nextAlloc; // Every block ever decoded, freed on flush
+    Insn insns[]; // count instructions followed by an OP_END terminator
+} Block;
 
-#define DEFAULT_MEMORY_SIZE 1024 // Sets the maximum memory size. Maximum memory size is 0xFFFF due to 16-bit registers
-#define DEFAULT_PROGRAM_SIZE 2048
+typedef struct {
+#ifdef LANVM_WORD32
+    Block ***blocks; // As below, in pages of CODE_PAGE entries (see decode.c)
+    uint8_t **refs;
+#else
+    Block **blocks; // Valid blocks by start address
+    uint8_t *refs; // Number of valid blocks covering each address, saturating
+#endif
+    size_t size; // Entries in blocks and refs
+    Block *all;
+    int retiredCount;
+    bool flushPending; // Memory was reallocated, drop everything at the next block boundary
+    Block *current; // Block being executed, to locate a faulting instruction
+    uint64_t decoded, invalidated; // Statistics
+} CodeCache;
+
+#define JIT_THRESHOLD 32 // Block entries before it is compiled
 
-extern bool DEBUG; // Debug mode
-extern bool GRAPHICS; // Graphics mode
+typedef struct {
+    uint8_t *mem; // Executable code cache
+    size_t size, used;
+    bool enabled;
+    uint64_t compiled, rejected; // Statistics
+} Jit;
+
+#define INPUT_WAIT (-2) // inputChar(): nothing has arrived yet
+
+// What a VM waits for, when the last vm_run() returned VM_IO_WAIT
+enum {
+    WAIT_NONE, // The host, e.g. after GLINIT
+    WAIT_INPUT, // Its input descriptor, see input.c
+    WAIT_CHANNEL // A channel's other end, see channel.c
+};
+
+// Input of IN and GETS, see input.c
+typedef struct {
+    int fd; // Read without blocking, -1 for stdin through getchar()
+    uint8_t *buf; // Read from fd and not consumed yet, [start, end)
+    size_t start, end, capacity;
+    bool eof; // fd has nothing more
+} Input;
 
-typedef struct{
+typedef struct VM {
     uint8_t *memory; // RAM
-    uint16_t memSize;
+    word_t memSize;
+    size_t committed; // Guarded memory: accessible bytes from memory on
+    int32_t faultAddress; // Guarded memory: address of the last faulting access
     uint8_t *program; // program
-    uint16_t progSize;
-    uint16_t pc;
-    uint16_t iv; // interrupt vector
-    uint16_t r[5]; // Accumulator, Data, Base, Destination, Source
-    bool flags[8];
-    uint16_t sp, bp;
+    word_t progSize;
+    word_t entry; // Entry point, VMRESTART starts over here
+    word_t baseMemSize; // Memory size the program was loaded with
+    uint8_t *pristine; // Memory as loaded, baseMemSize + MEMORY_SLACK bytes, restored by VMRESTART
+    bool sharedPristine; // pristine belongs to the template of this clone
+    uint8_t *codeSpace; // Harvard mode: codeSize + MEMORY_SLACK bytes of code, NULL when code lives in memory
+    word_t codeSize; // Harvard mode: end of the loaded code, fetching past it traps
+    bool sharedCode; // codeSpace belongs to the template of this clone
+    bool mapped; // memory is a private mapping of a template's image, see memClone()
+    int imageFd; // Memory file clones of this VM map, -1 until the first vm_clone()
+    uint8_t *image; // Shared mapping of imageFd, the memory as of the last vm_clone()
+    word_t imageSize; // memSize when the image was taken
+    uint8_t dirty[DIRTY_PAGES]; // Pages stored to since the load or the last restart
+    uint64_t restarts, restoredPages; // Statistics
+    uintptr_t windowBase[BANK_WINDOWS]; // Per 4 KiB of the address space, host address of guest 0 as seen there
+    uint16_t windowBank[BANK_WINDOWS]; // Bank shown there, NO_BANK for memory
+    uint8_t **banks; // MAX_BANKS extended memory banks, NULL until the first VMBANK
+    uint16_t bankCount; // Banks allocated
+    word_t pc;
+    word_t iv; // interrupt vector
+    union {
+        struct {
+            word_t r[5]; // Accumulator, Data, Base, Destination, Source
+            word_t bp, sp;
+        };
+        word_t regs[7]; // Indexed by register operand mode
+    };
+    uint8_t flags; // FLAGS bits, the condition bits are stale while lazyFlags is set
+    word_t flagResult; // Last ALU result, the condition flags derive from it
+    bool lazyFlags;
+    uint64_t icount; // Retired instructions
+    volatile bool stop; // Set by vm_stop() to leave vm_run()
+    int exception; // Last warning raised during vm_run(), ERR_NO_ERROR if none
+    bool exited; // VMEXIT or a severe exception ended the program, with exitCode
+    int8_t exitCode;
+    jmp_buf *exitJump; // Where vm_exit() leaves the running vm_run()
+    bool harvard; // Load programs in Harvard mode whatever the image says
+    atomic_int schedState; // Where a scheduler has the VM, see sched.c
+    Scheduler *_Atomic sched; // The one it was submitted to, until it finished there
+    uint8_t waiting; // WAIT_*
+    Input input;
+    Channels *channels; // Namespace of VMCHOPEN, NULL if none
+    CodeCache code; // Decoded blocks
+    uint64_t fusions[FUSE_COUNT]; // Executed superinstructions
+    Jit jit;
 
     // Graphics
     int screenWidth, screenHeight;
@@ -68,11 +257,10 @@ void langlExit(VM *vm);
 
 int vm_exception(VM *vm, int code, int severity, char *fmt, ...);
 
-int vm_init(VM *vm, uint8_t *program);
-int vm_restart(VM *vm);
 int vm_load(VM *vm, uint8_t *program);
-int vm_malloc(VM *vm, uint16_t size);
-int hypervisorCall(VM *vm, uint8_t operation, uint16_t operand);
+int vm_malloc(VM *vm, word_t size);
+int hypervisorCall(VM *vm, uint8_t operation, word_t operand);
+#define CALL_WAIT 2 // hypervisorCall(): the guest waits, the instruction runs again
 int vm_exit(VM *vm, int8_t code);
 
 #define EXC_SEVERE 0
@@ -109,7 +297,7 @@ int vm_exit(VM *vm, int8_t code);
     -12 - Graphics error
 */
 
-/*  FLAGS
+/*  FLAGS (bits of VM.flags, as pushed by PUSHF)
     0x01 - Carry
     0x02 - Zero
     0x04 - Overflow
@@ -133,8 +321,15 @@ typedef struct {
     uint8_t srcReg;
 } DSbyte;
 
-void* GetDestination(VM *vm, uint8_t DSb);
-uint16_t GetSource(VM *vm, uint8_t DSb);
+// Resolved operands of a dest, src instruction
+typedef struct {
+    word_t *dest; // NULL after an out of bounds access
+    word_t src;
+} Operands;
+
+void* ResolveDestination(VM *vm, uint8_t mode, int8_t offset);
+word_t ResolveSource(VM *vm, uint8_t mode, int8_t offset);
+Operands ResolveOperands(VM *vm, const Insn *ins);
 DSbyte decodeDS(uint8_t DSb);
 
 #define CARRY_FLAG 0x00
@@ -144,6 +339,27 @@ DSbyte decodeDS(uint8_t DSb);
 #define HALT_FLAG 0x04
 #define IE_FLAG 0x05
 #define IA_FLAG 0x06
+#define FLAG_BIT(f) (1 << (f))
+#define COND_FLAGS (FLAG_BIT(CARRY_FLAG) | FLAG_BIT(ZERO_FLAG) | FLAG_BIT(OVERFLOW_FLAG) | FLAG_BIT(SIGN_FLAG))
+
+// Branch and SET conditions, the first eight in Jcc opcode order
+typedef enum {
+    COND_Z,
+    COND_NZ,
+    COND_C,
+    COND_NC,
+    COND_JLE, // jle: overflow, or sign differs from zero
+    COND_JGE, // jge: always taken
+    COND_L,
+    COND_G, // jg, setg: zero and sign equals overflow
+    COND_LE,
+    COND_GE,
+    COND_BE,
+    COND_A,
+    COND_COUNT
+} Condition;
+
+extern const uint8_t condTable[256][COND_COUNT]; // Condition outcome by FLAGS byte
 
 typedef enum {
     // NOP
@@ -222,6 +438,10 @@ typedef enum {
     VMSTATE,            // vmstate
     VMMALLOC = 0xd5,    // vmmalloc size
     VMFREE = 0xd6,      // vmfree size
+    VMBANK = 0xd7,      // vmbank ; show extended memory bank r0 in the window at r1
+    VMCHOPEN = 0xd8,    // vmchopen ; open the channel named at r0, to receive (r1 = 0) or send, handle in r0
+    VMCHSEND,           // vmchsend ; send r2 bytes at r1 on channel r0
+    VMCHRECV,           // vmchrecv ; receive into the r2 bytes at r1 from channel r0, length in r2
 
     // Graphics
     GLINIT = 0xc0,      // glinit
@@ -253,15 +473,161 @@ typedef enum {
 
 void printState(VM *vm);
 int execute(VM *vm);
-void alu(VM *vm, ALU_OP op, uint16_t *dest, uint16_t src);
+void alu(VM *vm, ALU_OP op, word_t *dest, word_t src);
 void handleSET(VM *vm, uint8_t op, uint8_t DSb);
 
 void push8(VM *vm, uint8_t value);
-void push16(VM *vm, uint16_t value);
+void pushWord(VM *vm, word_t value);
 uint8_t pop8(VM *vm);
-uint16_t pop16(VM *vm);
-
-uint8_t fByte(VM *vm);
-uint16_t fWord(VM *vm);
+word_t popWord(VM *vm);
+
+int memInit(VM *vm, word_t size);
+int memResize(VM *vm, word_t size);
+void memFree(VM *vm);
+int memClone(VM *vm, VM *template);
+uint8_t *memBank(VM *vm, uint16_t bank);
+int memMapBank(VM *vm, uint16_t bank, word_t addr);
+void memUnmapBanks(VM *vm);
+void memFreeBanks(VM *vm);
+int memCloneBanks(VM *vm, const VM *template);
+int memSnapshot(VM *vm);
+int memCodeSpace(VM *vm, word_t size);
+void memFreeCode(VM *vm);
+int memReset(VM *vm);
+#ifdef LANVM_GUARDED
+void memCatchFaults(VM *vm, sigjmp_buf *jump);
+void operandFault(VM *vm, const Insn *ins);
+uint8_t memOperands(const Insn *ins);
+#endif
+
+int codeInit(VM *vm);
+#ifdef LANVM_WORD32
+int codeResize(VM *vm, word_t limit);
+#else
+static inline int codeResize(VM *vm, word_t limit) { // The tables cover the 16-bit address space
+  (void)vm;
+  (void)limit;
+  return 0;
+}
+#endif
+void codeFree(VM *vm);
+void flushCode(VM *vm);
+bool decodeInsn(VM *vm, word_t pc, Insn *ins, const void *const *handlers);
+Block *findBlock(VM *vm, word_t pc);
+Block *getBlock(VM *vm, word_t pc, const void *const *handlers);
+void invalidateCode(VM *vm, word_t addr, uint16_t len);
+
+int chanOpen(VM *vm);
+int chanSend(VM *vm);
+int chanReceive(VM *vm);
+void chanRelease(VM *vm);
+
+int inputChar(VM *vm);
+bool inputLine(VM *vm);
+void inputFree(VM *vm);
+
+int jitInit(VM *vm, size_t size);
+void jitFree(VM *vm);
+void jitFlush(VM *vm);
+void jitCompile(VM *vm, Block *b);
+
+// Decoded blocks covering addr, which is at most MAX_INSN_SIZE past memory
+static inline uint8_t codeRefs(VM *vm, word_t addr) {
+#ifdef LANVM_WORD32
+  return vm->code.refs[addr >> CODE_PAGE_SHIFT][addr & (CODE_PAGE - 1)];
+#else
+  return vm->code.refs[addr];
+#endif
+}
+
+// Store hook for up to a word, marks its pages dirty and drops decoded
+// blocks that cover a written address
+static inline void memWritten(VM *vm, word_t addr, uint16_t len) {
+  word_t last = addr + len - 1;
+  vm->dirty[addr >> DIRTY_PAGE_SHIFT] = vm->dirty[last >> DIRTY_PAGE_SHIFT] = 1;
+  if (codeRefs(vm, addr) | codeRefs(vm, last)) invalidateCode(vm, addr, len);
+}
+
+// Store hook for a pointer from ResolveDestination(), stores into banks hold no code
+static inline void ptrWritten(VM *vm, const void *ptr, uint16_t len) {
+  uintptr_t addr = (uintptr_t)ptr - (uintptr_t)vm->memory;
+  if (addr <= vm->memSize) memWritten(vm, addr, len);
+}
+
+// Host address of a data byte, in the bank shown at addr if there is one.
+// Instructions are always fetched from memory. 32-bit words have no banks.
+static inline uint8_t *memAt(VM *vm, word_t addr) {
+#ifdef LANVM_WORD32
+  return vm->memory + addr;
+#else
+  return (uint8_t *)(vm->windowBase[addr >> BANK_SHIFT] + addr);
+#endif
+}
+
+// Memory operands are little-endian words, stores go through word_t
+// pointers and so assume a little-endian host. A word is found by its first
+// byte, one starting at the end of a window reaches the bank's slack.
+static inline word_t memWord(VM *vm, word_t addr) {
+  word_t value;
+  memcpy(&value, memAt(vm, addr), sizeof(value));
+  return value;
+}
+
+// Where instructions are fetched from: the code space in Harvard mode, otherwise memory
+static inline const uint8_t *codeBase(VM *vm) {
+  return vm->codeSpace ? vm->codeSpace : vm->memory;
+}
+
+// Address instruction fetch traps at
+static inline word_t codeLimit(VM *vm) {
+  return vm->codeSpace ? vm->codeSize : vm->memSize;
+}
+
+// Instruction fetch, inlined into the dispatch loop
+static inline uint8_t fByte(VM *vm) {
+  return codeBase(vm)[vm->pc++];
+}
+
+static inline word_t fWord(VM *vm) {
+  word_t temp;
+  memcpy(&temp, codeBase(vm) + vm->pc, sizeof(temp));
+  vm->pc += WORD_BYTES;
+  return temp;
+}
+
+/*
+ * Lazy condition flags. ALU instructions only record their result, ZERO,
+ * OVERFLOW, SIGN and CARRY are derived from it when a Jcc, SETcc or PUSHF
+ * reads them: zero for a zero result, overflow from the top bit, sign and carry
+ * always clear.
+ */
+static inline void modifyFlags(VM *vm, word_t result) {
+  vm->flagResult = result;
+  vm->lazyFlags = true;
+}
+
+// Current FLAGS byte, with pending condition flags filled in
+static inline uint8_t flagByte(VM *vm) {
+  if (!vm->lazyFlags) return vm->flags;
+  return (vm->flags & ~COND_FLAGS) | (vm->flagResult == 0) << ZERO_FLAG | (vm->flagResult >> (WORD_BITS - 1)) << OVERFLOW_FLAG;
+}
+
+static inline bool getFlag(VM *vm, int flag) {
+  return flagByte(vm) & FLAG_BIT(flag);
+}
+
+static inline bool testCond(VM *vm, Condition cond) {
+  return condTable[flagByte(vm)][cond];
+}
+
+// Store pending condition flags into VM.flags before they are partly written
+static inline void syncFlags(VM *vm) {
+  vm->flags = flagByte(vm);
+  vm->lazyFlags = false;
+}
+
+static inline void setFlag(VM *vm, int flag, bool value) {
+  vm->flags = (vm->flags & ~FLAG_BIT(flag)) | value << flag;
+}
 
 #endif
\ No newline at end of file
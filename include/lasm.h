@@ -22,8 +22,8 @@
 
 #define MAX_LABELS 256
 
-#define LASM_VERSION 102
-#define LASM_VERSION_STR "1.0.2"
+#define LASM_VERSION 110
+#define LASM_VERSION_STR "1.1.0"
 
 // Instruction table
 typedef struct {
@@ -34,7 +34,7 @@ typedef struct {
 
 typedef struct {
     char name[32];
-    uint16_t address;
+    uint32_t address;
 } Label;
 
 #endif
\ No newline at end of file
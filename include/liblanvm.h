@@ -0,0 +1,155 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef LIBLANVM_H
+#define LIBLANVM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VM_VERSION 111
+#define VM_VERSION_STR "1.1.1"
+
+/*
+ * liblanvm, the VM as a library. Every VM is an instance of its own, so a
+ * process can run any number of them, one thread per VM at a time. Nothing
+ * in the library exits the process: VMEXIT and severe exceptions end the
+ * run with VM_EXITED and an exit code, and loading reports failures by its
+ * return value. Programs still do their I/O on the process's stdin and
+ * stdout, and exceptions are reported there.
+ *
+ *     VM *vm = vm_create(NULL);
+ *     if (!vm || vm_load_image(vm, image, size)) ...
+ *     while (vm_run(vm, VM_UNLIMITED) == VM_EXCEPTION) {} // Warnings, keep going
+ *     int code = vm_exit_code(vm);
+ *     vm_destroy(vm);
+ *
+ * liblanvm32 is the same library for 32-bit LanCode.
+ */
+
+typedef struct VM VM;
+
+// Options of vm_create(), zeroed for the defaults
+typedef struct {
+    bool harvard; // Load programs with code in its own address space
+    size_t jitCache; // Bytes of native code to cache, 0 runs everything in the interpreter
+} VMConfig;
+
+// Why vm_run() returned
+typedef enum {
+    VM_HALTED, // HLT
+    VM_BUDGET, // Instruction budget exhausted
+    VM_EXCEPTION, // A warning was raised and reported, the VM can carry on
+    VM_IO_WAIT, // The program needs the host, e.g. GLINIT opened a window or IN waits for input
+    VM_STOPPED, // vm_stop() was called
+    VM_EXITED // VMEXIT or a severe exception, see vm_exit_code()
+} VMStop;
+
+#define VM_UNLIMITED UINT64_MAX // Budget for running until some other stop
+
+VM *vm_create(const VMConfig *config);
+VM *vm_clone(VM *template);
+void vm_destroy(VM *vm);
+int vm_load_image(VM *vm, const uint8_t *data, size_t size);
+int vm_load_file(VM *vm, const char *filename);
+int vm_snapshot(VM *vm, const char *filename);
+int vm_restore(VM *vm, const char *filename);
+int vm_restart(VM *vm);
+VMStop vm_run(VM *vm, uint64_t max);
+void vm_stop(VM *vm);
+int vm_exit_code(const VM *vm);
+int vm_set_input(VM *vm, int fd);
+uint32_t vm_get_register(const VM *vm, int reg);
+void vm_set_register(VM *vm, int reg, uint32_t value);
+uint8_t vm_get_flags(const VM *vm);
+uint64_t vm_instructions(const VM *vm);
+int vm_word_bits(void);
+void vm_print_state(VM *vm);
+
+// Counters of vm_get_stats()
+typedef struct {
+    uint32_t programBytes; // Loaded program, code and data
+    uint64_t instructions; // Retired, as vm_instructions()
+    uint64_t blocksDecoded, blocksInvalidated;
+    uint64_t fusedCmpJcc, fusedDecJnz, fusedOrJcc; // Superinstructions executed
+    uint64_t restarts, restoredPages; // VMRESTART, and the pages it copied back
+    unsigned banks; // Extended memory banks allocated
+    bool jit; // Hot blocks are compiled, the counters below are kept
+    uint64_t jitCompiled, jitRejected;
+    size_t jitBytes; // Native code in the cache
+} VMStats;
+
+void vm_get_stats(const VM *vm, VMStats *stats);
+
+/*
+ * Graphics. After GLINIT the program draws into a framebuffer, which the
+ * host shows with vm_present() between runs, on the thread that ran GLINIT.
+ */
+bool vm_has_window(const VM *vm);
+bool vm_present(VM *vm);
+
+/*
+ * Channels, named message queues between the VMs of a process. VMs given
+ * the same Channels open a channel by name with VMCHOPEN, one of them as
+ * its sender and one as its receiver, and pass blocks of memory over it
+ * with VMCHSEND and VMCHRECV. Each channel is a bounded ring the two ends
+ * share without locks. A guest that finds it full or empty waits, parked
+ * if it runs on a scheduler, until the other end wakes it. Destroy the
+ * VMs before their Channels.
+ */
+typedef struct Channels Channels;
+
+Channels *vm_channels_create(void);
+void vm_channels_destroy(Channels *channels);
+void vm_set_channels(VM *vm, Channels *channels);
+
+/*
+ * Lockstep, for many VMs running the same program on different inputs,
+ * typically clones given their inputs with vm_set_register(). Lanes at the
+ * same PC run register-only code together, in SIMD registers where the CPU
+ * has them, and end as they would have running alone.
+ */
+int vm_run_lockstep(VM **vms, int count, uint64_t max, VMStop *stops);
+
+/*
+ * Scheduler, a pool of worker threads that runs any number of guest VMs,
+ * each for a quantum of instructions at a time. Guests that wait for I/O
+ * (VM_IO_WAIT) are parked until sched_wake(). The callbacks run on the
+ * worker threads. On Linux guests waiting for input from vm_set_input()
+ * are parked by the scheduler itself, and woken once their descriptor is
+ * readable.
+ */
+typedef struct Scheduler Scheduler;
+
+typedef struct {
+    int workers; // Threads, 0 for one per core
+    uint64_t quantum; // Instructions per turn, 0 for the default
+    void (*parked)(Scheduler *s, VM *vm, void *user); // VM_IO_WAIT guests not waiting on a channel or input it watches, NULL queues them again at once
+    void (*finished)(Scheduler *s, VM *vm, VMStop stop, void *user); // vm is the host's again
+    void *user;
+} SchedConfig;
+
+Scheduler *sched_create(const SchedConfig *config);
+int sched_submit(Scheduler *s, VM *vm);
+void sched_wake(Scheduler *s, VM *vm);
+void sched_wait(Scheduler *s);
+void sched_destroy(Scheduler *s);
+
+#endif
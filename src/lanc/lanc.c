@@ -0,0 +1,669 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../include/lanc.h"
+#include "../include/lanvm.h"
+#include "../include/lanimg.h"
+
+/*
+ * Ahead-of-time translator from assembled LanCode to C. The code reachable
+ * from the entry point is found by following every branch, call and fall-through,
+ * then each instruction becomes a labelled run of C that works on locals
+ * for the guest registers and flags. Direct branches are plain gotos, RET,
+ * RETI and INT go through a switch over every translated instruction. The
+ * result includes lanrt.h for everything that needs the VM state: stack
+ * checks, exceptions, printState and the hypervisor calls.
+ *
+ * Programs must not modify their own code, the runtime stops them when a
+ * store reaches a translated instruction. Graphics, extended memory
+ * (VMBANK), channels, Harvard mode and 32-bit images are not supported.
+ */
+
+static const Opcode opcodes[256] = {
+    [NOP] = {"NOP", FMT_NONE},
+    [LD_dest_src] = {"LD", FMT_DEST_SRC}, [LD_dest_imm16] = {"LD", FMT_DEST_IMM16},
+    [PUSH_src] = {"PUSH", FMT_SRC}, [PUSH_imm16] = {"PUSH", FMT_IMM16}, [POP_dest] = {"POP", FMT_DEST},
+    [ADD_dest_src] = {"ADD", FMT_DEST_SRC}, [ADD_dest_imm16] = {"ADD", FMT_DEST_IMM16},
+    [SUB_dest_src] = {"SUB", FMT_DEST_SRC}, [SUB_dest_imm16] = {"SUB", FMT_DEST_IMM16},
+    [AND_dest_src] = {"AND", FMT_DEST_SRC}, [AND_dest_imm16] = {"AND", FMT_DEST_IMM16},
+    [OR_dest_src] = {"OR", FMT_DEST_SRC}, [OR_dest_imm16] = {"OR", FMT_DEST_IMM16},
+    [XOR_dest_src] = {"XOR", FMT_DEST_SRC}, [XOR_dest_imm16] = {"XOR", FMT_DEST_IMM16},
+    [CMP_dest_src] = {"CMP", FMT_DEST_SRC}, [CMP_dest_imm16] = {"CMP", FMT_DEST_IMM16},
+    [MUL_dest_src] = {"MUL", FMT_DEST_SRC}, [MUL_dest_imm16] = {"MUL", FMT_DEST_IMM16},
+    [DIV_dest_src] = {"DIV", FMT_DEST_SRC}, [DIV_dest_imm16] = {"DIV", FMT_DEST_IMM16},
+    [NOT_dest] = {"NOT", FMT_DEST}, [INC_dest] = {"INC", FMT_DEST}, [DEC_dest] = {"DEC", FMT_DEST},
+    [JMP_addr16] = {"JMP", FMT_IMM16}, [JZ_addr16] = {"JZ", FMT_IMM16}, [JNZ_addr16] = {"JNZ", FMT_IMM16},
+    [JC_addr16] = {"JC", FMT_IMM16}, [JNC_addr16] = {"JNC", FMT_IMM16}, [JLE_addr16] = {"JLE", FMT_IMM16},
+    [JGE_addr16] = {"JGE", FMT_IMM16}, [JL_addr16] = {"JL", FMT_IMM16}, [JG_addr16] = {"JG", FMT_IMM16},
+    [CALL_addr16] = {"CALL", FMT_IMM16}, [RET] = {"RET", FMT_NONE}, [RETI] = {"RETI", FMT_NONE},
+    [INT] = {"INT", FMT_NONE}, [EI] = {"EI", FMT_NONE}, [DI] = {"DI", FMT_NONE}, [CHK_INT] = {"CHK", FMT_NONE},
+    [PUSHF] = {"PUSHF", FMT_NONE}, [POPF] = {"POPF", FMT_NONE},
+    [SETZ_dest] = {"SETZ", FMT_NONE}, [SETNZ_dest] = {"SETNZ", FMT_NONE}, // SETcc has no DS byte, it always targets r0
+    [SETL_dest] = {"SETL", FMT_NONE}, [SETLE_dest] = {"SETLE", FMT_NONE}, [SETG_dest] = {"SETG", FMT_NONE},
+    [SETGE_dest] = {"SETGE", FMT_NONE}, [SETB_dest] = {"SETB", FMT_NONE}, [SETBE_dest] = {"SETBE", FMT_NONE},
+    [SETA_dest] = {"SETA", FMT_NONE}, [SETAE_dest] = {"SETAE", FMT_NONE},
+    [IN_dest] = {"IN", FMT_DEST}, [OUT_src] = {"OUT", FMT_SRC}, [GETS_r4] = {"GETS", FMT_NONE},
+    [PRINTS_r3] = {"PRINTS", FMT_NONE},
+    [VMEXIT] = {"VMEXIT", FMT_IMM8}, [VMRESTART] = {"VMRESTART", FMT_NONE},
+    [VMGETMEMSIZE] = {"VMGETMEMSIZE", FMT_NONE}, [VMSTATE] = {"VMSTATE", FMT_NONE},
+    [VMMALLOC] = {"VMMALLOC", FMT_IMM16}, [VMFREE] = {"VMFREE", FMT_IMM16}, [VMBANK] = {"VMBANK", FMT_NONE},
+    [VMCHOPEN] = {"VMCHOPEN", FMT_NONE}, [VMCHSEND] = {"VMCHSEND", FMT_NONE}, [VMCHRECV] = {"VMCHRECV", FMT_NONE},
+    [GLINIT] = {"GLINIT", FMT_NONE}, [GLCLEAR] = {"GLCLEAR", FMT_NONE}, [GLSETCOLOR] = {"GLSETCOLOR", FMT_NONE},
+    [GLPLOT] = {"GLPLOT", FMT_NONE}, [GLRECT] = {"GLRECT", FMT_NONE}, [GLLINE] = {"GLLINE", FMT_NONE},
+    [LEA_dest_bpoff] = {"LEA", FMT_DEST_IMM8}, [LIV_addr16] = {"LIV", FMT_IMM16}, [HALT] = {"HLT", FMT_NONE}
+};
+
+static const char *regNames[7] = {"r0", "r1", "r2", "r3", "r4", "bp", "sp"};
+
+uint8_t image[ADDRESS_SPACE];
+uint16_t imageSize = 0;
+uint16_t entry = 0;
+uint16_t memSize = DEFAULT_MEMORY_SIZE;
+
+Op ops[ADDRESS_SPACE]; // Decoded instructions by address
+bool decoded[ADDRESS_SPACE];
+bool queued[ADDRESS_SPACE];
+bool labelled[ADDRESS_SPACE]; // Target of a goto
+uint8_t codeMap[ADDRESS_SPACE]; // Bytes of decoded instructions
+
+uint16_t worklist[ADDRESS_SPACE];
+int worklistSize = 0;
+
+// Temporaries and labels the translation used, only those get declared
+bool usesA, usesB, usesS, usesV, usesDispatch, usesStopped;
+const char *indent = "  ";
+
+// Memory past the image is zeroed when the VM loads a program
+uint8_t byteAt(uint16_t addr) {
+    return addr < imageSize ? image[addr] : 0;
+}
+
+void decode(uint16_t pc, Op *op) {
+    uint8_t fmt = opcodes[byteAt(pc)].format;
+    memset(op, 0, sizeof(*op));
+    op->opcode = byteAt(pc++);
+
+    if (fmt == FMT_DEST || fmt == FMT_SRC || fmt == FMT_DEST_SRC || fmt == FMT_DEST_IMM16 || fmt == FMT_DEST_IMM8) {
+        DSbyte DS = decodeDS(byteAt(pc++));
+        op->dest = DS.destReg;
+        op->src = DS.srcReg;
+        if (fmt != FMT_SRC && (op->dest == 7 || op->dest == 8)) op->doff = byteAt(pc++);
+        if ((fmt == FMT_SRC || fmt == FMT_DEST_SRC) && (op->src == 7 || op->src == 8)) op->soff = byteAt(pc++);
+    }
+    if (fmt == FMT_DEST_IMM16 || fmt == FMT_IMM16) {
+        op->imm = byteAt(pc) | byteAt(pc + 1) << 8;
+        pc += 2;
+    } else if (fmt == FMT_DEST_IMM8 || fmt == FMT_IMM8) {
+        op->imm = byteAt(pc++);
+    }
+    op->next = pc;
+}
+
+// Same as ds.c
+DSbyte decodeDS(uint8_t DSb) {
+    DSbyte DS;
+    DS.destReg = (DSb & 0xF0) >> 4;
+    DS.srcReg = DSb & 0x0F;
+    return DS;
+}
+
+void enqueue(uint16_t addr) {
+    if (addr < imageSize && !queued[addr]) {
+        queued[addr] = true;
+        worklist[worklistSize++] = addr;
+    }
+}
+
+// Instructions that never continue at the next address
+bool endsFlow(uint8_t opcode) {
+    return opcode == JMP_addr16 || opcode == JGE_addr16 || opcode == RET || opcode == RETI ||
+        opcode == HALT || opcode == VMEXIT || opcode == VMRESTART;
+}
+
+// Find the reachable code, returns the number of instructions or -1
+int analyse(void) {
+    int count = 0;
+    enqueue(entry);
+    while (worklistSize > 0) {
+        uint16_t pc = worklist[--worklistSize];
+        Op *op = &ops[pc];
+        decode(pc, op);
+        decoded[pc] = true;
+        count++;
+        for (uint16_t a = pc; a < op->next && a < imageSize; a++) codeMap[a] = 1;
+
+        if (op->opcode >= GLINIT && op->opcode <= GLLINE) {
+            fprintf(stderr, "0x%04x: %s, graphics are not supported\n", pc, opcodes[op->opcode].mnemonic);
+            return -1;
+        }
+        if (op->opcode == VMBANK) {
+            fprintf(stderr, "0x%04x: VMBANK, extended memory is not supported\n", pc);
+            return -1;
+        }
+        if (op->opcode >= VMCHOPEN && op->opcode <= VMCHRECV) {
+            fprintf(stderr, "0x%04x: %s, channels are not supported\n", pc, opcodes[op->opcode].mnemonic);
+            return -1;
+        }
+        if (op->opcode >= JMP_addr16 && op->opcode <= CALL_addr16) enqueue(op->imm);
+        if (op->opcode == LIV_addr16) enqueue(op->imm); // Interrupt handler
+        if (!endsFlow(op->opcode)) enqueue(op->next);
+    }
+    return count;
+}
+
+// Address of the next instruction written after pc
+int nextDecoded(uint16_t pc) {
+    for (int a = pc + 1; a < imageSize; a++) {
+        if (decoded[a]) return a;
+    }
+    return -1;
+}
+
+void operandName(char *buf, uint8_t mode, int8_t off) {
+    if (mode < 7) strcpy(buf, regNames[mode]);
+    else if (mode == 7) sprintf(buf, "[bp%+d]", off);
+    else if (mode == 8) sprintf(buf, "[sp%+d]", off);
+    else if (mode == 9) strcpy(buf, "[r3]");
+    else if (mode == 10) strcpy(buf, "[r4]");
+    else strcpy(buf, "[0]");
+}
+
+void disassemble(char *buf, const Op *op) {
+    const Opcode *info = &opcodes[op->opcode];
+    char dest[16], src[16];
+    operandName(dest, op->dest, op->doff);
+    operandName(src, op->src, op->soff);
+    switch (info->format) {
+        case FMT_DEST: sprintf(buf, "%s %s", info->mnemonic, dest); break;
+        case FMT_SRC: sprintf(buf, "%s %s", info->mnemonic, src); break;
+        case FMT_DEST_SRC: sprintf(buf, "%s %s, %s", info->mnemonic, dest, src); break;
+        case FMT_DEST_IMM16:
+        case FMT_DEST_IMM8: sprintf(buf, "%s %s, %u", info->mnemonic, dest, op->imm); break;
+        case FMT_IMM16: sprintf(buf, "%s 0x%04x", info->mnemonic, op->imm); break;
+        case FMT_IMM8: sprintf(buf, "%s %u", info->mnemonic, op->imm); break;
+        case FMT_NONE: strcpy(buf, info->mnemonic); break;
+        default: sprintf(buf, "DB 0x%02x", op->opcode); break;
+    }
+}
+
+// Transfer control to a constant address
+void emitJump(FILE *out, uint16_t target) {
+    if (target < imageSize && decoded[target]) {
+        fprintf(out, "goto L_%04x;\n", target);
+        labelled[target] = true;
+    } else {
+        fprintf(out, "{ pc = 0x%04x; goto dispatch; }\n", target);
+        usesDispatch = true;
+    }
+}
+
+// Effective address of a memory operand into a, or -1 if it was out of bounds
+void emitAddress(FILE *out, const char *var, uint8_t mode, int8_t off, uint16_t at) {
+    if (mode == 7 || mode == 8) fprintf(out, "%s%s = RT_OFF(%s, %d, 0x%04x);\n", indent, var, mode == 7 ? "bp" : "sp", off, at);
+    else if (mode == 9 || mode == 10) fprintf(out, "%s%s = RT_IND(%s, 0x%04x);\n", indent, var, mode == 9 ? "r3" : "r4", at);
+    else fprintf(out, "%s%s = 0;\n", indent, var); // Modes past [r4] address byte 0
+}
+
+// Expression for a source operand, memory sources read a 16-bit word
+const char *emitSource(FILE *out, uint8_t mode, int8_t off, uint16_t at) {
+    if (mode < 7) return regNames[mode];
+    emitAddress(out, "b", mode, off, at);
+    fprintf(out, "%ss = b >= 0 ? rtLoad16(mem + b) : 0;\n", indent);
+    usesB = usesS = true;
+    return "s";
+}
+
+// Resolve a memory destination into a and open the branch taken when it is valid
+void emitDestination(FILE *out, const Op *op, uint16_t at, const char *what) {
+    emitAddress(out, "a", op->dest, op->doff, at);
+    fprintf(out, "  if (a < 0) RT_WARN(0x%04x, RT_ERR_NULL_PTR, \"%s\\n\");\n", at, what);
+    usesA = true;
+}
+
+void emitALU(FILE *out, const Op *op, uint16_t at) {
+    static const char *operators[] = {"+", "-", "&", "|", "^", NULL, "*", "/"};
+    bool imm = (op->opcode - ADD_dest_src) & 1;
+    uint8_t base = op->opcode - imm;
+    const char *operator = operators[(base - ADD_dest_src) / 2];
+    char immText[8];
+    const char *src;
+    bool memory = op->dest >= 7;
+
+    if (memory) {
+        emitAddress(out, "a", op->dest, op->doff, at);
+        usesA = true;
+    }
+    if (imm) {
+        sprintf(immText, "0x%04x", op->imm);
+        src = immText;
+    } else {
+        src = emitSource(out, op->src, op->soff, at);
+    }
+    if (base == DIV_dest_src && strcmp(src, "s")) {
+        fprintf(out, "  s = %s;\n", src);
+        usesS = true;
+        src = "s";
+    }
+
+    if (!memory) {
+        const char *d = regNames[op->dest];
+        if (base == CMP_dest_src) {
+            fprintf(out, "  v = %s - %s;\n  RT_FLAGS(v);\n", d, src);
+            usesV = true;
+        } else if (base == DIV_dest_src) {
+            fprintf(out, "  if (s == 0) RT_WARN(0x%04x, RT_ERR_DBZ, NULL);\n", at);
+            fprintf(out, "  else { %s /= s; RT_FLAGS(%s); }\n", d, d);
+        } else if (base == MUL_dest_src) { // uint16_t operands promote to int, multiply unsigned
+            fprintf(out, "  %s = (unsigned)%s * %s;\n  RT_FLAGS(%s);\n", d, d, src, d);
+        } else {
+            fprintf(out, "  %s %s= %s;\n  RT_FLAGS(%s);\n", d, operator, src, d);
+        }
+        return;
+    }
+
+    usesV = true;
+    fprintf(out, "  if (a < 0) RT_WARN(0x%04x, RT_ERR_NULL_PTR, \"Null pointer passed to ALU\\n\");\n", at);
+    if (base == CMP_dest_src) {
+        fprintf(out, "  else { v = rtLoad16(mem + a) - %s; RT_FLAGS(v); }\n", src);
+    } else {
+        if (base == DIV_dest_src) fprintf(out, "  else if (s == 0) RT_WARN(0x%04x, RT_ERR_DBZ, NULL);\n", at);
+        fprintf(out, "  else { v = %srtLoad16(mem + a) %s %s; RT_STORE(a, v, 0x%04x); RT_FLAGS(v); }\n",
+            base == MUL_dest_src ? "(unsigned)" : "", operator, src, at);
+    }
+}
+
+// NOT, INC and DEC
+void emitUnary(FILE *out, const Op *op, uint16_t at) {
+    const char *expr = op->opcode == NOT_dest ? "~%s" : op->opcode == INC_dest ? "%s + 1" : "%s - 1";
+    if (op->dest < 7) {
+        const char *d = regNames[op->dest];
+        fprintf(out, "  %s = ", d);
+        fprintf(out, expr, d);
+        fprintf(out, ";\n  RT_FLAGS(%s);\n", d);
+        return;
+    }
+    emitAddress(out, "a", op->dest, op->doff, at);
+    fprintf(out, "  if (a < 0) RT_WARN(0x%04x, RT_ERR_NULL_PTR, \"Null pointer passed to ALU\\n\");\n", at);
+    fprintf(out, "  else { v = ");
+    fprintf(out, expr, "rtLoad16(mem + a)");
+    fprintf(out, "; RT_STORE(a, v, 0x%04x); RT_FLAGS(v); }\n", at);
+    usesA = usesV = true;
+}
+
+// Store value into the destination of op, skipping it with a warning if the operand is out of bounds
+void emitStore(FILE *out, const Op *op, uint16_t at, const char *value, const char *what) {
+    if (op->dest < 7) {
+        fprintf(out, "  %s = %s;\n", regNames[op->dest], value);
+        return;
+    }
+    emitDestination(out, op, at, what);
+    fprintf(out, "  else RT_STORE(a, %s, 0x%04x);\n", value, at);
+}
+
+static const char *conditions[] = {
+    [JZ_addr16] = "fZ", [JNZ_addr16] = "!fZ", [JC_addr16] = "fC", [JNC_addr16] = "!fC",
+    [JLE_addr16] = "fO || fS != fZ", [JL_addr16] = "fS != fO", [JG_addr16] = "fZ && fS == fO",
+    [SETZ_dest] = "fZ", [SETNZ_dest] = "!fZ", [SETL_dest] = "fS != fO", [SETLE_dest] = "fZ || fS != fO",
+    [SETG_dest] = "fZ && fS == fO", [SETGE_dest] = "fS == fO", [SETB_dest] = "fC", [SETBE_dest] = "fC || fZ",
+    [SETA_dest] = "!fC && !fZ", [SETAE_dest] = "!fC"
+};
+
+void emitInsn(FILE *out, uint16_t pc) {
+    const Op *op = &ops[pc];
+    uint16_t at = op->next; // PC seen by exceptions and printState, as in lanvm
+    char text[48];
+    const char *src;
+
+    disassemble(text, op);
+    if (labelled[pc]) fprintf(out, "L_%04x: ", pc);
+    fprintf(out, "// 0x%04x %s\n", pc, text);
+
+    switch (op->opcode) {
+        case LD_dest_src:
+            if (op->dest < 7) {
+                src = emitSource(out, op->src, op->soff, at);
+                fprintf(out, "  %s = %s;\n", regNames[op->dest], src);
+                break;
+            }
+            // The source is only read once the destination is known to be valid
+            emitDestination(out, op, at, "Null ptr passed to LD");
+            if (op->src < 7) {
+                fprintf(out, "  else RT_STORE(a, %s, 0x%04x);\n", regNames[op->src], at);
+                break;
+            }
+            fprintf(out, "  else {\n");
+            indent = "      ";
+            src = emitSource(out, op->src, op->soff, at);
+            indent = "  ";
+            fprintf(out, "      RT_STORE(a, %s, 0x%04x);\n  }\n", src, at);
+            break;
+        case LD_dest_imm16:
+            sprintf(text, "0x%04x", op->imm);
+            emitStore(out, op, at, text, "Null ptr passed to LD");
+            break;
+        case PUSH_src:
+            src = emitSource(out, op->src, op->soff, at);
+            fprintf(out, "  RT_PUSH16(%s, 0x%04x);\n", src, at);
+            break;
+        case PUSH_imm16:
+            fprintf(out, "  RT_PUSH16(0x%04x, 0x%04x);\n", op->imm, at);
+            break;
+        case POP_dest:
+            if (op->dest < 7) {
+                fprintf(out, "  RT_POP16(%s, 0x%04x);\n", regNames[op->dest], at);
+                break;
+            }
+            emitDestination(out, op, at, "Null ptr passed to POP");
+            fprintf(out, "  else { RT_POP16(v, 0x%04x); RT_STORE(a, v, 0x%04x); }\n", at, at);
+            usesV = true;
+            break;
+
+        case ADD_dest_src ... DIV_dest_imm16:
+            emitALU(out, op, at);
+            break;
+        case NOT_dest:
+        case INC_dest:
+        case DEC_dest:
+            emitUnary(out, op, at);
+            break;
+
+        case JMP_addr16:
+        case JGE_addr16: // Always taken in lanvm
+            fprintf(out, "  ");
+            emitJump(out, op->imm);
+            break;
+        case JZ_addr16 ... JNC_addr16:
+        case JLE_addr16:
+        case JL_addr16:
+        case JG_addr16:
+            fprintf(out, "  if (%s) ", conditions[op->opcode]);
+            emitJump(out, op->imm);
+            break;
+        case CALL_addr16:
+            fprintf(out, "  RT_PUSH16(0x%04x, 0x%04x);\n  ", at, at);
+            emitJump(out, op->imm);
+            break;
+        case RET:
+        case RETI:
+            fprintf(out, "  RT_POP16(pc, 0x%04x);\n", at);
+            if (op->opcode == RETI) fprintf(out, "  fIA = 0;\n");
+            fprintf(out, "  goto dispatch;\n");
+            usesDispatch = true;
+            break;
+        case INT:
+            fprintf(out, "  if (fIE) { RT_PUSH16(0x%04x, 0x%04x); pc = iv; fIA = 1; goto dispatch; }\n", at, at);
+            usesDispatch = true;
+            break;
+        case EI:
+            fprintf(out, "  fIE = 1;\n");
+            break;
+        case DI:
+            fprintf(out, "  fIE = 0;\n");
+            break;
+        case CHK_INT:
+            fprintf(out, "  fZ = !fIA;\n");
+            break;
+        case PUSHF:
+            fprintf(out, "  RT_PUSH8(fZ << RT_ZERO | fC << RT_CARRY | fO << RT_OVERFLOW | fS << RT_SIGN | "
+                "fH << RT_HALT | fIA << RT_IA | fIE << RT_IE, 0x%04x);\n", at);
+            break;
+        case POPF:
+            fprintf(out, "  RT_POP8(v, 0x%04x);\n", at);
+            fprintf(out, "  fZ = v & 1 << RT_ZERO; fC = v & 1 << RT_CARRY; fO = v & 1 << RT_OVERFLOW; fS = v & 1 << RT_SIGN;\n");
+            fprintf(out, "  fH = v & 1 << RT_HALT; fIA = v & 1 << RT_IA; fIE = v & 1 << RT_IE; f7 = v & 1 << 7;\n");
+            fprintf(out, "  if (fH) { pc = 0x%04x; goto stopped; }\n", at);
+            usesV = usesStopped = true;
+            break;
+        case SETZ_dest ... SETAE_dest:
+            fprintf(out, "  r0 = %s;\n", conditions[op->opcode]);
+            break;
+
+        case IN_dest:
+            emitStore(out, op, at, "(uint16_t)getchar()", "Null ptr passed to IN");
+            break;
+        case OUT_src:
+            src = emitSource(out, op->src, op->soff, at);
+            fprintf(out, "  putchar((unsigned char)%s);\n", src);
+            break;
+        case GETS_r4:
+        case PRINTS_r3:
+            fprintf(out, "  RT_SAVE(0x%04x);\n  %s(&rt);\n  RT_LOAD();\n", at, op->opcode == GETS_r4 ? "rtGets" : "rtPrints");
+            break;
+
+        case VMEXIT:
+            fprintf(out, "  RT_SAVE(0x%04x);\n  rtExit(&rt, (int8_t)%u);\n", at, op->imm);
+            break;
+        case VMRESTART:
+            fprintf(out, "  RT_SAVE(0x%04x);\n", at);
+            fprintf(out, "  rtRestart(&rt);\n");
+            fprintf(out, "  RT_LOAD();\n  ");
+            emitJump(out, entry);
+            break;
+        case VMGETMEMSIZE:
+            fprintf(out, "  r0 = memSize;\n");
+            break;
+        case VMSTATE:
+            fprintf(out, "  RT_SAVE(0x%04x);\n  rtPrintState(&rt);\n", at);
+            break;
+        case VMMALLOC:
+        case VMFREE:
+            fprintf(out, "  RT_SAVE(0x%04x);\n  v = %s(&rt, 0x%04x);\n  RT_LOAD();\n  fZ = v;\n",
+                at, op->opcode == VMMALLOC ? "rtMalloc" : "rtFree", op->imm);
+            usesV = true;
+            break;
+
+        case LEA_dest_bpoff:
+            sprintf(text, "bp + %u", op->imm);
+            emitStore(out, op, at, text, "Null ptr passed to LEA");
+            break;
+        case LIV_addr16:
+            fprintf(out, "  iv = 0x%04x;\n", op->imm);
+            break;
+        case NOP:
+            break;
+        case HALT:
+            fprintf(out, "  fH = 1;\n  pc = 0x%04x;\n  goto stopped;\n", at);
+            usesStopped = true;
+            break;
+        default:
+            fprintf(out, "  RT_WARN(0x%04x, RT_ERR_INVALID_OPCODE, \"Opcode: 0x%%02x\\n\", 0x%02x);\n", at, op->opcode);
+            break;
+    }
+
+    // Fall through to the next instruction, jumping if it isn't the next one written
+    if (!endsFlow(op->opcode) && nextDecoded(pc) != op->next) {
+        fprintf(out, "  ");
+        emitJump(out, op->next);
+    }
+}
+
+void emitBytes(FILE *out, const char *name, const uint8_t *bytes) {
+    fprintf(out, "static const uint8_t %s[RT_IMAGE_SIZE + 1] = {", name);
+    for (int i = 0; i < imageSize; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n    ", bytes[i]);
+    }
+    fprintf(out, "\n    0\n};\n\n");
+}
+
+void emitBody(FILE *out) {
+    if (entry != 0) { // Translations run from the top, start at the entry point
+        fprintf(out, "%s", indent);
+        emitJump(out, entry);
+    }
+    for (int pc = 0; pc < imageSize; pc++) {
+        if (decoded[pc]) emitInsn(out, pc);
+    }
+    if (!decoded[0]) emitJump(out, 0);
+}
+
+int translate(FILE *out, const char *source) {
+    // A first pass finds the labels and temporaries the body refers to
+    FILE *body = tmpfile();
+    if (!body) return 1;
+    emitBody(body);
+    fclose(body);
+    if (usesDispatch) {
+        for (int pc = 0; pc < imageSize; pc++) labelled[pc] |= decoded[pc];
+    }
+    body = tmpfile();
+    if (!body) return 1;
+    emitBody(body);
+
+    fprintf(out, "/* Generated by lanc v%s from %s, do not edit */\n", LANC_VERSION_STR, source);
+    fprintf(out, "#define RT_MEMORY_SIZE %d\n", memSize);
+    fprintf(out, "#define RT_IMAGE_SIZE %d\n", imageSize);
+    fprintf(out, "#define RT_VERSION_STR \"%s\"\n\n", VM_VERSION_STR);
+    fprintf(out, "#include \"lanrt.h\"\n\n");
+    emitBytes(out, "image", image);
+    emitBytes(out, "code", codeMap);
+
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "  Runtime rt;\n  uint8_t *mem;\n  uint16_t memSize;\n");
+    fprintf(out, "  uint16_t r0, r1, r2, r3, r4, bp, sp, pc = 0, iv;\n");
+    fprintf(out, "  bool fC, fZ, fO, fS, fH, fIE, fIA, f7;\n");
+    if (usesA || usesB) fprintf(out, "  int %s;\n", usesA && usesB ? "a, b" : usesA ? "a" : "b");
+    if (usesS || usesV) fprintf(out, "  uint16_t %s;\n", usesS && usesV ? "s, v" : usesS ? "s" : "v");
+    fprintf(out, "\n  rtInit(&rt, image, code, RT_IMAGE_SIZE);\n  RT_LOAD();\n");
+    fprintf(out, "  (void)mem; (void)memSize; // Unused by programs that only touch registers\n\n");
+
+    rewind(body);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), body)) > 0) fwrite(buf, 1, n, out);
+    fclose(body);
+
+    if (usesDispatch) {
+        fprintf(out, "\ndispatch: // Indirect control transfers\n  switch (pc) {\n");
+        for (int pc = 0; pc < imageSize; pc++) {
+            if (decoded[pc]) fprintf(out, "      case 0x%04x: goto L_%04x;\n", pc, pc);
+        }
+        fprintf(out, "  }\n");
+        fprintf(out, "  RT_SAVE(pc);\n  rtUntranslated(&rt);\n");
+    }
+    fprintf(out, "\n%s  // Halted or left the program area, like the main loop of lanvm\n", usesStopped ? "stopped:\n" : "");
+    fprintf(out, "  RT_SAVE(pc);\n  rtPrintState(&rt);\n  rtExit(&rt, 1);\n  return 1;\n}\n");
+    return 0;
+}
+
+// Size memory the way lanvm does, the declared size or enough for the program
+int fitProgram(uint32_t extent, uint16_t declared) {
+    uint32_t size = declared ? declared : extent > DEFAULT_MEMORY_SIZE ? extent : DEFAULT_MEMORY_SIZE;
+    if (extent > size || size > UINT16_MAX) {
+        fprintf(stderr, "Program does not fit in %u bytes of memory\n", size > UINT16_MAX ? UINT16_MAX : size);
+        return 1;
+    }
+    memSize = size;
+    imageSize = extent;
+    return 0;
+}
+
+// Older hex text format, the same as vm_load_image() in liblanvm reads
+int loadHex(const uint8_t *text, size_t size) {
+    size_t length = 0;
+    while (length < size && text[length] != '\n') length++;
+    if (fitProgram((length + 1) / 2, 0)) return 1;
+    char digits[3] = "";
+    for (size_t i = 0; i < length; i += 2) {
+        digits[0] = text[i];
+        digits[1] = i + 1 < length ? text[i + 1] : '\0';
+        image[i / 2] = (uint8_t)strtol(digits, NULL, 16);
+    }
+    return 0;
+}
+
+// Code and data sections are translated from where lanvm would load them
+int loadSections(const uint8_t *file, size_t size) {
+    Image img;
+    const char *error = imgParse(file, size, &img);
+    if (error) {
+        fprintf(stderr, "Invalid program image: %s\n", error);
+        return 1;
+    }
+    if (img.flags & IMG_HARVARD) {
+        fprintf(stderr, "Harvard mode images are not supported\n");
+        return 1;
+    }
+    if (img.flags & IMG_WIDE) {
+        fprintf(stderr, "32-bit images are not supported\n");
+        return 1;
+    }
+    if (fitProgram(imgExtent(&img), img.memSize)) return 1;
+    for (int i = 0; i < img.sectionCount; i++) {
+        const ImgSection *s = &img.sections[i];
+        if (imgLoaded(s)) memcpy(image + s->addr, s->data, s->size);
+    }
+    entry = img.entry;
+    return 0;
+}
+
+int loadImage(FILE *file) {
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    uint8_t *buffer = malloc(length > 0 ? length : 1);
+    if (length < 0 || !buffer) {
+        fprintf(stderr, "Error reading the program\n");
+        free(buffer);
+        return 1;
+    }
+    size_t size = fread(buffer, 1, length, file);
+    int err = imgIsImage(buffer, size) ? loadSections(buffer, size) : loadHex(buffer, size);
+    free(buffer);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    printf("LANC v%s\n", LANC_VERSION_STR);
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <input_file> <output_file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *input = fopen(argv[1], "rb");
+    if (!input) {
+        fprintf(stderr, "Error opening files\n");
+        return 1;
+    }
+    int err = loadImage(input);
+    fclose(input);
+    if (err) return 1;
+
+    int count = analyse();
+    if (count < 0) return 1;
+
+    FILE *output = fopen(argv[2], "w");
+    if (!output) {
+        fprintf(stderr, "Error opening files\n");
+        return 1;
+    }
+    err = translate(output, argv[1]);
+    fclose(output);
+    if (err) {
+        fprintf(stderr, "Translation failed\n");
+        return 1;
+    }
+    printf("Translated %d instructions from %d bytes\n", count, imageSize);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Client of `lanvm --fork-server`. It hands its stdin, stdout and stderr
+ * to the server, which runs the preloaded program on them in a child, and
+ * exits with the exit code of that run. It is kept apart from lanvm so it
+ * starts without loading the graphics libraries.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <socket>\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (strlen(argv[1]) >= sizeof(addr.sun_path) || conn < 0) {
+        fprintf(stderr, "Cannot connect to %s\n", argv[1]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Cannot connect to %s\n", argv[1]);
+        return 1;
+    }
+
+    // One byte of data carries the descriptors
+    int stdio[3] = {0, 1, 2};
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(stdio))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(stdio));
+    memcpy(CMSG_DATA(c), stdio, sizeof(stdio));
+
+    int32_t code;
+    if (sendmsg(conn, &msg, 0) != 1 || read(conn, &code, sizeof(code)) != sizeof(code)) {
+        fprintf(stderr, "Fork server at %s did not run the program\n", argv[1]);
+        return 1;
+    }
+    close(conn);
+    return code;
+}
@@ -19,14 +19,7 @@
  */
 #include "../include/lanvm.h"
 
-void modifyFlags(VM *vm, uint16_t result) {
-  vm->flags[ZERO_FLAG] = result == 0 ? 1 : 0;
-  vm->flags[SIGN_FLAG] = (result & 0x8000) < 0 ? 1 : 0;
-  vm->flags[OVERFLOW_FLAG] = result < -32768 || result > 32767 ? 1 : 0;
-  vm->flags[CARRY_FLAG] = (result & 0x10000) ? 1 : 0;
-}
-
-void alu(VM *vm, ALU_OP op, uint16_t *dest, uint16_t src) {
+void alu(VM *vm, ALU_OP op, word_t *dest, word_t src) {
   if (!dest) {
       vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null pointer passed to ALU\n");
       return;
@@ -53,7 +46,7 @@ void alu(VM *vm, ALU_OP op, uint16_t *dest, uint16_t src) {
           modifyFlags(vm, *dest);
           break;
       case ALU_CMP:
-          modifyFlags(vm, (int16_t)(*dest - src));
+          modifyFlags(vm, (sword_t)(*dest - src));
           break;
       case ALU_MUL:
           *dest *= src;
@@ -85,47 +78,42 @@ void alu(VM *vm, ALU_OP op, uint16_t *dest, uint16_t src) {
   }
 }
 
+// SETcc opcodes to conditions, SETLE and SETGE differ from JLE and JGE
+static const uint8_t setCond[] = {
+    COND_Z, COND_NZ, COND_L, COND_LE, COND_G, COND_GE, COND_C, COND_BE, COND_A, COND_NC
+};
+
 void handleSET(VM *vm, uint8_t op, uint8_t DSb) {
-  DSbyte DS = decodeDS(DSb);
-  uint16_t* dest = GetDestination(vm, DSb);
+  word_t* dest = ResolveDestination(vm, DSb >> 4, 0);
   if (!dest) {
       vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to SET\n");
       return;
   }
-  switch (op) {
-      case 0x32: // SETZ
-          *dest = (vm->flags[ZERO_FLAG]) ? 1 : 0;
-          break;
-      case 0x33: // SETNZ
-          *dest = (!vm->flags[ZERO_FLAG]) ? 1 : 0;
-          break;
-      case 0x34: // SETL
-          *dest = (vm->flags[SIGN_FLAG] != vm->flags[OVERFLOW_FLAG]) ? 1 : 0;
-          break;
-      case 0x35: // SETLE
-          *dest = (vm->flags[ZERO_FLAG] || vm->flags[SIGN_FLAG] != vm->flags[OVERFLOW_FLAG]) ? 1 : 0;
-          break;
-      case 0x36: // SETG
-          *dest = (vm->flags[ZERO_FLAG] && vm->flags[SIGN_FLAG] == vm->flags[OVERFLOW_FLAG]) ? 1 : 0;
-          break;
-      case 0x37: // SETGE
-          *dest = (vm->flags[SIGN_FLAG] == vm->flags[OVERFLOW_FLAG]) ? 1 : 0;
-          break;
-      case 0x38: // SETB
-          *dest = (vm->flags[CARRY_FLAG]) ? 1 : 0;
-          break;
-      case 0x39: // SETBE
-          *dest = (vm->flags[CARRY_FLAG] || vm->flags[ZERO_FLAG]) ? 1 : 0;
-          break;
-      case 0x3a: // SETA
-          *dest = (!vm->flags[CARRY_FLAG] && !vm->flags[ZERO_FLAG]) ? 1 : 0;
-          break;
-      case 0x3b: // SETAE
-          *dest = (!vm->flags[CARRY_FLAG]) ? 1 : 0;
-          break;
-      default:
-          vm_exception(vm, ERR_INVALID_ALU, EXC_WARNING, "Invalid SET opcode\n");
-          break;
+  if (op < SETZ_dest || op > SETAE_dest) {
+      vm_exception(vm, ERR_INVALID_ALU, EXC_WARNING, "Invalid SET opcode\n");
+      return;
+  }
+  *dest = testCond(vm, setCond[op - SETZ_dest]);
+}
 
+// Outcome of every condition for FLAGS byte f, in Condition order
+#define COND_C_(f) ((f) >> CARRY_FLAG & 1)
+#define COND_Z_(f) ((f) >> ZERO_FLAG & 1)
+#define COND_O_(f) ((f) >> OVERFLOW_FLAG & 1)
+#define COND_S_(f) ((f) >> SIGN_FLAG & 1)
+#define COND_ROW(f) { \
+    [COND_Z] = COND_Z_(f), [COND_NZ] = !COND_Z_(f), [COND_C] = COND_C_(f), [COND_NC] = !COND_C_(f), \
+    [COND_JLE] = COND_O_(f) || COND_S_(f) != COND_Z_(f), [COND_JGE] = 1, \
+    [COND_L] = COND_S_(f) != COND_O_(f), [COND_G] = COND_Z_(f) && COND_S_(f) == COND_O_(f), \
+    [COND_LE] = COND_Z_(f) || COND_S_(f) != COND_O_(f), [COND_GE] = COND_S_(f) == COND_O_(f), \
+    [COND_BE] = COND_C_(f) || COND_Z_(f), [COND_A] = !COND_C_(f) && !COND_Z_(f) \
   }
-}
\ No newline at end of file
+#define COND_ROWS4(f) COND_ROW(f), COND_ROW((f) + 1), COND_ROW((f) + 2), COND_ROW((f) + 3)
+#define COND_ROWS16(f) COND_ROWS4(f), COND_ROWS4((f) + 4), COND_ROWS4((f) + 8), COND_ROWS4((f) + 12)
+#define COND_ROWS64(f) COND_ROWS16(f), COND_ROWS16((f) + 16), COND_ROWS16((f) + 32), COND_ROWS16((f) + 48)
+
+// Built at compile time, so VMs share it without anything to initialize
+const uint8_t condTable[256][COND_COUNT] = {
+    COND_ROWS64(0), COND_ROWS64(64), COND_ROWS64(128), COND_ROWS64(192)
+};
+
@@ -0,0 +1,299 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "../include/lanvm.h"
+#include <pthread.h>
+
+/*
+ * Channels between VMs. A channel is a ring of CHANNEL_BYTES with one
+ * sender and one receiver, each message a length word followed by its
+ * bytes. The sender only writes tail and the receiver only writes head,
+ * each on a cache line of its own next to a copy of the other index, so a
+ * message costs a copy and a cache line changing hands, not a lock or a
+ * system call. Opening and releasing ends goes through the Channels lock.
+ *
+ * An end that finds the ring full, or empty, sets its waiting flag, looks
+ * at the other index once more and returns CALL_WAIT: the instruction
+ * runs again and vm_run() returns VM_IO_WAIT. The other end moves its
+ * index before it looks at the flag, so one of the two always sees the
+ * other (both are sequentially consistent), and the wake is never lost. It
+ * wakes the waiting VM through the scheduler the VM runs on. A VM run
+ * without one simply finds the channel ready when its host runs it again.
+ */
+
+#define CHANNEL_BYTES 65536 // Ring size, a power of two
+#define MAX_CHANNELS 256 // Per Channels, handles are indexes
+#define CHANNEL_NAME 32 // Longest name, in characters
+#define LENGTH_BYTES 4 // uint32_t before each message
+
+typedef struct {
+  char name[CHANNEL_NAME + 1];
+  VM *_Atomic sender, *_Atomic receiver; // NULL while the end isn't open
+  atomic_bool closed; // The sender went, receives fail once the ring is empty
+  atomic_bool abandoned; // The receiver went, sends fail
+  pthread_mutex_t wake; // Held while waking an end, so a releasing VM can't go meanwhile
+  _Alignas(64) atomic_uint tail; // Sender's line: bytes ever sent
+  unsigned headCache; // head as the sender saw it last
+  atomic_bool senderWaiting;
+  _Alignas(64) atomic_uint head; // Receiver's line: bytes ever received
+  unsigned tailCache;
+  atomic_bool receiverWaiting;
+  _Alignas(64) uint8_t ring[CHANNEL_BYTES];
+} Channel;
+
+struct Channels {
+  pthread_mutex_t lock; // For opening and releasing ends
+  Channel *_Atomic list[MAX_CHANNELS];
+  int count;
+};
+
+// Channels for VMs to share with vm_set_channels(), NULL if out of memory
+Channels *vm_channels_create(void) {
+  Channels *channels = calloc(1, sizeof(*channels));
+  if (!channels) return NULL;
+  pthread_mutex_init(&channels->lock, NULL);
+  return channels;
+}
+
+void vm_channels_destroy(Channels *channels) {
+  if (!channels) return;
+  for (int i = 0; i < channels->count; i++) {
+      pthread_mutex_destroy(&channels->list[i]->wake);
+      free(channels->list[i]);
+  }
+  pthread_mutex_destroy(&channels->lock);
+  free(channels);
+}
+
+// Let vm open the channels of channels, NULL for none. Ends it has open stay open.
+void vm_set_channels(VM *vm, Channels *channels) {
+  vm->channels = channels;
+}
+
+// Queue vm again if it waits, with waiting its flag on a channel
+static void wakeEnd(Channel *c, atomic_bool *waiting, VM *_Atomic *end) {
+  pthread_mutex_lock(&c->wake);
+  VM *vm = atomic_load(end);
+  if (atomic_exchange(waiting, false) && vm) {
+      Scheduler *s = atomic_load(&vm->sched);
+      if (s) sched_wake(s, vm);
+  }
+  pthread_mutex_unlock(&c->wake);
+}
+
+// Copy n bytes between the ring at position at and guest memory at addr, which fits in memory
+static void copyRing(VM *vm, Channel *c, unsigned at, word_t addr, uint32_t n, bool toGuest) {
+  while (n) {
+      uint32_t chunk = CHANNEL_BYTES - (at & (CHANNEL_BYTES - 1));
+      uint32_t window = BANK_SIZE - (addr & (BANK_SIZE - 1)); // memAt() holds within a window
+      if (window < chunk) chunk = window;
+      if (n < chunk) chunk = n;
+      uint8_t *ring = c->ring + (at & (CHANNEL_BYTES - 1));
+      if (toGuest) {
+          memcpy(memAt(vm, addr), ring, chunk);
+          for (uint64_t page = addr >> DIRTY_PAGE_SHIFT; page <= (addr + chunk - 1) >> DIRTY_PAGE_SHIFT; page++) {
+              vm->dirty[page] = 1;
+          }
+          invalidateCode(vm, addr, chunk);
+      } else {
+          memcpy(ring, memAt(vm, addr), chunk);
+      }
+      at += chunk;
+      addr += chunk;
+      n -= chunk;
+  }
+}
+
+// Copy the length word at position at, it may wrap around the ring
+static void ringLength(Channel *c, unsigned at, uint32_t *length, bool store) {
+  uint8_t *bytes = (uint8_t *)length;
+  for (int i = 0; i < LENGTH_BYTES; i++) {
+      uint8_t *slot = &c->ring[(at + i) & (CHANNEL_BYTES - 1)];
+      if (store) *slot = bytes[i];
+      else bytes[i] = *slot;
+  }
+}
+
+// Channel of handle if vm has its sending or receiving end open, otherwise NULL
+static Channel *endOf(VM *vm, word_t handle, bool sending) {
+  if (!vm->channels || handle >= MAX_CHANNELS) return NULL;
+  Channel *c = atomic_load(&vm->channels->list[handle]);
+  if (!c || atomic_load(sending ? &c->sender : &c->receiver) != vm) return NULL;
+  return c;
+}
+
+/*
+ * VMCHOPEN: open the channel named by the string at r0, created by the
+ * first VM to open it, as its receiver if r1 is 0 and as its sender
+ * otherwise. The handle is returned in r0. Fails if the VM has no
+ * Channels, the name is empty or too long, or another VM has that end.
+ */
+int chanOpen(VM *vm) {
+  Channels *channels = vm->channels;
+  if (!channels) return 1;
+  char name[CHANNEL_NAME + 1];
+  int length = 0;
+  for (uint64_t addr = vm->r[0]; ; addr += WORD_BYTES) { // Low bytes of words, as PRINTS reads them
+      if (addr + WORD_BYTES > vm->memSize) return 1;
+      name[length] = *memAt(vm, addr);
+      if (!name[length]) break;
+      if (++length > CHANNEL_NAME) return 1;
+  }
+  if (!length) return 1;
+  bool sending = vm->r[1] != 0;
+
+  pthread_mutex_lock(&channels->lock);
+  int i = 0;
+  while (i < channels->count && strcmp(channels->list[i]->name, name)) i++;
+  Channel *c = i < channels->count ? channels->list[i] : NULL;
+  if (!c && i < MAX_CHANNELS && (c = aligned_alloc(_Alignof(Channel), sizeof(Channel)))) {
+      memset(c, 0, offsetof(Channel, ring)); // The ring is written before it is read
+      strcpy(c->name, name);
+      pthread_mutex_init(&c->wake, NULL);
+      atomic_store(&channels->list[i], c);
+      channels->count++;
+  }
+  int failed = 1;
+  if (c) {
+      VM *_Atomic *end = sending ? &c->sender : &c->receiver;
+      VM *owner = atomic_load(end);
+      if (!owner || owner == vm) {
+          atomic_store(sending ? &c->closed : &c->abandoned, false);
+          atomic_store(end, vm);
+          vm->r[0] = i;
+          failed = 0;
+      }
+  }
+  pthread_mutex_unlock(&channels->lock);
+  return failed;
+}
+
+/*
+ * VMCHSEND: send the r2 bytes at r1 on channel r0, waiting while the ring
+ * is too full for them. Fails if r0 isn't a channel this VM sends on, the
+ * message is larger than the ring or runs past memory, or the receiver has
+ * gone.
+ */
+int chanSend(VM *vm) {
+  Channel *c = endOf(vm, vm->r[0], true);
+  uint32_t length = vm->r[2];
+  word_t addr = vm->r[1];
+  if (!c || length > CHANNEL_BYTES - LENGTH_BYTES || (uint64_t)addr + length > vm->memSize) return 1;
+  unsigned tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+  unsigned need = LENGTH_BYTES + length;
+  if (CHANNEL_BYTES - (tail - c->headCache) < need) {
+      c->headCache = atomic_load_explicit(&c->head, memory_order_acquire);
+      if (CHANNEL_BYTES - (tail - c->headCache) < need) { // Full, wait unless the receiver just made room
+          atomic_store(&c->senderWaiting, true);
+          c->headCache = atomic_load(&c->head);
+          if (CHANNEL_BYTES - (tail - c->headCache) < need) {
+              if (atomic_load(&c->abandoned)) {
+                  atomic_store(&c->senderWaiting, false);
+                  return 1;
+              }
+              vm->waiting = WAIT_CHANNEL;
+              return CALL_WAIT;
+          }
+          atomic_store_explicit(&c->senderWaiting, false, memory_order_relaxed);
+      }
+  }
+  if (atomic_load_explicit(&c->abandoned, memory_order_relaxed)) return 1;
+  ringLength(c, tail, &length, true);
+  copyRing(vm, c, tail + LENGTH_BYTES, addr, length, false);
+  atomic_store(&c->tail, tail + need);
+  if (atomic_load(&c->receiverWaiting)) wakeEnd(c, &c->receiverWaiting, &c->receiver);
+  return 0;
+}
+
+/*
+ * VMCHRECV: receive the next message on channel r0 into the r2 bytes at
+ * r1, waiting while there is none, and return its length in r2. Fails if
+ * r0 isn't a channel this VM receives on or the buffer runs past memory,
+ * with r2 = 0 once the sender has gone and every message is received, and
+ * with the length in r2 if the message is larger than the buffer. That
+ * message is kept for the next receive.
+ */
+int chanReceive(VM *vm) {
+  Channel *c = endOf(vm, vm->r[0], false);
+  word_t addr = vm->r[1];
+  if (!c || (uint64_t)addr + vm->r[2] > vm->memSize) return 1;
+  unsigned head = atomic_load_explicit(&c->head, memory_order_relaxed);
+  if (head == c->tailCache) {
+      c->tailCache = atomic_load_explicit(&c->tail, memory_order_acquire);
+      if (head == c->tailCache) { // Empty, wait unless the sender just sent or went
+          atomic_store(&c->receiverWaiting, true);
+          c->tailCache = atomic_load(&c->tail);
+          if (head == c->tailCache) {
+              bool closed = atomic_load(&c->closed);
+              c->tailCache = atomic_load(&c->tail); // Its last message may have come meanwhile
+              if (head == c->tailCache) {
+                  if (!closed) {
+                      vm->waiting = WAIT_CHANNEL;
+                      return CALL_WAIT;
+                  }
+                  atomic_store(&c->receiverWaiting, false);
+                  vm->r[2] = 0;
+                  return 1;
+              }
+          }
+          atomic_store_explicit(&c->receiverWaiting, false, memory_order_relaxed);
+      }
+  }
+  uint32_t length;
+  ringLength(c, head, &length, false);
+  if (length > vm->r[2]) {
+      vm->r[2] = length;
+      return 1;
+  }
+  copyRing(vm, c, head + LENGTH_BYTES, addr, length, true);
+  vm->r[2] = length;
+  atomic_store(&c->head, head + LENGTH_BYTES + length);
+  if (atomic_load(&c->senderWaiting)) wakeEnd(c, &c->senderWaiting, &c->sender);
+  return 0;
+}
+
+/*
+ * Close the ends vm has open, when its program ends or it is destroyed. A
+ * receiver left waiting on a closed channel is woken to find it so, as is
+ * a sender left waiting on an abandoned one.
+ */
+void chanRelease(VM *vm) {
+  Channels *channels = vm->channels;
+  if (!channels) return;
+  pthread_mutex_lock(&channels->lock);
+  for (int i = 0; i < channels->count; i++) {
+      Channel *c = channels->list[i];
+      if (atomic_load(&c->sender) != vm && atomic_load(&c->receiver) != vm) continue;
+      pthread_mutex_lock(&c->wake);
+      if (atomic_load(&c->sender) == vm) {
+          atomic_store(&c->sender, NULL);
+          atomic_store(&c->senderWaiting, false);
+          atomic_store(&c->closed, true);
+      }
+      if (atomic_load(&c->receiver) == vm) {
+          atomic_store(&c->receiver, NULL);
+          atomic_store(&c->receiverWaiting, false);
+          atomic_store(&c->abandoned, true);
+      }
+      pthread_mutex_unlock(&c->wake);
+      if (atomic_load(&c->receiverWaiting)) wakeEnd(c, &c->receiverWaiting, &c->receiver);
+      if (atomic_load(&c->senderWaiting)) wakeEnd(c, &c->senderWaiting, &c->sender);
+  }
+  pthread_mutex_unlock(&channels->lock);
+}
@@ -0,0 +1,195 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "../include/liblanvm.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Fork server. lanvm loads the program once and listens on a Unix socket.
+ * A client (lanrun) connects and passes its stdin, stdout and stderr over
+ * the socket, the server forks a child that runs the loaded VM on those, and
+ * when the child exits the server writes its exit status back as a 32-bit
+ * integer. Children run concurrently, the server only keeps the connection
+ * of each until it can report the status. A client never writes after the
+ * descriptors, so a readable connection means it went away, and its child is
+ * killed rather than left running on its terminal.
+ */
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_JOBS 64 // Children running at once, more clients wait in the backlog
+
+typedef struct {
+  pid_t pid;
+  int fd; // Connection the status goes back on
+  bool killed;
+} Job;
+
+static int childPipe[2] = {-1, -1}; // Written on SIGCHLD to wake poll()
+
+static void onChild(int sig) {
+  (void)sig;
+  int saved = errno;
+  if (write(childPipe[1], "", 1) < 0) {} // Full means a wakeup is already pending
+  errno = saved;
+}
+
+static int unixAddress(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) return 1;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+// Receive the three standard descriptors of a client, returns 1 if it sent something else
+static int receiveFds(int conn, int fds[3]) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof(control.space);
+  if (recvmsg(conn, &msg, 0) != 1) return 1;
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+      return 1;
+  }
+  memcpy(fds, CMSG_DATA(c), 3 * sizeof(int));
+  return 0;
+}
+
+// Report the status of finished children, returns the number of jobs left
+static int reapJobs(Job *jobs, int count, bool block) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0) {
+      block = false;
+      int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      for (int i = 0; i < count; i++) {
+          if (jobs[i].pid != pid) continue;
+          if (write(jobs[i].fd, &code, sizeof(code)) < 0) {} // The client may be gone
+          close(jobs[i].fd);
+          jobs[i] = jobs[--count];
+          break;
+      }
+  }
+  return count;
+}
+
+/*
+ * Serve runs of the VM over the socket at path. Returns 0 in each child,
+ * with stdin, stdout and stderr replaced by the client's, so the caller
+ * goes on to run the VM. The server itself only returns on failure.
+ */
+int forkServer(VM *vm, const char *path) {
+  (void)vm; // Children inherit it in its loaded state
+  struct sockaddr_un addr;
+  if (unixAddress(path, &addr)) {
+      printf("Socket path too long: %s\n", path);
+      return 1;
+  }
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) || listen(server, SOMAXCONN)) {
+      printf("Cannot listen on %s: %s\n", path, strerror(errno));
+      return 1;
+  }
+  if (pipe(childPipe)) return 1;
+  fcntl(childPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(childPipe[1], F_SETFL, O_NONBLOCK);
+  signal(SIGCHLD, onChild);
+  signal(SIGPIPE, SIG_IGN); // A client that went away is noticed by write()
+  printf("Serving %s\n", path);
+  fflush(stdout); // Buffered output would be copied into every child
+
+  Job jobs[MAX_JOBS];
+  int count = 0;
+  for (;;) {
+      if (count == MAX_JOBS) count = reapJobs(jobs, count, true);
+      struct pollfd fds[2 + MAX_JOBS] = {{server, POLLIN, 0}, {childPipe[0], POLLIN, 0}};
+      for (int i = 0; i < count; i++) fds[2 + i] = (struct pollfd){jobs[i].fd, jobs[i].killed ? 0 : POLLIN, 0};
+      if (poll(fds, 2 + count, -1) < 0 && errno != EINTR) return 1;
+      for (int i = 0; i < count; i++) {
+          if (!fds[2 + i].revents || jobs[i].killed) continue;
+          kill(jobs[i].pid, SIGKILL);
+          jobs[i].killed = true;
+      }
+      if (fds[1].revents) {
+          char drain[64];
+          while (read(childPipe[0], drain, sizeof(drain)) > 0) {}
+          count = reapJobs(jobs, count, false);
+      }
+      if (!(fds[0].revents & POLLIN)) continue;
+
+      int conn = accept(server, NULL, NULL);
+      int stdio[3];
+      if (conn < 0) continue;
+      if (receiveFds(conn, stdio)) {
+          close(conn);
+          continue;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+          signal(SIGCHLD, SIG_DFL);
+          signal(SIGPIPE, SIG_DFL);
+          for (int i = 0; i < 3; i++) {
+              dup2(stdio[i], i);
+              close(stdio[i]);
+          }
+          for (int i = 0; i < count; i++) close(jobs[i].fd);
+          close(conn);
+          close(server);
+          close(childPipe[0]);
+          close(childPipe[1]);
+          return 0;
+      }
+      for (int i = 0; i < 3; i++) close(stdio[i]);
+      if (pid < 0) {
+          close(conn);
+          continue;
+      }
+      jobs[count++] = (Job){pid, conn, false};
+  }
+}
+
+#else
+
+int forkServer(VM *vm, const char *path) {
+  (void)vm;
+  (void)path;
+  printf("The fork server needs Unix sockets\n");
+  return 1;
+}
+
+#endif
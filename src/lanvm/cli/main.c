@@ -0,0 +1,382 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "../include/liblanvm.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The lanvm command, a client of liblanvm that only uses its public API.
+ * Process-wide concerns live here: the options, SIGINT, statistics, the
+ * graphics loop, the fork server and turning the way the program ended
+ * into the exit status.
+ */
+
+#define FRAME_INSTRUCTIONS 100000 // Instructions run between rendered frames
+#define DEFAULT_JIT_CACHE 1024 // Code cache size in KiB
+
+int forkServer(VM *vm, const char *path); // See forkserver.c
+
+static bool stats; // Print execution statistics on exit
+static bool forkChild; // Running a fork server request, exit handlers belong to the server
+static VM *activeVM; // VM stopped by SIGINT
+static struct timespec startTime;
+static double loadSeconds; // Time loading the program took
+static uint64_t startCount; // Instructions retired before this process, by a resumed VM
+static bool noLockstep; // --lanes runs each lane alone, to check lockstep against
+
+// --guests and --lanes, clones of the loaded program run on a scheduler or in lockstep
+static VM **clones;
+static int cloneCount;
+static pthread_mutex_t guestLock = PTHREAD_MUTEX_INITIALIZER;
+static double *latencies; // Seconds from the start to each guest finishing, in finishing order
+static int finishedCount;
+static int guestCode; // Exit code of the first guest to finish
+static bool guestsDiffer; // Some guest exited with another code
+
+static double elapsedSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - startTime.tv_sec) + (now.tv_nsec - startTime.tv_nsec) / 1e9;
+}
+
+static void handleSigint(int sig) {
+    (void)sig;
+    if (activeVM) vm_stop(activeVM);
+    for (int i = 0; i < cloneCount; i++) vm_stop(clones[i]);
+}
+
+static void printStats(VM *vm) {
+    double secs = elapsedSeconds();
+    VMStats s;
+    vm_get_stats(vm, &s);
+    printf("Loaded %u bytes in %.3f ms\n", s.programBytes, loadSeconds * 1e3);
+    uint64_t count = s.instructions - startCount;
+    printf("Executed %llu instructions in %.3f s (%.2f MIPS)\n",
+        (unsigned long long)count, secs, secs > 0 ? count / secs / 1e6 : 0.0);
+    printf("Decoded %llu blocks, %llu invalidated\n",
+        (unsigned long long)s.blocksDecoded, (unsigned long long)s.blocksInvalidated);
+    printf("Fused: cmp+jcc %llu, dec+jnz %llu, or+jcc %llu\n",
+        (unsigned long long)s.fusedCmpJcc, (unsigned long long)s.fusedDecJnz, (unsigned long long)s.fusedOrJcc);
+    if (s.restarts) {
+        printf("Restarted %llu times, %llu pages restored\n",
+            (unsigned long long)s.restarts, (unsigned long long)s.restoredPages);
+    }
+    if (s.banks) printf("Extended memory: %u banks\n", s.banks);
+    if (s.jit) {
+        printf("JIT: %llu blocks compiled, %llu rejected, %zu bytes of code\n",
+            (unsigned long long)s.jitCompiled, (unsigned long long)s.jitRejected, s.jitBytes);
+    }
+}
+
+// Runs on a worker thread
+static void guestFinished(Scheduler *s, VM *vm, VMStop stop, void *user) {
+    (void)s;
+    (void)user;
+    int code = stop == VM_EXITED ? vm_exit_code(vm) : 1;
+    pthread_mutex_lock(&guestLock);
+    latencies[finishedCount++] = elapsedSeconds();
+    if (finishedCount == 1) guestCode = code;
+    else if (code != guestCode) guestsDiffer = true;
+    pthread_mutex_unlock(&guestLock);
+}
+
+static int compareSeconds(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(int p) {
+    return latencies[(finishedCount - 1) * p / 100];
+}
+
+/*
+ * Run count clones of template on workers threads and return the exit code
+ * they agree on, 1 if they don't. All guests start together, so the time
+ * each one finished is its latency.
+ */
+static int8_t runGuests(VM *template, int count, int workers, uint64_t quantum) {
+    clones = calloc(count, sizeof(*clones));
+    latencies = calloc(count, sizeof(*latencies));
+    if (!clones || !latencies) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    Channels *channels = vm_channels_create(); // Guests can talk to each other
+    if (!channels) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    vm_set_channels(template, channels);
+    for (int i = 0; i < count; i++) {
+        if (!(clones[i] = vm_clone(template))) {
+            printf("Memory allocation failed\n");
+            for (int j = 0; j < i; j++) vm_destroy(clones[j]);
+            vm_set_channels(template, NULL);
+            vm_channels_destroy(channels);
+            return 1;
+        }
+    }
+    cloneCount = count;
+    SchedConfig config = {.workers = workers, .quantum = quantum, .finished = guestFinished};
+    Scheduler *sched = sched_create(&config);
+    if (!sched) {
+        printf("Could not start %d workers\n", workers);
+        finishedCount = count;
+        guestsDiffer = true;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    for (int i = 0; sched && i < count; i++) {
+        if (sched_submit(sched, clones[i])) guestFinished(sched, clones[i], VM_STOPPED, NULL);
+    }
+    if (sched) sched_wait(sched);
+    double secs = elapsedSeconds();
+    sched_destroy(sched);
+
+    uint64_t retired = 0;
+    for (int i = 0; i < count; i++) retired += vm_instructions(clones[i]) - startCount;
+    if (stats) {
+        qsort(latencies, finishedCount, sizeof(*latencies), compareSeconds);
+        printf("Ran %d guests on %d workers in %.3f s (%.1f guests/s, %.2f MIPS)\n",
+            count, workers, secs, secs > 0 ? count / secs : 0.0, secs > 0 ? retired / secs / 1e6 : 0.0);
+        printf("Latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            percentile(50) * 1e3, percentile(99) * 1e3, percentile(100) * 1e3);
+    }
+    cloneCount = 0; // Before the guests go, SIGINT may still come
+    for (int i = 0; i < count; i++) vm_destroy(clones[i]);
+    vm_set_channels(template, NULL);
+    vm_channels_destroy(channels);
+    free(clones);
+    free(latencies);
+    return guestsDiffer ? 1 : guestCode;
+}
+
+// Clone template for each line of file, with the line's numbers in r0 to r4, returns 1 if out of memory
+static int readLanes(VM *template, FILE *file) {
+    char line[256];
+    int capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char *p = line, *end;
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p) continue;
+        if (cloneCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            VM **grown = realloc(clones, capacity * sizeof(*clones));
+            if (!grown) return 1;
+            clones = grown;
+        }
+        VM *lane = vm_clone(template);
+        if (!lane) return 1;
+        clones[cloneCount++] = lane;
+        for (int reg = 0; reg < 5; reg++) {
+            unsigned long value = strtoul(p, &end, 0);
+            if (end == p) break;
+            vm_set_register(lane, reg, value);
+            p = end;
+        }
+    }
+    return 0;
+}
+
+// Run each lane on its own as vm_run_lockstep() would have it end
+static void runAlone(VMStop *stops) {
+    for (int i = 0; i < cloneCount; i++) {
+        VMStop stop;
+        do {
+            stop = vm_run(clones[i], VM_UNLIMITED);
+        } while (stop == VM_EXCEPTION || stop == VM_IO_WAIT);
+        stops[i] = stop;
+    }
+}
+
+/*
+ * Run a clone of template per line of path in lockstep, each line giving
+ * r0 to r4 of its lane, and return the exit code they agree on, 1 if they
+ * don't. With --no-lockstep the lanes run one after the other instead.
+ */
+static int8_t runLanes(VM *template, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Error opening %s\n", path);
+        return 1;
+    }
+    int failed = readLanes(template, file);
+    fclose(file);
+    VMStop *stops = failed ? NULL : calloc(cloneCount ? cloneCount : 1, sizeof(*stops));
+    int8_t code = 1;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (stops && noLockstep) runAlone(stops);
+    if (!stops || (!noLockstep && vm_run_lockstep(clones, cloneCount, VM_UNLIMITED, stops))) {
+        printf("Memory allocation failed\n");
+    } else if (!cloneCount) {
+        printf("No lanes in %s\n", path);
+    } else {
+        double secs = elapsedSeconds();
+        uint64_t retired = 0;
+        bool differ = false;
+        for (int i = 0; i < cloneCount; i++) {
+            VM *lane = clones[i];
+            int laneCode = stops[i] == VM_EXITED ? vm_exit_code(lane) : 1;
+            if (i == 0) code = laneCode;
+            else if (laneCode != code) differ = true;
+            retired += vm_instructions(lane) - startCount;
+            printf("Lane %d: code %d, r0=0x%04x r1=0x%04x r2=0x%04x r3=0x%04x r4=0x%04x F=0x%02x\n", i, laneCode,
+                vm_get_register(lane, 0), vm_get_register(lane, 1), vm_get_register(lane, 2),
+                vm_get_register(lane, 3), vm_get_register(lane, 4), vm_get_flags(lane));
+        }
+        if (differ) code = 1;
+        if (stats) {
+            printf("Ran %d lanes %s in %.3f s (%.2f MIPS)\n",
+                cloneCount, noLockstep ? "one by one" : "in lockstep", secs, secs > 0 ? retired / secs / 1e6 : 0.0);
+        }
+    }
+    free(stops);
+    int count = cloneCount;
+    cloneCount = 0; // Before the lanes go, SIGINT may still come
+    for (int i = 0; i < count; i++) vm_destroy(clones[i]);
+    free(clones);
+    return code;
+}
+
+// Release vm and exit the process with code
+static void finish(VM *vm, int8_t code) {
+    if (stats) printStats(vm);
+    vm_destroy(vm);
+    printf("VM exited with code %d\n", code);
+    if (forkChild) { // Skip the atexit handlers inherited from the server
+        fflush(NULL);
+        _Exit(code);
+    }
+    exit(code);
+}
+
+int main(int argc, char **argv) {
+    printf("LanVM v%s%s\n", VM_VERSION_STR, vm_word_bits() == 32 ? " (32-bit)" : "");
+
+    const char *filename = NULL;
+#ifdef LANVM_JIT
+    bool useJit = true;
+#else
+    bool useJit = false;
+#endif
+    long jitCache = DEFAULT_JIT_CACHE;
+    bool resume = false;
+    VMConfig config = {0};
+    uint64_t snapshotAt = 0;
+    const char *snapshotFile = NULL; // Written once snapshotAt instructions have run
+    const char *serverPath = NULL;
+    int guestTotal = 0, workers = 0;
+    const char *laneFile = NULL;
+    long quantum = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) stats = true;
+        else if (strcmp(argv[i], "--jit") == 0) useJit = true;
+        else if (strcmp(argv[i], "--no-jit") == 0) useJit = false;
+        else if (strncmp(argv[i], "--jit-cache=", 12) == 0) jitCache = atol(argv[i] + 12);
+        else if (strcmp(argv[i], "--resume") == 0) resume = true;
+        else if (strcmp(argv[i], "--harvard") == 0) config.harvard = true;
+        else if (strncmp(argv[i], "--fork-server=", 14) == 0) serverPath = argv[i] + 14;
+        else if (strncmp(argv[i], "--guests=", 9) == 0) guestTotal = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--workers=", 10) == 0) workers = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--quantum=", 10) == 0) quantum = atol(argv[i] + 10);
+        else if (strncmp(argv[i], "--lanes=", 8) == 0) laneFile = argv[i] + 8;
+        else if (strcmp(argv[i], "--no-lockstep") == 0) noLockstep = true;
+        else if (strncmp(argv[i], "--snapshot-at=", 14) == 0) {
+            char *end;
+            snapshotAt = strtoull(argv[i] + 14, &end, 10);
+            snapshotFile = *end == ':' && end[1] ? end + 1 : "";
+        }
+        else filename = argv[i];
+    }
+
+    if (!filename || jitCache <= 0 || (snapshotFile && !*snapshotFile) || guestTotal < 0 || workers < 0 || quantum < 0
+        || ((guestTotal || laneFile) && snapshotFile) || (guestTotal && laneFile) || (noLockstep && !laneFile)) {
+        printf("Usage: %s [--stats] [--jit | --no-jit] [--jit-cache=KiB] [--snapshot-at=COUNT:FILE] [--resume]\n"
+            "    [--fork-server=SOCKET] [--harvard] [--guests=N [--workers=N] [--quantum=COUNT] | --lanes=FILE [--no-lockstep]] <filename>\n", argv[0]);
+        return 1;
+    }
+
+    if (useJit) config.jitCache = (size_t)jitCache * 1024;
+    VM *vm = vm_create(&config);
+    if (!vm) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    if (resume ? vm_restore(vm, filename) : vm_load_file(vm, filename)) {
+        finish(vm, 1);
+    }
+    loadSeconds = elapsedSeconds();
+    startCount = vm_instructions(vm);
+    VMStats loaded;
+    vm_get_stats(vm, &loaded);
+    if (useJit && !loaded.jit) {
+        printf("JIT not available, using the interpreter\n");
+    }
+    if (serverPath) {
+        if (forkServer(vm, serverPath)) finish(vm, 1);
+        forkChild = true; // Children return to run the program
+    }
+
+    signal(SIGINT, handleSigint);
+    if (guestTotal) {
+        if (!workers) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            workers = cores > 0 ? cores : 1;
+        }
+        int8_t code = runGuests(vm, guestTotal, workers, quantum);
+        stats = false; // The guests' statistics are printed already
+        finish(vm, code);
+    }
+    if (laneFile) {
+        int8_t code = runLanes(vm, laneFile);
+        stats = false;
+        finish(vm, code);
+    }
+
+    activeVM = vm;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    for (;;) {
+        uint64_t icount = vm_instructions(vm);
+        if (snapshotFile && icount >= snapshotAt) { // At the first block boundary past the count
+            if (vm_snapshot(vm, snapshotFile)) printf("Error writing snapshot %s\n", snapshotFile);
+            snapshotFile = NULL;
+        }
+        // Without graphics there is nothing to do between batches, so run unbounded
+        uint64_t budget = vm_has_window(vm) ? FRAME_INSTRUCTIONS : VM_UNLIMITED;
+        if (snapshotFile && snapshotAt - icount < budget) budget = snapshotAt - icount;
+        VMStop reason = vm_run(vm, budget);
+        if (reason == VM_EXITED) finish(vm, vm_exit_code(vm));
+        if (reason == VM_HALTED || reason == VM_STOPPED) break;
+        if (!vm_has_window(vm)) continue; // Warnings are already reported, keep going
+        // TODO: Implement graphics rendering on a separate thread for performance
+        if (!vm_present(vm)) break;
+    }
+
+    // If program didn't stop correctly, print state and exit with code 1
+    vm_print_state(vm);
+    finish(vm, 1);
+
+    return 0;
+}
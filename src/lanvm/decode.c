@@ -0,0 +1,423 @@
+/*  
+ * Lanskern ByteCode - A Virtual Machine & Assembler  
+ * Copyright (c) 2025 Benjamin Helle  
+ *  
+ * This file is part of Lanskern ByteCode.  
+ *  
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, either version 3 of the License, or  
+ * (at your option) any later version.  
+ *  
+ * Lanskern ByteCode is distributed in the hope that it will be useful,  
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of  
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the  
+ * GNU General Public License for more details.  
+ *  
+ * You should have received a copy of the GNU General Public License  
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.  
+ */
+#include "../include/lanvm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define LANVM_TABLE_MMAP
+#endif
+
+/*
+ * Predecoded instruction cache. Code is decoded lazily, one basic block at
+ * a time, into Insn records holding the handler, operand modes, offsets,
+ * immediates and fall-through PC, so the dispatch loop never touches the
+ * raw bytes again. The compare-and-branch and counter-loop idioms that end
+ * most blocks are fused into a single record, and instructions whose
+ * operands are all registers get handlers that skip operand resolution.
+ * Code and data share vm->memory: every store checks the per-address
+ * reference counts and retires the blocks it overlaps. In Harvard mode code
+ * is in vm->codeSpace, which no store reaches, so no reference is counted
+ * and nothing is retired.
+ */
+
+enum {
+    FMT_INVALID,
+    FMT_NONE, // opcode
+    FMT_DEST, // opcode DS [off8]
+    FMT_SRC, // opcode DS [off8]
+    FMT_DEST_SRC, // opcode DS [off8] [off8]
+    FMT_DEST_IMM16, // opcode DS [off8] imm16
+    FMT_DEST_IMM8, // opcode DS [off8] imm8
+    FMT_IMM16, // opcode imm16
+    FMT_IMM8 // opcode imm8
+};
+
+static const uint8_t formats[256] = {
+    [NOP] = FMT_NONE,
+    [LD_dest_src] = FMT_DEST_SRC, [LD_dest_imm16] = FMT_DEST_IMM16,
+    [PUSH_src] = FMT_SRC, [PUSH_imm16] = FMT_IMM16, [POP_dest] = FMT_DEST,
+    [ADD_dest_src] = FMT_DEST_SRC, [ADD_dest_imm16] = FMT_DEST_IMM16,
+    [SUB_dest_src] = FMT_DEST_SRC, [SUB_dest_imm16] = FMT_DEST_IMM16,
+    [AND_dest_src] = FMT_DEST_SRC, [AND_dest_imm16] = FMT_DEST_IMM16,
+    [OR_dest_src] = FMT_DEST_SRC, [OR_dest_imm16] = FMT_DEST_IMM16,
+    [XOR_dest_src] = FMT_DEST_SRC, [XOR_dest_imm16] = FMT_DEST_IMM16,
+    [CMP_dest_src] = FMT_DEST_SRC, [CMP_dest_imm16] = FMT_DEST_IMM16,
+    [MUL_dest_src] = FMT_DEST_SRC, [MUL_dest_imm16] = FMT_DEST_IMM16,
+    [DIV_dest_src] = FMT_DEST_SRC, [DIV_dest_imm16] = FMT_DEST_IMM16,
+    [NOT_dest] = FMT_DEST, [INC_dest] = FMT_DEST, [DEC_dest] = FMT_DEST,
+    [JMP_addr16 ... CALL_addr16] = FMT_IMM16,
+    [RET ... POPF] = FMT_NONE,
+    [SETZ_dest ... SETAE_dest] = FMT_NONE, // SETcc has no DS byte, it always targets r0
+    [IN_dest] = FMT_DEST, [OUT_src] = FMT_SRC, [GETS_r4] = FMT_NONE, [PRINTS_r3] = FMT_NONE,
+    [VMEXIT] = FMT_IMM8, [VMRESTART] = FMT_NONE, [VMGETMEMSIZE] = FMT_NONE, [VMSTATE] = FMT_NONE,
+    [VMMALLOC] = FMT_IMM16, [VMFREE] = FMT_IMM16, [VMBANK] = FMT_NONE,
+    [VMCHOPEN ... VMCHRECV] = FMT_NONE,
+    [GLINIT ... GLLINE] = FMT_NONE,
+    [LEA_dest_bpoff] = FMT_DEST_IMM8, [LIV_addr16] = FMT_IMM16, [HALT] = FMT_NONE
+};
+
+// Bytes past the end of the code decode as NOP
+static inline uint8_t codeByte(VM *vm, word_t addr) {
+  return addr < codeLimit(vm) ? codeBase(vm)[addr] : 0;
+}
+
+static inline bool hasOffset(uint8_t mode) {
+  return mode == 7 || mode == 8; // [bp+off8], [sp+off8]
+}
+
+// Instructions after which the next PC is not known at decode time
+static bool endsBlock(uint8_t opcode) {
+  switch (opcode) {
+      case JMP_addr16 ... INT:
+      case POPF: // May set HALT
+      case HALT:
+      case VMEXIT:
+      case VMRESTART:
+      case VMMALLOC:
+      case VMFREE:
+      case GLINIT:
+          return true;
+      default:
+          return formats[opcode] == FMT_INVALID;
+  }
+}
+
+// Decode the instruction at pc, returns true if it ends a basic block
+bool decodeInsn(VM *vm, word_t pc, Insn *ins, const void *const *handlers) {
+  memset(ins, 0, sizeof(*ins));
+  if (pc >= codeLimit(vm)) { // Running off the end of memory traps, so the dispatch loop never checks PC
+      ins->op = OP_PC_OOB;
+      ins->next = pc;
+      if (handlers) ins->handler = handlers[OP_PC_OOB];
+      return true;
+  }
+  uint8_t opcode = codeByte(vm, pc++);
+  uint8_t fmt = formats[opcode];
+  ins->op = opcode;
+  ins->opcode = opcode;
+
+  if (fmt == FMT_DEST || fmt == FMT_SRC || fmt == FMT_DEST_SRC || fmt == FMT_DEST_IMM16 || fmt == FMT_DEST_IMM8) {
+      DSbyte DS = decodeDS(codeByte(vm, pc++));
+      ins->dest = DS.destReg;
+      ins->src = DS.srcReg;
+      if (fmt != FMT_SRC && hasOffset(ins->dest)) ins->doff = codeByte(vm, pc++);
+      if ((fmt == FMT_SRC || fmt == FMT_DEST_SRC) && hasOffset(ins->src)) ins->soff = codeByte(vm, pc++);
+  }
+  if (fmt == FMT_DEST_IMM16 || fmt == FMT_IMM16) {
+      for (int i = 0; i < WORD_BYTES; i++) ins->imm |= (word_t)codeByte(vm, pc + i) << 8 * i;
+      pc += WORD_BYTES;
+  } else if (fmt == FMT_DEST_IMM8 || fmt == FMT_IMM8) {
+      ins->imm = codeByte(vm, pc++);
+  }
+  ins->next = pc;
+  if (handlers) ins->handler = handlers[opcode];
+  return endsBlock(opcode);
+}
+
+#ifdef LANVM_GUARDED
+// Memory operands of a decoded instruction, bit 0 the destination, bit 1 the source
+uint8_t memOperands(const Insn *ins) {
+  uint8_t fmt = formats[ins->opcode];
+  uint8_t mem = 0;
+  if ((fmt == FMT_DEST || fmt == FMT_DEST_SRC || fmt == FMT_DEST_IMM16 || fmt == FMT_DEST_IMM8) && ins->dest >= 7) mem |= 1;
+  if ((fmt == FMT_SRC || fmt == FMT_DEST_SRC) && ins->src >= 7) mem |= 2;
+  return mem;
+}
+#endif
+
+#ifdef LANVM_WORD32
+/*
+ * The tables can't cover the 4 GiB a 32-bit address reaches, so they are
+ * split in pages of CODE_PAGE entries. Pages are allocated when first
+ * written, until then they share an all-zero page, and the page tables
+ * grow with memory (or the code space) and are never shrunk. Entries run
+ * MAX_INSN_SIZE past the end, where the last instruction's operands may
+ * reach. A block decoded at an address past them is not cached.
+ */
+static uint8_t noRefs[CODE_PAGE];
+static Block *noBlocks[CODE_PAGE];
+
+static inline bool inTable(VM *vm, word_t pc) {
+  return pc < vm->code.size;
+}
+
+static inline Block *blockAt(VM *vm, word_t pc) {
+  return vm->code.blocks[pc >> CODE_PAGE_SHIFT][pc & (CODE_PAGE - 1)];
+}
+
+// Give the pages holding addr entries of their own, returns 1 if out of memory
+static int ownPage(VM *vm, word_t addr) {
+  size_t page = addr >> CODE_PAGE_SHIFT;
+  if (!inTable(vm, addr)) return 0;
+  if (vm->code.blocks[page] == noBlocks) {
+      Block **blocks = calloc(CODE_PAGE, sizeof(Block *));
+      if (!blocks) return 1;
+      vm->code.blocks[page] = blocks;
+  }
+  if (vm->code.refs[page] == noRefs) {
+      uint8_t *refs = calloc(CODE_PAGE, 1);
+      if (!refs) return 1;
+      vm->code.refs[page] = refs;
+  }
+  return 0;
+}
+
+static inline void setBlock(VM *vm, word_t pc, Block *b) {
+  vm->code.blocks[pc >> CODE_PAGE_SHIFT][pc & (CODE_PAGE - 1)] = b;
+}
+
+static inline uint8_t *refAt(VM *vm, word_t addr) {
+  return &vm->code.refs[addr >> CODE_PAGE_SHIFT][addr & (CODE_PAGE - 1)];
+}
+
+int codeInit(VM *vm) {
+  memset(&vm->code, 0, sizeof(vm->code));
+  return codeResize(vm, vm->memSize) || codeResize(vm, codeLimit(vm));
+}
+
+int codeResize(VM *vm, word_t limit) {
+  size_t pages = (((size_t)limit + MAX_INSN_SIZE) >> CODE_PAGE_SHIFT) + 1, old = vm->code.size >> CODE_PAGE_SHIFT;
+  if (pages <= old) return 0;
+  Block ***blocks = realloc(vm->code.blocks, pages * sizeof(*blocks));
+  if (!blocks) return 1;
+  vm->code.blocks = blocks;
+  uint8_t **refs = realloc(vm->code.refs, pages * sizeof(*refs));
+  if (!refs) return 1;
+  vm->code.refs = refs;
+  for (size_t i = old; i < pages; i++) {
+      blocks[i] = noBlocks;
+      refs[i] = noRefs;
+  }
+  vm->code.size = pages << CODE_PAGE_SHIFT;
+  return 0;
+}
+
+// Free the pages of their own and put every entry back to the shared page
+static void releasePages(VM *vm) {
+  for (size_t i = 0; i < vm->code.size >> CODE_PAGE_SHIFT; i++) {
+      if (vm->code.blocks[i] != noBlocks) free(vm->code.blocks[i]);
+      if (vm->code.refs[i] != noRefs) free(vm->code.refs[i]);
+      vm->code.blocks[i] = noBlocks;
+      vm->code.refs[i] = noRefs;
+  }
+}
+#else
+static inline bool inTable(VM *vm, word_t pc) {
+  (void)vm;
+  (void)pc;
+  return true; // The tables cover the 16-bit address space
+}
+
+static inline Block *blockAt(VM *vm, word_t pc) {
+  return vm->code.blocks[pc];
+}
+
+static inline int ownPage(VM *vm, word_t addr) {
+  (void)vm;
+  (void)addr;
+  return 0;
+}
+
+static inline void setBlock(VM *vm, word_t pc, Block *b) {
+  vm->code.blocks[pc] = b;
+}
+
+static inline uint8_t *refAt(VM *vm, word_t addr) {
+  return &vm->code.refs[addr];
+}
+
+#define TABLE_BYTES (0x10000 * (sizeof(Block *) + sizeof(uint8_t))) // blocks, then refs
+
+/*
+ * A program touches the table entries of the code it runs and no others.
+ * Fresh anonymous pages read as zero without being cleared or backed, so
+ * with mmap a VM (a clone in particular) starts without writing 576 KiB.
+ */
+int codeInit(VM *vm) {
+  memset(&vm->code, 0, sizeof(vm->code));
+#ifdef LANVM_TABLE_MMAP
+  uint8_t *tables = mmap(NULL, TABLE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (tables == MAP_FAILED) return 1;
+#else
+  uint8_t *tables = calloc(TABLE_BYTES, 1);
+  if (!tables) return 1;
+#endif
+  vm->code.blocks = (Block **)tables;
+  vm->code.refs = tables + 0x10000 * sizeof(Block *);
+  vm->code.size = 0x10000;
+  return 0;
+}
+#endif
+
+static void freeBlocks(VM *vm) {
+  Block *b = vm->code.all;
+  while (b) {
+      Block *next = b->nextAlloc;
+      free(b);
+      b = next;
+  }
+  vm->code.all = NULL;
+}
+
+void flushCode(VM *vm) {
+  freeBlocks(vm);
+  jitFlush(vm);
+  vm->code.retiredCount = 0;
+  vm->code.flushPending = false;
+#ifdef LANVM_WORD32
+  releasePages(vm);
+#else
+  memset(vm->code.blocks, 0, vm->code.size * sizeof(Block *));
+  memset(vm->code.refs, 0, vm->code.size * sizeof(uint8_t));
+#endif
+}
+
+void codeFree(VM *vm) {
+  if (!vm->code.blocks) return;
+  freeBlocks(vm); // Not flushCode(), clearing the tables before freeing them only costs page faults
+#ifdef LANVM_WORD32
+  releasePages(vm);
+  free(vm->code.refs);
+  free(vm->code.blocks);
+#elif defined(LANVM_TABLE_MMAP)
+  munmap(vm->code.blocks, TABLE_BYTES);
+#else
+  free(vm->code.blocks);
+#endif
+  vm->code.blocks = NULL;
+  vm->code.refs = NULL;
+}
+
+static void retireBlock(VM *vm, Block *b) {
+  b->valid = false;
+  if (inTable(vm, b->start)) setBlock(vm, b->start, NULL);
+  for (word_t a = b->start; a != b->end && inTable(vm, a); a++) {
+      uint8_t *refs = refAt(vm, a);
+      if (*refs != 0xFF) (*refs)--; // Saturated counts stay conservative
+  }
+  vm->code.retiredCount++;
+  vm->code.invalidated++;
+}
+
+// Retire every block overlapping [addr, addr+len)
+void invalidateCode(VM *vm, word_t addr, uint16_t len) {
+  if (vm->codeSpace) return; // addr is data, the blocks index the code space
+  size_t end = (size_t)addr + len;
+  saddr_t first = (saddr_t)addr - MAX_BLOCK_INSNS * MAX_INSN_SIZE;
+  if (first < 0) first = 0;
+  for (size_t start = first; start < end && start < vm->code.size; start++) {
+      Block *b = blockAt(vm, start);
+      if (b && b->end > addr) retireBlock(vm, b);
+  }
+}
+
+// Replace a flag-setting register instruction followed by JZ/JNZ with one fused record
+static bool fuseBranch(Insn *first, const Insn *branch, const void *const *handlers) {
+  bool jz = branch->op == JZ_addr16;
+  uint16_t op;
+  if (!jz && branch->op != JNZ_addr16) return false;
+  if (first->dest >= 7) return false; // Register operands only
+
+  if (first->op == CMP_dest_imm16) op = jz ? OP_CMP_JZ : OP_CMP_JNZ;
+  else if (first->op == DEC_dest && !jz) op = OP_DEC_JNZ;
+  else if (first->op == OR_dest_src && first->src == first->dest) op = jz ? OP_OR_JZ : OP_OR_JNZ;
+  else return false;
+
+  first->op = op;
+  first->target = branch->imm;
+  first->next = branch->next;
+  if (handlers) first->handler = handlers[op];
+  return true;
+}
+
+#define REG_ALU_FORMS(name, op) [name##_dest_src] = OP_##name##_RR, [name##_dest_imm16] = OP_##name##_RI,
+
+// Register forms of the opcodes, for operands in modes 0-6
+static const uint16_t regForms[256] = {
+    [LD_dest_src] = OP_LD_RR, [LD_dest_imm16] = OP_LD_RI,
+    [CMP_dest_src] = OP_CMP_RR, [CMP_dest_imm16] = OP_CMP_RI,
+    REG_ALU_OPS(REG_ALU_FORMS)
+    [NOT_dest] = OP_NOT_R, [INC_dest] = OP_INC_R, [DEC_dest] = OP_DEC_R,
+    [PUSH_src] = OP_PUSH_R, [POP_dest] = OP_POP_R
+};
+
+// Switch an instruction without memory operands to its register form
+static void specialise(Insn *ins, const void *const *handlers) {
+  if (ins->op > 0xFF || !regForms[ins->op]) return;
+  uint8_t fmt = formats[ins->op];
+  if (fmt != FMT_SRC && ins->dest >= 7) return;
+  if ((fmt == FMT_SRC || fmt == FMT_DEST_SRC) && ins->src >= 7) return;
+  ins->op = regForms[ins->op];
+  if (handlers) ins->handler = handlers[ins->op];
+}
+
+// Valid block decoded at pc, NULL if there is none
+Block *findBlock(VM *vm, word_t pc) {
+  return inTable(vm, pc) ? blockAt(vm, pc) : NULL;
+}
+
+Block *getBlock(VM *vm, word_t pc, const void *const *handlers) {
+  Block *b = findBlock(vm, pc);
+  if (b) return b;
+
+  Insn insns[MAX_BLOCK_INSNS];
+  uint16_t count = 0;
+  word_t addr = pc;
+  while (count < MAX_BLOCK_INSNS) {
+      bool ends = decodeInsn(vm, addr, &insns[count], handlers);
+      addr = insns[count++].next;
+      if (ends || addr >= codeLimit(vm) || addr < pc) break; // Stop at the end of memory
+  }
+  uint16_t length = count;
+  if (count >= 2 && fuseBranch(&insns[count - 2], &insns[count - 1], handlers)) count--;
+  for (uint16_t i = 0; i < count; i++) specialise(&insns[i], handlers);
+
+  // The table entries it is entered in come first, a block spans two pages at most
+  b = ownPage(vm, pc) || ownPage(vm, addr - 1) ? NULL : malloc(sizeof(Block) + (count + 1) * sizeof(Insn));
+  if (!b) {
+      vm_exception(vm, ERR_MALLOC, EXC_SEVERE, "Failed to allocate decoded block\n");
+      return NULL;
+  }
+  b->start = pc;
+  b->end = addr;
+  b->count = count;
+  b->length = length;
+  b->valid = true;
+  b->noJit = false;
+  b->entries = 0;
+  b->native = NULL;
+  b->nativeResume = -1;
+  b->succ[0] = b->succ[1] = NULL;
+  memcpy(b->insns, insns, count * sizeof(Insn));
+  memset(&b->insns[count], 0, sizeof(Insn));
+  b->insns[count].op = OP_END;
+  b->insns[count].next = addr;
+  if (handlers) b->insns[count].handler = handlers[OP_END];
+
+  b->nextAlloc = vm->code.all;
+  vm->code.all = b;
+  if (inTable(vm, pc)) setBlock(vm, pc, b);
+  for (word_t a = pc; a != addr && inTable(vm, a) && !vm->codeSpace; a++) {
+      uint8_t *refs = refAt(vm, a);
+      if (*refs != 0xFF) (*refs)++;
+  }
+  vm->code.decoded++;
+  return b;
+}
@@ -26,73 +26,64 @@ DSbyte decodeDS(uint8_t DSb) {
   return DS;
 }
 
-uint8_t* RegOffset(VM *vm, bool reg, int8_t offset) {
-  if (reg) { // SP
-      if (vm->sp + offset > vm->memSize || vm->sp + offset < 0) { // Prevent accessing memory out of bounds
-          vm_exception(vm, ERR_OOB_OFF, EXC_WARNING, 0);
-          return NULL;
-      }
-      return &vm->memory[vm->sp + offset];
-  } else { // BP
-      if (vm->bp + offset > vm->memSize || vm->bp + offset < 0) { // Prevent accessing memory out of bounds
-          vm_exception(vm, ERR_OOB_OFF, EXC_WARNING, 0);
-          return NULL;
-      }
-      return &vm->memory[vm->bp + offset];
-  }
+#define NO_ADDRESS INT32_MIN
+
+// Effective address of a memory operand, not checked against memSize
+static inline saddr_t effectiveAddress(VM *vm, uint8_t mode, int8_t offset) {
+  if (mode == 7 || mode == 8) return (saddr_t)(mode == 8 ? vm->sp : vm->bp) + offset; // [bp+offset8], [sp+offset8]
+  return mode == 9 ? vm->r[3] : mode == 10 ? vm->r[4] : 0; // [r3], [r4], modes past [r4] address byte 0
 }
 
-void* GetDestination(VM *vm, uint8_t DSb) {
-  uint16_t *dest[16] = {&vm->r[0], &vm->r[1], &vm->r[2], &vm->r[3], &vm->r[4], &vm->bp, &vm->sp, &vm->r[3], &vm->r[4], NULL, NULL, NULL, NULL, NULL, NULL};
-  DSbyte DS = decodeDS(DSb);
+static void reportOutOfBounds(VM *vm, uint8_t mode, saddr_t addr) {
+  if (mode == 7 || mode == 8) vm_exception(vm, ERR_OOB_OFF, EXC_WARNING, 0);
+  else vm_exception(vm, ERR_OOB_REG, EXC_WARNING, "Indirect address: 0x%04x\n", (unsigned)addr);
+}
 
-  if (DS.destReg >= 7) { // Memory destination
-      uint16_t addr = 0;
-      if (DS.destReg == 7) { // [bp+offset8]
-          return RegOffset(vm, 0, fByte(vm));
-      } else if (DS.destReg == 8) { // [sp+offset8]
-          return RegOffset(vm, 1, fByte(vm));
-      }
-      else if (DS.destReg == 9) addr = vm->r[3]; // [r3]
-      else if (DS.destReg == 10) addr = vm->r[4]; // [r4]
-      if (addr < 0 || addr > vm->memSize) { // Prevent accessing memory out of bounds
-          vm_exception(vm, ERR_OOB_REG, EXC_WARNING, "Indirect address: 0x%04x\n", addr);
-          return NULL;
-      }
-      return &vm->memory[addr];
-  } else { // Register destination
-      return (uint16_t*)dest[DS.destReg];
+// Address of a memory operand, NO_ADDRESS once an out of bounds access was reported
+static saddr_t operandAddress(VM *vm, uint8_t mode, int8_t offset) {
+  saddr_t addr = effectiveAddress(vm, mode, offset);
+#ifndef LANVM_GUARDED // Guarded memory faults instead, see memory.c
+  if (addr > vm->memSize || addr < 0) { // Prevent accessing memory out of bounds
+      reportOutOfBounds(vm, mode, addr);
+      return NO_ADDRESS;
   }
+#endif
+  return addr;
+}
 
-  return NULL;
+void* ResolveDestination(VM *vm, uint8_t mode, int8_t offset) {
+  if (mode < 7) return &vm->regs[mode]; // Register destination
+  saddr_t addr = operandAddress(vm, mode, offset);
+  return addr == NO_ADDRESS ? NULL : memAt(vm, addr);
 }
 
-uint16_t GetSource(VM *vm, uint8_t DSb) {
-  uint16_t *src[16] = {&vm->r[0], &vm->r[1], &vm->r[2], &vm->r[3], &vm->r[4], &vm->bp, &vm->sp, &vm->r[3], &vm->r[4], NULL, NULL, NULL, NULL, NULL, NULL};
-  DSbyte DS = decodeDS(DSb);
+word_t ResolveSource(VM *vm, uint8_t mode, int8_t offset) {
+  if (mode < 7) return vm->regs[mode]; // Register source
+  saddr_t addr = operandAddress(vm, mode, offset);
+  return addr == NO_ADDRESS ? 0 : memWord(vm, addr);
+}
 
-  if (DS.srcReg >= 7) { // Memory source
-      uint16_t addr = 0;
-      if (DS.srcReg == 7) { // [bp+offset8]
-          return *RegOffset(vm, 0, fByte(vm));
-      } else if (DS.srcReg == 8) { // [sp+offset8]
-          return *RegOffset(vm, 1, fByte(vm));
-      }
-      else if (DS.srcReg == 9) addr = vm->r[3]; // [r3]
-      else if (DS.srcReg == 10) addr = vm->r[4]; // [r4]
-      if (addr < 0 || addr > vm->memSize) { // Prevent accessing memory out of bounds
-          vm_exception(vm, ERR_OOB_REG, EXC_WARNING, "Indirect address: 0x%04x\n", addr);
-          return 0;
-      }
-      return vm->memory[addr];
-  } else { // Register source
-      return *src[DS.srcReg];
-  }
+#ifdef LANVM_GUARDED
+static bool operandFaults(VM *vm, uint8_t mode, int8_t offset) {
+  saddr_t addr = effectiveAddress(vm, mode, offset);
+  if (addr >= 0 && (size_t)addr + 2 <= vm->committed) return false;
+  reportOutOfBounds(vm, mode, addr);
+  return true;
+}
 
-  return 0;
+// Report a guarded memory fault of ins (NULL if unknown) as its out of bounds operands
+void operandFault(VM *vm, const Insn *ins) {
+  uint8_t mem = ins ? memOperands(ins) : 0;
+  bool reported = (mem & 1) && operandFaults(vm, ins->dest, ins->doff);
+  if ((mem & 2) && operandFaults(vm, ins->src, ins->soff)) reported = true;
+  if (!reported) reportOutOfBounds(vm, 9, vm->faultAddress); // Strings of GETS/PRINTS
 }
+#endif
 
-uint16_t* GetReg(VM *vm, uint8_t reg) {
-  uint16_t *regs[16] = {&vm->r[0], &vm->r[1], &vm->r[2], &vm->r[3], &vm->r[4], &vm->bp, &vm->sp, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
-  return regs[reg];
-}
\ No newline at end of file
+// Both operands of a dest, src instruction, destination first
+Operands ResolveOperands(VM *vm, const Insn *ins) {
+  Operands ops;
+  ops.dest = ResolveDestination(vm, ins->dest, ins->doff);
+  ops.src = ResolveSource(vm, ins->src, ins->soff);
+  return ops;
+}
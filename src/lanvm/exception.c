@@ -19,8 +19,14 @@
  */
 #include "../include/lanvm.h"
 
+// Byte of the program as it was loaded, 0 outside it
+static uint8_t programByte(VM *vm, word_t addr) {
+  return vm->program && addr < vm->progSize ? vm->program[addr] : 0;
+}
+
 int vm_exception(VM *vm, int code, int severity, char *fmt, ...) {
   if (code == ERR_NO_ERROR) return 0; // No error
+  if (severity == EXC_WARNING) vm->exception = code; // Reported by vm_run()
   va_list args;
   va_start(args, fmt);
   printf("======================================================\nVM Runtime Exception: code %d severity %d at PC 0x%04x:\n", code, severity, vm->pc);
@@ -30,8 +36,8 @@ int vm_exception(VM *vm, int code, int severity, char *fmt, ...) {
       case ERR_OOB_OFF:
           printf("Offset out of bounds\n");
           printf("BP: %d\n", vm->bp);
-          printf("Offset: %d\n", vm->program[vm->pc - 1]);
-          printf("BP+Offset: %d\n", vm->bp+vm->program[vm->pc - 1]);
+          printf("Offset: %d\n", programByte(vm, vm->pc - 1));
+          printf("BP+Offset: %d\n", vm->bp+programByte(vm, vm->pc - 1));
           printf("Valid address range: 0x0000 - 0x%04x\n", vm->memSize);
           break;
       case ERR_OOB_REG:
@@ -73,11 +79,11 @@ int vm_exception(VM *vm, int code, int severity, char *fmt, ...) {
 
   }
   printf("Additional information:\n");
-  vprintf(fmt, args);
+  if (fmt) vprintf(fmt, args); // Severe exceptions may have nothing to add
   printState(vm);
   printf("======================================================\n");
   va_end(args);
-  if (severity == EXC_SEVERE) { // Exit if severity is severe
+  if (severity == EXC_SEVERE) { // End the program, vm_run() returns VM_EXITED
       vm_exit(vm, code);
   }
   return code;
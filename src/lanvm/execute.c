@@ -19,314 +19,587 @@
  */
 #include "../include/lanvm.h"
 
-int execute(VM *vm) {
-  uint8_t opcode = fByte(vm);
-  uint8_t DSb = 0;
-  uint16_t* dest;
-  switch(opcode) {
+/*
+ * Instruction dispatch. Handlers run on predecoded instructions (see
+ * decode.c). With LANVM_THREADED (GCC/Clang) each decoded instruction
+ * carries the address of its handler label and every handler ends in its
+ * own indirect jump, otherwise the handlers are the cases of a portable
+ * switch. Both build from the same handler bodies below.
+ */
+#ifdef LANVM_THREADED
+#define INSN(op) L_##op:
+#define INVALID L_INVALID:
+#define DISPATCH() do { vm->pc = ins->next; goto *ins->handler; } while (0)
+#define DISPATCH_BEGIN DISPATCH();
+#define DISPATCH_END
+#else
+#define INSN(op) case op:
+#define INVALID default:
+#define DISPATCH() goto dispatch
+#define DISPATCH_BEGIN dispatch: vm->pc = ins->next; switch (ins->op) {
+#define DISPATCH_END }
+#endif
+
+// Continue with the next instruction of the block, unless single-stepping
+#define NEXT() do { \
+    if (step) goto chain; \
+    ins++; \
+    DISPATCH(); \
+  } while (0)
+
+// Control transfers leave the block, the successor is looked up in chain
+#define NEXT_BRANCH() goto chain
+
+// Instructions that may have written a memory destination. A store into
+// the running block retires it, so execution resumes from a fresh decode.
+#define NEXT_STORE(ptr) do { \
+    if (ins->dest >= 7 && (ptr)) { \
+      ptrWritten(vm, (ptr), WORD_BYTES); \
+      if (!step && !block->valid) goto invalidated; \
+    } \
+    NEXT(); \
+  } while (0)
+
+// Register forms of the ALU instructions, a load, the operation and a store
+#define REG_ALU_LABELS(name, op) [OP_##name##_RR] = &&L_OP_##name##_RR, [OP_##name##_RI] = &&L_OP_##name##_RI,
+#define REG_ALU_HANDLERS(name, op) \
+    INSN(OP_##name##_RR) \
+        modifyFlags(vm, vm->regs[ins->dest] = (uint32_t)vm->regs[ins->dest] op vm->regs[ins->src]); \
+        NEXT(); \
+    INSN(OP_##name##_RI) \
+        modifyFlags(vm, vm->regs[ins->dest] = (uint32_t)vm->regs[ins->dest] op ins->imm); \
+        NEXT();
+
+#ifdef LANVM_GUARDED
+// The record of block that faulted, PC was already advanced past it
+static const Insn *faultingInsn(const Block *block, word_t pc) {
+  if (!block) return NULL;
+  for (const Insn *ins = block->insns; ins < &block->insns[block->count]; ins++) {
+      if (ins->next == pc) return ins;
+  }
+  return NULL;
+}
+#endif
+
+static inline VMStop run(VM *vm, bool step, uint64_t limit) {
+  word_t* dest;
+  Operands ops;
+  Block *block = NULL;
+  const Insn *ins;
+  Insn single[2];
+  word_t stepPc = vm->pc;
+#ifdef LANVM_GUARDED
+  sigjmp_buf fault;
+#endif
+#ifdef LANVM_THREADED
+  static const void *handlers[OP_COUNT] = {
+      [0 ... OP_COUNT - 1] = &&L_INVALID,
+      [LD_dest_src] = &&L_LD_dest_src, [LD_dest_imm16] = &&L_LD_dest_imm16,
+      [PUSH_src] = &&L_PUSH_src, [PUSH_imm16] = &&L_PUSH_imm16, [POP_dest] = &&L_POP_dest,
+      [ADD_dest_src] = &&L_ADD_dest_src, [ADD_dest_imm16] = &&L_ADD_dest_imm16,
+      [SUB_dest_src] = &&L_SUB_dest_src, [SUB_dest_imm16] = &&L_SUB_dest_imm16,
+      [AND_dest_src] = &&L_AND_dest_src, [AND_dest_imm16] = &&L_AND_dest_imm16,
+      [OR_dest_src] = &&L_OR_dest_src, [OR_dest_imm16] = &&L_OR_dest_imm16,
+      [XOR_dest_src] = &&L_XOR_dest_src, [XOR_dest_imm16] = &&L_XOR_dest_imm16,
+      [CMP_dest_src] = &&L_CMP_dest_src, [CMP_dest_imm16] = &&L_CMP_dest_imm16,
+      [MUL_dest_src] = &&L_MUL_dest_src, [MUL_dest_imm16] = &&L_MUL_dest_imm16,
+      [DIV_dest_src] = &&L_DIV_dest_src, [DIV_dest_imm16] = &&L_DIV_dest_imm16,
+      [NOT_dest] = &&L_NOT_dest, [INC_dest] = &&L_INC_dest, [DEC_dest] = &&L_DEC_dest,
+      [JMP_addr16] = &&L_JMP_addr16, [JZ_addr16] = &&L_JZ_addr16, [JNZ_addr16] = &&L_JNZ_addr16,
+      [JC_addr16] = &&L_JC_addr16, [JNC_addr16] = &&L_JNC_addr16, [JLE_addr16] = &&L_JLE_addr16,
+      [JGE_addr16] = &&L_JGE_addr16, [JL_addr16] = &&L_JL_addr16, [JG_addr16] = &&L_JG_addr16,
+      [CALL_addr16] = &&L_CALL_addr16, [RET] = &&L_RET, [RETI] = &&L_RETI, [INT] = &&L_INT,
+      [EI] = &&L_EI, [DI] = &&L_DI, [CHK_INT] = &&L_CHK_INT, [PUSHF] = &&L_PUSHF,
+      [POPF] = &&L_POPF, [SETZ_dest] = &&L_SETZ_dest, [SETNZ_dest] = &&L_SETNZ_dest,
+      [SETL_dest] = &&L_SETL_dest, [SETLE_dest] = &&L_SETLE_dest, [SETG_dest] = &&L_SETG_dest,
+      [SETGE_dest] = &&L_SETGE_dest, [SETB_dest] = &&L_SETB_dest, [SETBE_dest] = &&L_SETBE_dest,
+      [SETA_dest] = &&L_SETA_dest, [SETAE_dest] = &&L_SETAE_dest, [IN_dest] = &&L_IN_dest,
+      [OUT_src] = &&L_OUT_src, [GETS_r4] = &&L_GETS_r4, [PRINTS_r3] = &&L_PRINTS_r3,
+      [VMEXIT] = &&L_VMEXIT, [VMRESTART] = &&L_VMRESTART, [VMGETMEMSIZE] = &&L_VMGETMEMSIZE,
+      [VMSTATE] = &&L_VMSTATE, [VMMALLOC] = &&L_VMMALLOC, [VMFREE] = &&L_VMFREE, [VMBANK] = &&L_VMBANK,
+      [VMCHOPEN] = &&L_VMCHOPEN, [VMCHSEND] = &&L_VMCHSEND, [VMCHRECV] = &&L_VMCHRECV,
+      [GLINIT] = &&L_GLINIT, [GLCLEAR] = &&L_GLCLEAR, [GLSETCOLOR] = &&L_GLSETCOLOR,
+      [GLPLOT] = &&L_GLPLOT, [GLLINE] = &&L_GLLINE, [GLRECT] = &&L_GLRECT,
+      [LEA_dest_bpoff] = &&L_LEA_dest_bpoff, [LIV_addr16] = &&L_LIV_addr16, [NOP] = &&L_NOP,
+      [HALT] = &&L_HALT, [OP_END] = &&L_OP_END, [OP_PC_OOB] = &&L_OP_PC_OOB,
+      [OP_CMP_JZ] = &&L_OP_CMP_JZ, [OP_CMP_JNZ] = &&L_OP_CMP_JNZ, [OP_DEC_JNZ] = &&L_OP_DEC_JNZ,
+      [OP_OR_JZ] = &&L_OP_OR_JZ, [OP_OR_JNZ] = &&L_OP_OR_JNZ,
+      [OP_LD_RR] = &&L_OP_LD_RR, [OP_LD_RI] = &&L_OP_LD_RI,
+      [OP_CMP_RR] = &&L_OP_CMP_RR, [OP_CMP_RI] = &&L_OP_CMP_RI,
+      REG_ALU_OPS(REG_ALU_LABELS)
+      [OP_NOT_R] = &&L_OP_NOT_R, [OP_INC_R] = &&L_OP_INC_R, [OP_DEC_R] = &&L_OP_DEC_R,
+      [OP_PUSH_R] = &&L_OP_PUSH_R, [OP_POP_R] = &&L_OP_POP_R
+  };
+#else
+  static const void **handlers = NULL;
+#endif
+
+  vm->exception = ERR_NO_ERROR;
+  vm->waiting = WAIT_NONE;
+  if (step) { // Decode just the instruction at PC, bypassing the block cache
+      decodeInsn(vm, vm->pc, &single[0], handlers);
+      vm->icount++;
+      ins = single;
+  }
+#ifdef LANVM_GUARDED
+  if (sigsetjmp(fault, 0)) { // An operand hit a guard page, locals are stale but vm is not
+      const Insn *at = step ? single : faultingInsn(vm->code.current, vm->pc);
+      operandFault(vm, at);
+      if (step || !at) goto chain;
+      block = vm->code.current;
+      ins = at;
+      goto invalidated;
+  }
+  memCatchFaults(vm, &fault);
+#endif
+  if (!step) goto chain;
 
+  DISPATCH_BEGIN
     // Load/Store
-    case LD_dest_src:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
-        if (!dest) {
+    INSN(LD_dest_src)
+        ops = ResolveOperands(vm, ins);
+        if (!ops.dest) {
             vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to LD\n");
-            break;
+            NEXT();
         }
-        *dest = GetSource(vm, DSb);
-        break;
-    case LD_dest_imm16:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+        *ops.dest = ops.src;
+        NEXT_STORE(ops.dest);
+    INSN(LD_dest_imm16)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         if (!dest) {
             vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to LD\n");
-            break;
+            NEXT();
         }
-        *dest = fWord(vm);
-        break;
+        *dest = ins->imm;
+        NEXT_STORE(dest);
 
     // Stack
-    case PUSH_src:
-        DSb = fByte(vm);
-        push16(vm, GetSource(vm, DSb));
-        break;
-    case PUSH_imm16:
-        push16(vm, fWord(vm));
-        break;
-    case POP_dest:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+    INSN(PUSH_src)
+        pushWord(vm, ResolveSource(vm, ins->src, ins->soff));
+        if (!step && !block->valid) goto invalidated;
+        NEXT();
+    INSN(PUSH_imm16)
+        pushWord(vm, ins->imm);
+        if (!step && !block->valid) goto invalidated;
+        NEXT();
+    INSN(POP_dest)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         if (!dest) {
             vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to POP\n");
-            break;
+            NEXT();
         }
-        *dest = pop16(vm);
-        break;
-        
+#ifdef LANVM_GUARDED
+        (void)*(volatile word_t *)dest; // Fault before popping, as the bounds check would
+#endif
+        *dest = popWord(vm);
+        NEXT_STORE(dest);
+
     // ALU
-    case ADD_dest_src:
-    case ADD_dest_imm16:
-    case SUB_dest_src:
-    case SUB_dest_imm16:
-    case AND_dest_src:
-    case AND_dest_imm16:
-    case OR_dest_src:
-    case OR_dest_imm16:
-    case XOR_dest_src:
-    case XOR_dest_imm16:
-    case CMP_dest_src:
-    case CMP_dest_imm16:
-    case MUL_dest_src:
-    case MUL_dest_imm16:
-    case DIV_dest_src:
-    case DIV_dest_imm16:
-        {
-            DSb = fByte(vm);
-            dest = GetDestination(vm, DSb);
-            if (opcode % 2 == 0) { // Even operations are dest, src
-                alu(vm, opcode, dest, GetSource(vm, DSb));
-            } else { // Odd operations are dest, imm16
-                alu(vm, opcode-1, dest, fWord(vm));
-            }
-        }
-        break;
-    case NOT_dest:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+    INSN(ADD_dest_src)
+    INSN(SUB_dest_src)
+    INSN(AND_dest_src)
+    INSN(OR_dest_src)
+    INSN(XOR_dest_src)
+    INSN(CMP_dest_src)
+    INSN(MUL_dest_src)
+    INSN(DIV_dest_src)
+        ops = ResolveOperands(vm, ins);
+        alu(vm, ins->op, ops.dest, ops.src);
+        NEXT_STORE(ops.dest);
+    INSN(ADD_dest_imm16)
+    INSN(SUB_dest_imm16)
+    INSN(AND_dest_imm16)
+    INSN(OR_dest_imm16)
+    INSN(XOR_dest_imm16)
+    INSN(CMP_dest_imm16)
+    INSN(MUL_dest_imm16)
+    INSN(DIV_dest_imm16)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
+        alu(vm, ins->op - 1, dest, ins->imm);
+        NEXT_STORE(dest);
+    INSN(NOT_dest)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         alu(vm, ALU_NOT, dest, 0);
-        break;
-    case INC_dest:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+        NEXT_STORE(dest);
+    INSN(INC_dest)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         alu(vm, ALU_INC, dest, 0);
-        break;
-    case DEC_dest:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+        NEXT_STORE(dest);
+    INSN(DEC_dest)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         alu(vm, ALU_DEC, dest, 0);
-        break;
+        NEXT_STORE(dest);
 
     // Control Flow
-    case JMP_addr16:
-        vm->pc = fWord(vm);
-        break;
-    case JZ_addr16:
-        if (vm->flags[ZERO_FLAG]) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JNZ_addr16:
-        if (!vm->flags[ZERO_FLAG]) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JC_addr16:
-        if (vm->flags[CARRY_FLAG]) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JNC_addr16:
-        if (!vm->flags[CARRY_FLAG]) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JLE_addr16:
-        if (vm->flags[OVERFLOW_FLAG] || (vm->flags[SIGN_FLAG] != vm->flags[ZERO_FLAG])) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JGE_addr16:
-        if (vm->flags[OVERFLOW_FLAG] == vm->flags[OVERFLOW_FLAG]) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JL_addr16:
-        if (vm->flags[SIGN_FLAG] != vm->flags[OVERFLOW_FLAG]) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case JG_addr16:
-        if (vm->flags[ZERO_FLAG] && (vm->flags[SIGN_FLAG] == vm->flags[OVERFLOW_FLAG])) {
-            vm->pc = fWord(vm);
-        } else vm->pc += 2;
-        break;
-    case CALL_addr16:
-        push16(vm, vm->pc + 2);
-        vm->pc = fWord(vm);
-        break;
-    case RET:
-        vm->pc = pop16(vm);
-        break;
-    case RETI:
-        vm->pc = pop16(vm);
-        vm->flags[IA_FLAG] = false;
-        break;
-    case INT:
-        if (vm->flags[IE_FLAG]) {
-            push16(vm, vm->pc);
-            vm->pc = vm->iv;
-            vm->flags[IA_FLAG] = true;   
-        }
-        break;
-    case EI:
-        vm->flags[IE_FLAG] = true;
-        break;
-    case DI:
-        vm->flags[IE_FLAG] = false;
-        break;
-    case CHK_INT:
-        vm->flags[ZERO_FLAG] = vm->flags[IA_FLAG] ? 0 : 1;
-        break;
-    case PUSHF:
-        {
-            uint8_t temp = 0;
-            temp |= vm->flags[ZERO_FLAG] << ZERO_FLAG;
-            temp |= vm->flags[CARRY_FLAG] << CARRY_FLAG;
-            temp |= vm->flags[OVERFLOW_FLAG] << OVERFLOW_FLAG;
-            temp |= vm->flags[SIGN_FLAG] << SIGN_FLAG;
-            temp |= vm->flags[HALT_FLAG] << HALT_FLAG;
-            temp |= vm->flags[IA_FLAG] << IA_FLAG;
-            temp |= vm->flags[IE_FLAG] << IE_FLAG;
-            push8(vm, temp);
+    INSN(JMP_addr16)
+        vm->pc = ins->imm;
+        NEXT_BRANCH();
+    INSN(JZ_addr16)
+    INSN(JNZ_addr16)
+    INSN(JC_addr16)
+    INSN(JNC_addr16)
+    INSN(JLE_addr16)
+    INSN(JGE_addr16)
+    INSN(JL_addr16)
+    INSN(JG_addr16)
+        if (testCond(vm, ins->op - JZ_addr16)) {
+            vm->pc = ins->imm;
         }
-        break;
-    case POPF:
-        {
-            uint8_t temp = pop8(vm);
-            vm->flags[ZERO_FLAG] = temp & (1 << ZERO_FLAG);
-            vm->flags[CARRY_FLAG] = temp & (1 << CARRY_FLAG);
-            vm->flags[OVERFLOW_FLAG] = temp & (1 << OVERFLOW_FLAG);
-            vm->flags[SIGN_FLAG] = temp & (1 << SIGN_FLAG);
-            vm->flags[HALT_FLAG] = temp & (1 << HALT_FLAG);
-            vm->flags[IA_FLAG] = temp & (1 << IA_FLAG);
-            vm->flags[IE_FLAG] = temp & (1 << IE_FLAG);
-            vm->flags[7] = temp & (1 << 7);
+        NEXT_BRANCH();
+    INSN(CALL_addr16)
+        pushWord(vm, ins->next);
+        vm->pc = ins->imm;
+        NEXT_BRANCH();
+    INSN(RET)
+        vm->pc = popWord(vm);
+        NEXT_BRANCH();
+    INSN(RETI)
+        vm->pc = popWord(vm);
+        setFlag(vm, IA_FLAG, false);
+        NEXT_BRANCH();
+    INSN(INT)
+        if (vm->flags & FLAG_BIT(IE_FLAG)) {
+            pushWord(vm, vm->pc);
+            vm->pc = vm->iv;
+            setFlag(vm, IA_FLAG, true);
         }
-        break;
+        NEXT_BRANCH();
+    INSN(EI)
+        setFlag(vm, IE_FLAG, true);
+        NEXT();
+    INSN(DI)
+        setFlag(vm, IE_FLAG, false);
+        NEXT();
+    INSN(CHK_INT)
+        syncFlags(vm);
+        setFlag(vm, ZERO_FLAG, !(vm->flags & FLAG_BIT(IA_FLAG)));
+        NEXT();
+    INSN(PUSHF)
+        push8(vm, flagByte(vm) & 0x7f); // Bit 7 is not pushed
+        if (!step && !block->valid) goto invalidated;
+        NEXT();
+    INSN(POPF)
+        vm->flags = pop8(vm);
+        vm->lazyFlags = false;
+        NEXT_BRANCH(); // May have set HALT
 
-    case SETZ_dest:
-    case SETNZ_dest:
-    case SETL_dest:
-    case SETLE_dest:
-    case SETG_dest:
-    case SETGE_dest:
-    case SETB_dest:
-    case SETBE_dest:
-    case SETA_dest:
-    case SETAE_dest:
-        handleSET(vm, opcode, DSb);
-        break;
+    INSN(SETZ_dest)
+    INSN(SETNZ_dest)
+    INSN(SETL_dest)
+    INSN(SETLE_dest)
+    INSN(SETG_dest)
+    INSN(SETGE_dest)
+    INSN(SETB_dest)
+    INSN(SETBE_dest)
+    INSN(SETA_dest)
+    INSN(SETAE_dest)
+        handleSET(vm, ins->op, 0);
+        NEXT();
 
     // I/O
-    case IN_dest:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+    INSN(IN_dest)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         if (!dest) {
             vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to IN\n");
-            break;
+            NEXT();
         }
-        *dest = getchar();
-        break;
-    case OUT_src:
-        DSb = fByte(vm);
-        printf("%c", GetSource(vm, DSb));
-        break;
-    case GETS_r4:
+        {
+            int ch = inputChar(vm);
+            if (ch == INPUT_WAIT) goto ioWait;
+            *dest = ch;
+        }
+        NEXT_STORE(dest);
+    INSN(OUT_src)
+        printf("%c", ResolveSource(vm, ins->src, ins->soff));
+        NEXT();
+    INSN(GETS_r4)
         {
             char c;
-            dest = GetDestination(vm, 0xA0);
+            dest = ResolveDestination(vm, 10, 0); // [r4]
             if (!dest) {
                 vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to GETS\n");
-                break;
+                NEXT();
             }
+            if (!inputLine(vm)) goto ioWait;
+            // Characters are stored as words, byte address by address as a
+            // string may run into or out of a window
+            uint64_t start = vm->r[r4], addr = start;
+            int ch;
             *dest = '\0';
-            while ((c = getchar()) != '\n') {
-                *dest = c;
-                dest++;
+            while ((ch = inputChar(vm)) != '\n' && ch != EOF) {
+                if (addr > vm->memSize) {
+                    vm_exception(vm, ERR_OOB_REG, EXC_WARNING, "Indirect address: 0x%04x\n", (unsigned)addr);
+                    break;
+                }
+                c = ch;
+                *(word_t *)memAt(vm, addr) = c;
+                addr += WORD_BYTES;
                 vm->r[r3]++;
             }
+            uint64_t end = addr + WORD_BYTES;
+            for (uint64_t page = start >> DIRTY_PAGE_SHIFT; page <= (end - 1) >> DIRTY_PAGE_SHIFT && page < DIRTY_PAGES; page++) {
+                vm->dirty[page] = 1;
+            }
+            invalidateCode(vm, start, end - start);
         }
-        break;
-    case PRINTS_r3:
+        if (!step && !block->valid) goto invalidated;
+        NEXT();
+    INSN(PRINTS_r3)
         {
             char c = '\0';
-            uint16_t* src = GetDestination(vm, 0x90);
+            word_t* src = ResolveDestination(vm, 9, 0); // [r3]
             if (!src) {
                 vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to PRINTS\n");
-                break;
+                NEXT();
             }
-            while ((c = *src++) != '\0') {
+            for (uint64_t addr = vm->r[r3]; (c = *memAt(vm, addr)) != '\0'; addr += WORD_BYTES) { // Low bytes of words
                 printf("%c", c);
                 vm->r[r3]++;
+                if (addr + WORD_BYTES > vm->memSize) {
+                    vm_exception(vm, ERR_OOB_REG, EXC_WARNING, "Indirect address: 0x%04x\n", (unsigned)(addr + WORD_BYTES));
+                    break;
+                }
             }
         }
-        break;
+        NEXT();
 
     // Hypervisor calls
-    case VMEXIT:
-        hypervisorCall(vm, 0x00, (uint16_t)fByte(vm));
-        break;
-    case VMRESTART:
+    INSN(VMEXIT)
+        hypervisorCall(vm, 0x00, ins->imm);
+        NEXT_BRANCH();
+    INSN(VMRESTART)
         hypervisorCall(vm, 0x01, 0);
-        break;
-    case VMGETMEMSIZE:
+        NEXT_BRANCH();
+    INSN(VMGETMEMSIZE)
         hypervisorCall(vm, 0x02, 0);
-        break;
-    case VMSTATE: // Print current state, use for debugging
+        NEXT();
+    INSN(VMSTATE) // Print current state, use for debugging
         printState(vm);
-        break;
-    case VMMALLOC:
-        vm->flags[ZERO_FLAG] = hypervisorCall(vm, 0x05, fWord(vm)); // 0 = success, 1 = failure
-        break;
-    case VMFREE:
-        vm->flags[ZERO_FLAG] = hypervisorCall(vm, 0x06, fWord(vm)); // 0 = success, 1 = failure
-        break;
+        NEXT();
+    INSN(VMMALLOC)
+        syncFlags(vm);
+        setFlag(vm, ZERO_FLAG, hypervisorCall(vm, 0x05, ins->imm)); // 0 = success, 1 = failure
+        NEXT_BRANCH();
+    INSN(VMFREE)
+        syncFlags(vm);
+        setFlag(vm, ZERO_FLAG, hypervisorCall(vm, 0x06, ins->imm)); // 0 = success, 1 = failure
+        NEXT_BRANCH();
+    INSN(VMBANK)
+        syncFlags(vm);
+        setFlag(vm, ZERO_FLAG, hypervisorCall(vm, 0x07, 0)); // 0 = success, 1 = failure
+        NEXT();
+    INSN(VMCHOPEN)
+        syncFlags(vm);
+        setFlag(vm, ZERO_FLAG, hypervisorCall(vm, 0x08, 0)); // 0 = success, 1 = failure
+        NEXT();
+    INSN(VMCHSEND)
+    INSN(VMCHRECV)
+        {
+            int failed = hypervisorCall(vm, 0x09 + ins->op - VMCHSEND, 0);
+            if (failed == CALL_WAIT) goto ioWait;
+            syncFlags(vm);
+            setFlag(vm, ZERO_FLAG, failed);
+        }
+        if (!step && !block->valid) goto invalidated; // A receive may have stored into it
+        NEXT();
 
     // Graphics
-    case GLINIT:
-        GRAPHICS = true;
+    INSN(GLINIT)
         vm->screenWidth = vm->r[1];
         vm->screenHeight = vm->r[2];
         langlInit(vm);
-        break;
-    case GLCLEAR:
+        return VM_IO_WAIT; // Hand back to the host so it can start rendering
+    INSN(GLCLEAR)
         langlClear(vm);
-        break;
-    case GLSETCOLOR:
+        NEXT();
+    INSN(GLSETCOLOR)
         langlSetColor(vm,vm->r[1]);
-        break;
-    case GLPLOT:
+        NEXT();
+    INSN(GLPLOT)
         langlPlot(vm, vm->r[1], vm->r[2]);
-        break;
-    case GLLINE:
+        NEXT();
+    INSN(GLLINE)
         langlLine(vm, vm->r[1], vm->r[2], vm->r[3], vm->r[4]);
-        break;
-    case GLRECT:
+        NEXT();
+    INSN(GLRECT)
         langlRect(vm, vm->r[1], vm->r[2], vm->r[3], vm->r[4]);
-        break;
+        NEXT();
 
-    case LEA_dest_bpoff:
-        DSb = fByte(vm);
-        dest = GetDestination(vm, DSb);
+    INSN(LEA_dest_bpoff)
+        dest = ResolveDestination(vm, ins->dest, ins->doff);
         if (!dest) {
             vm_exception(vm, ERR_NULL_PTR, EXC_WARNING, "Null ptr passed to LEA\n");
-            break;
+            NEXT();
         }
-        *dest = vm->bp + fByte(vm);
-        break;
+        *dest = vm->bp + ins->imm;
+        NEXT_STORE(dest);
 
-    case LIV_addr16:
-        vm->iv = fWord(vm);
-        break;
+    INSN(LIV_addr16)
+        vm->iv = ins->imm;
+        NEXT();
 
-    case NOP:
-        break;
+    INSN(NOP)
+        NEXT();
     
-    case HALT:
-        vm->flags[HALT_FLAG] = true;
-        break;
-    default:
-        vm_exception(vm, ERR_INVALID_OPCODE, EXC_WARNING, "Opcode: 0x%02x\n", opcode);
-        return -1;
+    INSN(HALT)
+        setFlag(vm, HALT_FLAG, true);
+        return VM_HALTED;
+
+    INSN(OP_END) // Fell through the end of the block
+        NEXT_BRANCH();
+    INSN(OP_PC_OOB)
+        vm_exception(vm, ERR_PC_OOB, EXC_SEVERE, vm->codeSpace ? "Code ends at 0x%04x\n" : "Memory ends at 0x%04x\n",
+            codeLimit(vm));
+        NEXT_BRANCH();
+
+    // Fused superinstructions, same flags and PC as the two instructions in sequence
+    INSN(OP_CMP_JZ)
+        vm->fusions[FUSE_CMP_JCC]++;
+        modifyFlags(vm, (sword_t)(*(word_t *)ResolveDestination(vm, ins->dest, 0) - ins->imm));
+        if (getFlag(vm, ZERO_FLAG)) vm->pc = ins->target;
+        NEXT_BRANCH();
+    INSN(OP_CMP_JNZ)
+        vm->fusions[FUSE_CMP_JCC]++;
+        modifyFlags(vm, (sword_t)(*(word_t *)ResolveDestination(vm, ins->dest, 0) - ins->imm));
+        if (!getFlag(vm, ZERO_FLAG)) vm->pc = ins->target;
+        NEXT_BRANCH();
+    INSN(OP_DEC_JNZ)
+        vm->fusions[FUSE_DEC_JNZ]++;
+        dest = ResolveDestination(vm, ins->dest, 0);
+        modifyFlags(vm, --*dest);
+        if (!getFlag(vm, ZERO_FLAG)) vm->pc = ins->target;
+        NEXT_BRANCH();
+    INSN(OP_OR_JZ)
+        vm->fusions[FUSE_OR_JCC]++;
+        modifyFlags(vm, *(word_t *)ResolveDestination(vm, ins->dest, 0));
+        if (getFlag(vm, ZERO_FLAG)) vm->pc = ins->target;
+        NEXT_BRANCH();
+    INSN(OP_OR_JNZ)
+        vm->fusions[FUSE_OR_JCC]++;
+        modifyFlags(vm, *(word_t *)ResolveDestination(vm, ins->dest, 0));
+        if (!getFlag(vm, ZERO_FLAG)) vm->pc = ins->target;
+        NEXT_BRANCH();
+
+    // Register forms, see specialise() in decode.c
+    INSN(OP_LD_RR)
+        vm->regs[ins->dest] = vm->regs[ins->src];
+        NEXT();
+    INSN(OP_LD_RI)
+        vm->regs[ins->dest] = ins->imm;
+        NEXT();
+    INSN(OP_CMP_RR)
+        modifyFlags(vm, vm->regs[ins->dest] - vm->regs[ins->src]);
+        NEXT();
+    INSN(OP_CMP_RI)
+        modifyFlags(vm, vm->regs[ins->dest] - ins->imm);
+        NEXT();
+    REG_ALU_OPS(REG_ALU_HANDLERS)
+    INSN(OP_NOT_R)
+        modifyFlags(vm, vm->regs[ins->dest] = ~vm->regs[ins->dest]);
+        NEXT();
+    INSN(OP_INC_R)
+        modifyFlags(vm, ++vm->regs[ins->dest]);
+        NEXT();
+    INSN(OP_DEC_R)
+        modifyFlags(vm, --vm->regs[ins->dest]);
+        NEXT();
+    INSN(OP_PUSH_R)
+        pushWord(vm, vm->regs[ins->src]);
+        if (!step && !block->valid) goto invalidated;
+        NEXT();
+    INSN(OP_POP_R)
+        vm->regs[ins->dest] = popWord(vm);
+        NEXT();
+
+    INVALID
+        vm_exception(vm, ERR_INVALID_OPCODE, EXC_WARNING, "Opcode: 0x%02x\n", ins->op);
+        NEXT_BRANCH();
+  DISPATCH_END
+
+invalidated: // Don't count the instructions of the retired block that never ran
+  vm->icount -= &block->insns[block->count] - ins - 1;
+  block = NULL;
+
+chain: // Find the block at PC, preferring the successor chained to the current one
+  if (vm->flags & FLAG_BIT(HALT_FLAG)) return VM_HALTED;
+  if (vm->exception) return VM_EXCEPTION;
+  if (vm->stop) return VM_STOPPED;
+  if (step || vm->icount >= limit) return VM_BUDGET;
+  {
+      if (vm->code.flushPending || vm->code.retiredCount > MAX_RETIRED_BLOCKS) {
+          flushCode(vm);
+          block = NULL;
+      }
+      int slot = (block && vm->pc == block->end) ? 1 : 0;
+      Block *next = block ? block->succ[slot] : NULL;
+      if (!next || !next->valid || next->start != vm->pc) {
+          next = getBlock(vm, vm->pc, handlers);
+          if (block && block->valid) block->succ[slot] = next;
+      }
+      block = next;
   }
-}
\ No newline at end of file
+  vm->code.current = block;
+  vm->icount += block->length;
+#ifdef LANVM_JIT
+  if (!block->native && vm->jit.enabled && !block->noJit && ++block->entries >= JIT_THRESHOLD) {
+      jitCompile(vm, block);
+  }
+  if (block->native) {
+      block->native(vm);
+      if (block->nativeResume < 0) goto chain;
+      ins = &block->insns[block->nativeResume];
+      DISPATCH();
+  }
+#endif
+  ins = block->insns;
+  DISPATCH();
+
+ioWait: // Leave PC at the instruction, it runs again once what it waits for is there
+  if (step) {
+      vm->pc = stepPc;
+      vm->icount--;
+      return VM_IO_WAIT;
+  }
+  vm->pc = ins == block->insns ? block->start : ins[-1].next;
+  for (const Insn *left = ins; left < &block->insns[block->count]; left++) { // Uncount it and the rest of the block
+      vm->icount -= left->op >= OP_CMP_JZ && left->op <= OP_OR_JNZ ? 2 : 1;
+  }
+  return VM_IO_WAIT;
+}
+
+// Run with vm_exit() returning here, and from here VM_EXITED
+static VMStop runToExit(VM *vm, bool step, uint64_t limit) {
+  if (vm->exited) return VM_EXITED;
+  jmp_buf jump;
+  VMStop stop;
+  vm->exitJump = &jump;
+  if (setjmp(jump)) stop = VM_EXITED;
+  else stop = run(vm, step, limit);
+  vm->exitJump = NULL;
+  if ((stop == VM_HALTED || stop == VM_EXITED) && vm->channels) chanRelease(vm); // Their other ends learn it ended
+#ifdef LANVM_GUARDED
+  memCatchFaults(NULL, NULL);
+#endif
+  return stop;
+}
+
+int execute(VM *vm) { // Execute a single instruction
+  VMStop stop = runToExit(vm, true, 0);
+  return stop == VM_EXCEPTION ? -1 : 0;
+}
+
+/*
+ * Execute up to max instructions and say why execution stopped. The stop
+ * conditions are checked between basic blocks, so a budget can be overrun
+ * by the rest of the block it ran out in, and VM_EXCEPTION is returned at
+ * the end of the block that raised the warning. Once the program has
+ * exited it returns VM_EXITED without running anything.
+ */
+VMStop vm_run(VM *vm, uint64_t max) {
+  uint64_t limit = max > UINT64_MAX - vm->icount ? UINT64_MAX : vm->icount + max;
+  return runToExit(vm, false, limit);
+}
+
+void vm_stop(VM *vm) {
+  vm->stop = true;
+}
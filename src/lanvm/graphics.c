@@ -61,20 +61,27 @@ void langlRender(VM *vm) {
   glfwSwapBuffers(vm->window);
 }
 
+static int windows; // Open in the process, GLFW is terminated with the last one
+
 int langlInit(VM *vm) {
   vm->currentColor = 0x0000FFFF;
   if(glfwInit() != GLFW_TRUE){
-    vm_exception(NULL, ERR_GRAPHICS, EXC_SEVERE, "Failed to initialize GLFW\nError: %s", glfwGetError(NULL));
+    vm_exception(vm, ERR_GRAPHICS, EXC_SEVERE, "Failed to initialize GLFW\nError: %d\n", glfwGetError(NULL));
     return 1;
   }
   vm->window = glfwCreateWindow(vm->screenWidth, vm->screenWidth, "LanVM Graphics", NULL, NULL);
   if(vm->window == NULL){
-    vm_exception(NULL, ERR_GRAPHICS, EXC_SEVERE, "Failed to create GLFW window\nError: %s", glfwGetError(NULL));
-    glfwTerminate();
-    return 0;
+    int error = glfwGetError(NULL);
+    if (!windows) glfwTerminate();
+    vm_exception(vm, ERR_GRAPHICS, EXC_SEVERE, "Failed to create GLFW window\nError: %d\n", error);
+    return 1;
   }
   vm->framebuffer = malloc(vm->screenWidth * vm->screenHeight * sizeof(uint32_t));
-  if (!vm->framebuffer) vm_exception(vm, ERR_MALLOC, EXC_SEVERE, "Failed to allocate framebuffer\n");
+  windows++;
+  if (!vm->framebuffer) {
+    vm_exception(vm, ERR_MALLOC, EXC_SEVERE, "Failed to allocate framebuffer\n");
+    return 1;
+  }
   glfwMakeContextCurrent(vm->window);
   langlClear(vm);
   return 0;
@@ -82,6 +89,23 @@ int langlInit(VM *vm) {
 
 void langlExit(VM *vm) {
   free(vm->framebuffer);
+  vm->framebuffer = NULL;
+  if (!vm->window) return; // GLFW was never initialized
   glfwDestroyWindow(vm->window);
-  glfwTerminate();
-}
\ No newline at end of file
+  vm->window = NULL;
+  if (!--windows) glfwTerminate();
+}
+
+// Whether GLINIT opened a window for vm
+bool vm_has_window(const VM *vm) {
+  return vm->window != NULL;
+}
+
+// Show the framebuffer and handle window events, false once the window was closed
+bool vm_present(VM *vm) {
+  if (!vm->window) return false;
+  if (glfwWindowShouldClose(vm->window)) return false;
+  langlRender(vm);
+  glfwPollEvents();
+  return true;
+}
@@ -0,0 +1,113 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "../include/lanvm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Input of IN and GETS. By default they read the process's stdin with
+ * getchar() and block until it has something. A VM given a descriptor by
+ * vm_set_input() reads it without blocking, into a buffer of its own. An
+ * instruction that needs more than has arrived, a character for IN and a
+ * whole line for GETS, is left to run again: PC stays at it and vm_run()
+ * returns VM_IO_WAIT, so the thread can run other VMs until the
+ * descriptor is readable.
+ */
+
+#define INPUT_CHUNK 4096 // Initial buffer, doubled for longer lines
+
+// Read what fd has ready, returns false if that is nothing
+static bool fill(VM *vm) {
+  Input *in = &vm->input;
+  if (in->end == in->capacity) {
+      if (in->start) { // Move the unread bytes down
+          memmove(in->buf, in->buf + in->start, in->end - in->start);
+          in->end -= in->start;
+          in->start = 0;
+      } else {
+          size_t capacity = in->capacity ? in->capacity * 2 : INPUT_CHUNK;
+          uint8_t *buf = realloc(in->buf, capacity);
+          if (!buf) {
+              vm_exception(vm, ERR_MALLOC, EXC_WARNING, "Input buffer of %zu bytes\n", capacity);
+              in->eof = true; // GETS takes the line so far
+              return true;
+          }
+          in->buf = buf;
+          in->capacity = capacity;
+      }
+  }
+  ssize_t n;
+  do {
+      n = read(in->fd, in->buf + in->end, in->capacity - in->end);
+  } while (n < 0 && errno == EINTR);
+  if (n > 0) in->end += n;
+  else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) in->eof = true; // Errors end the input too
+  else return false;
+  return true;
+}
+
+// Next character for IN and GETS, EOF at the end and INPUT_WAIT if it hasn't arrived
+int inputChar(VM *vm) {
+  Input *in = &vm->input;
+  if (in->fd < 0) return getchar();
+  if (in->start == in->end && !in->eof) fill(vm);
+  if (in->start < in->end) return in->buf[in->start++];
+  if (in->eof) return EOF;
+  vm->waiting = WAIT_INPUT;
+  return INPUT_WAIT;
+}
+
+// Whether GETS can run without waiting, a whole line or the last of the input having arrived
+bool inputLine(VM *vm) {
+  Input *in = &vm->input;
+  if (in->fd < 0) return true;
+  size_t scanned = 0; // Unread bytes known to hold no newline
+  for (;;) {
+      size_t unread = in->end - in->start;
+      if (in->eof || (unread > scanned && memchr(in->buf + in->start + scanned, '\n', unread - scanned))) return true;
+      scanned = unread;
+      if (!fill(vm)) {
+          vm->waiting = WAIT_INPUT;
+          return false;
+      }
+  }
+}
+
+void inputFree(VM *vm) {
+  free(vm->input.buf);
+  vm->input = (Input){.fd = -1};
+}
+
+/*
+ * Read the program's input from fd instead of stdin, without blocking:
+ * see above. fd is made non-blocking and stays the caller's to close,
+ * -1 goes back to stdin. Input buffered from a previous descriptor is
+ * dropped. Returns 1 if fd can't be made non-blocking.
+ */
+int vm_set_input(VM *vm, int fd) {
+  if (fd >= 0) {
+      int flags = fcntl(fd, F_GETFL);
+      if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return 1;
+  }
+  inputFree(vm);
+  vm->input.fd = fd;
+  return 0;
+}
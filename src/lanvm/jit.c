@@ -0,0 +1,354 @@
+/*  
+ * Lanskern ByteCode - A Virtual Machine & Assembler  
+ * Copyright (c) 2025 Benjamin Helle  
+ *  
+ * This file is part of Lanskern ByteCode.  
+ *  
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, either version 3 of the License, or  
+ * (at your option) any later version.  
+ *  
+ * Lanskern ByteCode is distributed in the hope that it will be useful,  
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of  
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the  
+ * GNU General Public License for more details.  
+ *  
+ * You should have received a copy of the GNU General Public License  
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.  
+ */
+#include "../include/lanvm.h"
+
+/*
+ * Baseline x86-64 JIT. Blocks that are entered often enough get the
+ * longest prefix of register-only instructions translated to native code.
+ * Guest r0-r4, bp and sp live in host registers for the whole block, and
+ * the flags live in r14 as the last ALU result, which is written back to
+ * VM.flagResult at the exit (see modifyFlags()).
+ * When the block ends in JMP, JZ/JNZ or a fused compare-and-branch, the
+ * native code sets the PC. Otherwise the interpreter resumes at the first
+ * instruction that was not compiled. Memory operands, DIV, I/O, hypervisor
+ * calls and graphics always stay in the interpreter.
+ */
+#ifdef LANVM_JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+// Host registers
+#define RAX 0
+#define RBX 3
+#define RDI 7 // VM *
+#define R14 14 // Last ALU result
+
+// Guest register modes 0-6 (r0-r4, bp, sp) to host registers
+static const uint8_t hostReg[7] = {8, 9, 10, 11, RBX, 12, 13};
+
+typedef struct {
+    uint8_t *p;
+} Emit;
+
+static void emit8(Emit *e, uint8_t b) {
+  *e->p++ = b;
+}
+
+static void emit16(Emit *e, uint16_t v) {
+  emit8(e, v & 0xFF);
+  emit8(e, v >> 8);
+}
+
+static void emit32(Emit *e, uint32_t v) {
+  emit16(e, v & 0xFFFF);
+  emit16(e, v >> 16);
+}
+
+static void rex(Emit *e, int reg, int rm) {
+  if (reg >= 8 || rm >= 8) emit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// op r/m16, r16 (ADD 01, OR 09, AND 21, SUB 29, XOR 31, MOV 89)
+static void aluRR(Emit *e, uint8_t opc, int dst, int src) {
+  emit8(e, 0x66);
+  rex(e, src, dst);
+  emit8(e, opc);
+  emit8(e, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+// op r/m16, imm16 (group 81: ADD /0, OR /1, AND /4, SUB /5, XOR /6)
+static void aluRI(Emit *e, int digit, int dst, uint16_t imm) {
+  emit8(e, 0x66);
+  rex(e, 0, dst);
+  emit8(e, 0x81);
+  emit8(e, 0xC0 | digit << 3 | (dst & 7));
+  emit16(e, imm);
+}
+
+// Unary group (INC FF /0, DEC FF /1, NOT F7 /2)
+static void unary(Emit *e, uint8_t opc, int digit, int dst) {
+  emit8(e, 0x66);
+  rex(e, 0, dst);
+  emit8(e, opc);
+  emit8(e, 0xC0 | digit << 3 | (dst & 7));
+}
+
+static void movRI(Emit *e, int dst, uint16_t imm) {
+  emit8(e, 0x66);
+  rex(e, 0, dst);
+  emit8(e, 0xB8 + (dst & 7));
+  emit16(e, imm);
+}
+
+static void imulRR(Emit *e, int dst, int src) {
+  emit8(e, 0x66);
+  rex(e, dst, src);
+  emit8(e, 0x0F);
+  emit8(e, 0xAF);
+  emit8(e, 0xC0 | (dst & 7) << 3 | (src & 7));
+}
+
+static void imulRI(Emit *e, int dst, uint16_t imm) {
+  emit8(e, 0x66);
+  rex(e, dst, dst);
+  emit8(e, 0x69);
+  emit8(e, 0xC0 | (dst & 7) << 3 | (dst & 7));
+  emit16(e, imm);
+}
+
+// movzx reg32, word [rdi+disp]
+static void loadWord(Emit *e, int reg, uint32_t disp) {
+  rex(e, reg, RDI);
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  emit8(e, 0x80 | (reg & 7) << 3 | RDI);
+  emit32(e, disp);
+}
+
+// mov word [rdi+disp], reg16
+static void storeWord(Emit *e, int reg, uint32_t disp) {
+  emit8(e, 0x66);
+  rex(e, reg, RDI);
+  emit8(e, 0x89);
+  emit8(e, 0x80 | (reg & 7) << 3 | RDI);
+  emit32(e, disp);
+}
+
+// mov word [rdi+disp], imm16
+static void storeWordImm(Emit *e, uint32_t disp, uint16_t imm) {
+  emit8(e, 0x66);
+  emit8(e, 0xC7);
+  emit8(e, 0x80 | RDI);
+  emit32(e, disp);
+  emit16(e, imm);
+}
+
+// mov byte [rdi+disp], imm8
+static void storeByteImm(Emit *e, uint32_t disp, uint8_t imm) {
+  emit8(e, 0xC6);
+  emit8(e, 0x80 | RDI);
+  emit32(e, disp);
+  emit8(e, imm);
+}
+
+// test r14w, r14w
+static void testResult(Emit *e) {
+  emit8(e, 0x66);
+  emit8(e, 0x45);
+  emit8(e, 0x85);
+  emit8(e, 0xF6);
+}
+
+#define PC_SIZE_STORE 9 // Length of storeWordImm()
+#define REG(mode) ((mode) < 5 ? offsetof(VM, r) + (mode) * 2 : (mode) == 5 ? offsetof(VM, bp) : offsetof(VM, sp))
+
+static void prologue(Emit *e) {
+  emit8(e, 0x53); // push rbx
+  emit8(e, 0x41); emit8(e, 0x54); // push r12
+  emit8(e, 0x41); emit8(e, 0x55); // push r13
+  emit8(e, 0x41); emit8(e, 0x56); // push r14
+  for (int mode = 0; mode < 7; mode++) loadWord(e, hostReg[mode], REG(mode));
+}
+
+// Write back registers and flags, PC is stored by the caller
+static void writeBack(Emit *e, uint8_t written, bool flagsSet) {
+  for (int mode = 0; mode < 7; mode++) {
+      if (written & (1 << mode)) storeWord(e, hostReg[mode], REG(mode));
+  }
+  if (flagsSet) { // Same as modifyFlags()
+      storeWord(e, R14, offsetof(VM, flagResult));
+      storeByteImm(e, offsetof(VM, lazyFlags), 1);
+  }
+}
+
+static void epilogue(Emit *e) {
+  emit8(e, 0x41); emit8(e, 0x5E); // pop r14
+  emit8(e, 0x41); emit8(e, 0x5D); // pop r13
+  emit8(e, 0x41); emit8(e, 0x5C); // pop r12
+  emit8(e, 0x5B); // pop rbx
+  emit8(e, 0xC3); // ret
+}
+
+// PC = zero result ? taken : next, for JZ (jz == true) or JNZ
+static void branchExit(Emit *e, bool jz, uint16_t target, uint16_t next) {
+  storeWordImm(e, offsetof(VM, pc), next);
+  testResult(e);
+  emit8(e, jz ? 0x75 : 0x74); // Skip the taken store
+  emit8(e, PC_SIZE_STORE);
+  storeWordImm(e, offsetof(VM, pc), target);
+  epilogue(e);
+}
+
+static bool isReg(uint8_t mode) {
+  return mode < 7;
+}
+
+// Emit one ALU instruction on register operands, the result is left in r14
+static void compileALU(Emit *e, uint16_t op, int dst, bool imm, int src, uint16_t value) {
+  static const uint8_t rr[] = {[ALU_ADD] = 0x01, [ALU_SUB] = 0x29, [ALU_AND] = 0x21, [ALU_OR] = 0x09, [ALU_XOR] = 0x31};
+  static const uint8_t ri[] = {[ALU_ADD] = 0, [ALU_SUB] = 5, [ALU_AND] = 4, [ALU_OR] = 1, [ALU_XOR] = 6};
+  switch (op) {
+      case ALU_CMP: // r14 = dst - src, dst unchanged
+          aluRR(e, 0x89, R14, dst);
+          if (imm) aluRI(e, 5, R14, value);
+          else aluRR(e, 0x29, R14, src);
+          return;
+      case ALU_MUL:
+          if (imm) imulRI(e, dst, value);
+          else imulRR(e, dst, src);
+          break;
+      default:
+          if (imm) aluRI(e, ri[op], dst, value);
+          else aluRR(e, rr[op], dst, src);
+          break;
+  }
+  aluRR(e, 0x89, R14, dst);
+}
+
+int jitInit(VM *vm, size_t size) {
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return 1;
+  vm->jit.mem = mem;
+  vm->jit.size = size;
+  vm->jit.used = 0;
+  vm->jit.enabled = true;
+  return 0;
+}
+
+void jitFree(VM *vm) {
+  if (vm->jit.mem) munmap(vm->jit.mem, vm->jit.size);
+  vm->jit.mem = NULL;
+  vm->jit.enabled = false;
+}
+
+void jitFlush(VM *vm) { // Blocks are gone, so is every reference to their code
+  vm->jit.used = 0;
+}
+
+void jitCompile(VM *vm, Block *b) {
+  size_t worst = 256 + 64 * (b->count + 1);
+  b->noJit = true;
+  if (vm->jit.used + worst > vm->jit.size) { // Full, start over at the next block boundary
+      vm->code.flushPending = true;
+      return;
+  }
+  mprotect(vm->jit.mem, vm->jit.size, PROT_READ | PROT_WRITE);
+
+  uint8_t *start = vm->jit.mem + vm->jit.used;
+  Emit e = {start};
+  uint8_t written = 0;
+  bool flagsSet = false;
+  bool exits = false;
+  int i;
+
+  prologue(&e);
+  for (i = 0; i <= b->count && !exits; i++) {
+      const Insn *ins = &b->insns[i];
+      uint16_t op = ins->op >= OP_LD_RR ? ins->opcode : ins->op; // Register forms by their opcode
+      int dst = hostReg[ins->dest < 7 ? ins->dest : 0];
+      int src = hostReg[ins->src < 7 ? ins->src : 0];
+
+      if (op == NOP) continue;
+      if (op == LD_dest_src || op == LD_dest_imm16) {
+          if (!isReg(ins->dest) || (op == LD_dest_src && !isReg(ins->src))) break;
+          if (op == LD_dest_src) aluRR(&e, 0x89, dst, src);
+          else movRI(&e, dst, ins->imm);
+          written |= 1 << ins->dest;
+      } else if (op >= ADD_dest_src && op <= MUL_dest_imm16) {
+          bool imm = op % 2 == 1;
+          if (!isReg(ins->dest) || (!imm && !isReg(ins->src))) break;
+          compileALU(&e, imm ? op - 1 : op, dst, imm, src, ins->imm);
+          if (op != CMP_dest_src && op != CMP_dest_imm16) written |= 1 << ins->dest;
+          flagsSet = true;
+      } else if (op == NOT_dest || op == INC_dest || op == DEC_dest) {
+          if (!isReg(ins->dest)) break;
+          if (op == NOT_dest) unary(&e, 0xF7, 2, dst);
+          else unary(&e, 0xFF, op == INC_dest ? 0 : 1, dst);
+          aluRR(&e, 0x89, R14, dst);
+          written |= 1 << ins->dest;
+          flagsSet = true;
+      } else if (op == JMP_addr16 || op == OP_END) {
+          writeBack(&e, written, flagsSet);
+          storeWordImm(&e, offsetof(VM, pc), op == JMP_addr16 ? ins->imm : ins->next);
+          epilogue(&e);
+          exits = true;
+      } else if (op == JZ_addr16 || op == JNZ_addr16) {
+          if (!flagsSet) break; // Flags come from before the block
+          writeBack(&e, written, flagsSet);
+          branchExit(&e, op == JZ_addr16, ins->imm, ins->next);
+          exits = true;
+      } else if (op >= OP_CMP_JZ && op <= OP_OR_JNZ) {
+          uint8_t fuse = op <= OP_CMP_JNZ ? FUSE_CMP_JCC : op == OP_DEC_JNZ ? FUSE_DEC_JNZ : FUSE_OR_JCC;
+          if (op <= OP_CMP_JNZ) {
+              compileALU(&e, ALU_CMP, dst, true, 0, ins->imm);
+          } else if (op == OP_DEC_JNZ) {
+              unary(&e, 0xFF, 1, dst);
+              aluRR(&e, 0x89, R14, dst);
+              written |= 1 << ins->dest;
+          } else {
+              aluRR(&e, 0x89, R14, dst);
+          }
+          writeBack(&e, written, true);
+          // fusions[fuse]++
+          emit8(&e, 0x48); emit8(&e, 0xFF); emit8(&e, 0x80 | RDI);
+          emit32(&e, offsetof(VM, fusions) + fuse * sizeof(uint64_t));
+          branchExit(&e, op == OP_CMP_JZ || op == OP_OR_JZ, ins->target, ins->next);
+          exits = true;
+      } else {
+          break;
+      }
+  }
+
+  if (!exits) {
+      if (i == 0) { // Nothing worth compiling
+          mprotect(vm->jit.mem, vm->jit.size, PROT_READ | PROT_EXEC);
+          vm->jit.rejected++;
+          return;
+      }
+      writeBack(&e, written, flagsSet); // The interpreter continues at insns[i]
+      epilogue(&e);
+  }
+
+  mprotect(vm->jit.mem, vm->jit.size, PROT_READ | PROT_EXEC);
+  vm->jit.used += e.p - start;
+  vm->jit.compiled++;
+  b->native = (void (*)(VM *))start;
+  b->nativeResume = exits ? -1 : i;
+  b->noJit = false;
+}
+
+#else
+
+int jitInit(VM *vm, size_t size) {
+  return 1; // Not available on this host
+}
+
+void jitFree(VM *vm) {
+}
+
+void jitFlush(VM *vm) {
+}
+
+void jitCompile(VM *vm, Block *b) {
+  b->noJit = true;
+}
+
+#endif
@@ -16,98 +16,251 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.  
  */
 #include "../include/lanvm.h"
+#include "../include/lanimg.h"
 
-bool DEBUG = false;
-bool GRAPHICS = false;
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LANVM_MMAP
+#endif
 
-int vm_init(VM *vm, uint8_t *program) {
-    for (int i = 0; i < 8; i++) vm->flags[i] = 0;
+// A VM with default memory and nothing loaded, NULL if it can't be allocated
+VM *vm_create(const VMConfig *config) {
+    VM *vm = malloc(sizeof(*vm));
+    if (!vm) return NULL;
+    vm->flags = 0;
+    vm->lazyFlags = false;
     for (int i = 0; i < 5; i++) vm->r[i] = 0;
     vm->sp = DEFAULT_MEMORY_SIZE; // Top of the stack
     vm->bp = 0;
     vm->pc = 0;
+    vm->entry = 0;
+    vm->baseMemSize = DEFAULT_MEMORY_SIZE;
     vm->iv = 0;
-    vm->memSize = DEFAULT_MEMORY_SIZE;
-    vm->memory = calloc(vm->memSize, sizeof(uint8_t));
-    vm->program = calloc(vm->progSize, sizeof(uint8_t));
-    if (!vm->memory || !vm->program) {
-        vm_exit(vm, ERR_MALLOC);
+    vm->icount = 0;
+    vm->stop = false;
+    vm->exception = ERR_NO_ERROR;
+    vm->exited = false;
+    vm->exitCode = 0;
+    vm->exitJump = NULL;
+    vm->harvard = config && config->harvard;
+    atomic_init(&vm->schedState, 0);
+    atomic_init(&vm->sched, NULL);
+    vm->waiting = WAIT_NONE;
+    vm->input = (Input){.fd = -1};
+    vm->channels = NULL;
+    memset(&vm->code, 0, sizeof(vm->code));
+    memset(&vm->jit, 0, sizeof(vm->jit));
+    memset(vm->fusions, 0, sizeof(vm->fusions));
+    vm->memory = NULL;
+    vm->progSize = 0;
+    vm->program = NULL;
+    vm->pristine = NULL;
+    vm->sharedPristine = false;
+    vm->codeSpace = NULL;
+    vm->codeSize = 0;
+    vm->sharedCode = false;
+    vm->mapped = false;
+    vm->imageFd = -1;
+    vm->image = NULL;
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->restarts = vm->restoredPages = 0;
+    memset(vm->windowBank, 0xFF, sizeof(vm->windowBank)); // NO_BANK, memInit() points the windows at memory
+    vm->banks = NULL;
+    vm->bankCount = 0;
+    vm->screenWidth = vm->screenHeight = 0;
+    vm->window = NULL;
+    vm->framebuffer = NULL;
+    if (memInit(vm, DEFAULT_MEMORY_SIZE) || codeInit(vm)) {
+        vm_destroy(vm);
+        return NULL;
     }
-    return 0;
+    if (config && config->jitCache) jitInit(vm, config->jitCache); // Without it the interpreter runs everything
+    return vm;
+}
+
+/*
+ * A copy of template, in the same state, for running the program again
+ * with other input, NULL if it can't be allocated. Memory is shared until written (see memClone()),
+ * the memory as loaded and a Harvard code space are shared as they are, and
+ * extended memory banks are copied. Decoded
+ * blocks are not shared: they carry per-VM entry counts, chaining and native
+ * code, so a clone decodes what it runs. The template has to outlive its
+ * clones and not load another program while they exist. A graphics window
+ * is not cloned, GLINIT opens a new one, and the clone reads stdin until
+ * given input of its own with vm_set_input(). It shares the template's
+ * Channels, with none of their ends open.
+ */
+VM *vm_clone(VM *template) {
+    VM *vm = malloc(sizeof(*vm));
+    if (!vm) return NULL;
+    *vm = *template; // Registers, flags, sizes and dirty pages
+    vm->memory = NULL; // Until memClone(), so a failed clone never frees the template's
+    vm->mapped = false;
+    vm->program = NULL;
+    vm->sharedPristine = template->pristine != NULL;
+    vm->sharedCode = template->codeSpace != NULL;
+    vm->imageFd = -1;
+    vm->image = NULL;
+    vm->stop = false;
+    vm->exception = ERR_NO_ERROR;
+    vm->exitJump = NULL;
+    atomic_init(&vm->schedState, 0);
+    atomic_init(&vm->sched, NULL);
+    vm->input = (Input){.fd = -1}; // Reads stdin until given its own input
+    vm->restarts = vm->restoredPages = 0;
+    memset(&vm->code, 0, sizeof(vm->code));
+    memset(&vm->jit, 0, sizeof(vm->jit));
+    memset(vm->fusions, 0, sizeof(vm->fusions));
+    vm->screenWidth = vm->screenHeight = 0;
+    vm->window = NULL;
+    vm->framebuffer = NULL;
+    if (memCloneBanks(vm, template) || memClone(vm, template) || codeInit(vm) || (template->jit.mem && jitInit(vm, template->jit.size))) {
+        vm_destroy(vm);
+        return NULL;
+    }
+    vm->jit.enabled = template->jit.enabled;
+    return vm;
 }
 
+// Release vm with its memory, decoded blocks, native code and window
+void vm_destroy(VM *vm) {
+    if (!vm) return;
+    chanRelease(vm);
+    codeFree(vm);
+    jitFree(vm);
+    memFree(vm);
+    memFreeBanks(vm);
+    free(vm->program);
+    vm->program = NULL;
+    if (!vm->sharedPristine) free(vm->pristine);
+    vm->pristine = NULL;
+    vm->sharedPristine = false;
+    memFreeCode(vm);
+    inputFree(vm);
+    langlExit(vm);
+    free(vm);
+}
 
 int vm_restart(VM *vm) {
-    for (int i = 0; i < 8; i++) vm->flags[i] = 0;
+    vm->flags = 0;
+    vm->lazyFlags = false;
     for (int i = 0; i < 5; i++) vm->r[i] = 0;
-    vm->sp = DEFAULT_MEMORY_SIZE; // Top of the stack
+    vm->sp = vm->baseMemSize; // Top of the stack
     vm->bp = 0;
-    vm->pc = 0;
+    vm->pc = vm->entry;
     vm->iv = 0;
-    if (vm->memSize != DEFAULT_MEMORY_SIZE) { // Set stack size back to default
-        free(vm->memory);
-        vm->memSize = DEFAULT_MEMORY_SIZE;
-        vm->memory = calloc(vm->memSize, sizeof(uint8_t));
-        if (!vm->memory) {
-            vm_exit(vm, ERR_MALLOC);
-            return -5;
-        }
+    vm->exited = false;
+    vm->restarts++;
+    if (memReset(vm)) { // Only the pages written since the last start are copied back
+        vm_exit(vm, ERR_MALLOC);
+        return -5;
     }
     return 0;
 }
 
+/*
+ * End the program with code, for VMEXIT and severe exceptions. Inside
+ * vm_run() it doesn't return, vm_run() returns VM_EXITED instead.
+ */
 int vm_exit(VM *vm, int8_t code) {
-    free(vm->memory);
-    free(vm->program);
-    printf("VM exited with code %d\n", code);
-    langlExit(vm);
-    exit(code);
+    vm->exited = true;
+    vm->exitCode = code;
+    if (vm->exitJump) longjmp(*vm->exitJump, 1);
+    return code;
+}
+
+// Exit code of a VM vm_run() returned VM_EXITED for
+int vm_exit_code(const VM *vm) {
+    return vm->exitCode;
+}
+
+// Register reg: 0-4 for r0-r4, 5 for BP and 6 for SP
+uint32_t vm_get_register(const VM *vm, int reg) {
+    return reg >= 0 && reg < 7 ? vm->regs[reg] : 0;
+}
+
+void vm_set_register(VM *vm, int reg, uint32_t value) {
+    if (reg >= 0 && reg < 7) vm->regs[reg] = value;
+}
+
+// FLAGS byte, with the condition flags of the last ALU result filled in
+uint8_t vm_get_flags(const VM *vm) {
+    return flagByte((VM *)vm);
+}
+
+// Instructions retired since the VM was created, counting those before a snapshot it was restored from
+uint64_t vm_instructions(const VM *vm) {
+    return vm->icount;
+}
+
+// Width of the LanCode this library runs, 16 or 32 (liblanvm32)
+int vm_word_bits(void) {
+    return WORD_BITS;
+}
+
+// Print the registers and flags, as a severe exception does
+void vm_print_state(VM *vm) {
+    printState(vm);
+}
+
+void vm_get_stats(const VM *vm, VMStats *stats) {
+    *stats = (VMStats){
+        .programBytes = vm->progSize,
+        .instructions = vm->icount,
+        .blocksDecoded = vm->code.decoded,
+        .blocksInvalidated = vm->code.invalidated,
+        .fusedCmpJcc = vm->fusions[FUSE_CMP_JCC],
+        .fusedDecJnz = vm->fusions[FUSE_DEC_JNZ],
+        .fusedOrJcc = vm->fusions[FUSE_OR_JCC],
+        .restarts = vm->restarts,
+        .restoredPages = vm->restoredPages,
+        .banks = vm->bankCount,
+        .jit = vm->jit.enabled,
+        .jitCompiled = vm->jit.compiled,
+        .jitRejected = vm->jit.rejected,
+        .jitBytes = vm->jit.used
+    };
 }
 
 int vm_load(VM *vm, uint8_t *program) {
     if (!program) {
         return -1;
     }
-    memcpy(vm->memory, program, vm->progSize);
+    memcpy(vm->codeSpace ? vm->codeSpace : vm->memory, program, vm->progSize);
     return 0;
 }
 
-int vm_malloc(VM *vm, uint16_t size) { // Allocate memory, current memory size += size
+int vm_malloc(VM *vm, word_t size) { // Allocate memory, current memory size += size
     
-    if ((vm->memSize + size) > 0xFFFF) {
+    if ((uint64_t)vm->memSize + size > WORD_MAX) {
         vm_exception(vm, ERR_MALLOC, EXC_WARNING, "Stack allocation exceeds maximum size\n");
         return 1;
     }
 
-    uint16_t new_mem_size = vm->memSize + size;
-    uint8_t *new_memory = (uint8_t *)realloc(vm->memory, new_mem_size);
-
-    if (!new_memory) {
+    if (memResize(vm, vm->memSize + size)) {
         vm_exception(vm, ERR_MALLOC, EXC_SEVERE, 0);
         return 1;
     }
-    vm->memory = new_memory;
-    vm->memSize = new_mem_size;
+    vm->code.flushPending = !vm->codeSpace; // Blocks decoded up to the old end trap there
     return 0;
 }
 
-int vm_free(VM *vm, uint16_t size) { // Free memory, current memory size -= size
+int vm_free(VM *vm, word_t size) { // Free memory, current memory size -= size
 
     if (size >= vm->memSize) {
         vm_exception(vm, ERR_FREE, EXC_WARNING, "Cannot free more memory than allocated\n");
         return 1;
     }
 
-    uint16_t new_mem_size = vm->memSize - size;
-    uint8_t *new_memory = (uint8_t *)realloc(vm->memory, new_mem_size);
-
-    if (!new_memory) {
+    if (memResize(vm, vm->memSize - size)) {
         vm_exception(vm, ERR_MALLOC, EXC_SEVERE, 0);
         return 1;
     }
-
-    vm->memory = new_memory;
-    vm->memSize = new_mem_size;
+    vm->code.flushPending = !vm->codeSpace; // Code past the new end is gone
+    memUnmapBanks(vm);
 
     if (vm->sp > vm->memSize) { // Reset stack pointer if out of bounds
         vm->sp = vm->memSize;
@@ -116,10 +269,10 @@ int vm_free(VM *vm, uint16_t size) { // Free memory, current memory size -= size
     return 0;
 }
 
-int hypervisorCall(VM *vm, uint8_t operation, uint16_t operand) {
+int hypervisorCall(VM *vm, uint8_t operation, word_t operand) {
     switch (operation) {
         case 0x00: // VMEXIT
-            vm_exit(vm, operand);
+            return vm_exit(vm, operand);
         case 0x01: // VMRESTART
             vm_restart(vm);
             return 0;
@@ -130,6 +283,14 @@ int hypervisorCall(VM *vm, uint8_t operation, uint16_t operand) {
             return vm_malloc(vm, operand);
         case 0x06: // VMFREE
             return vm_free(vm, operand);
+        case 0x07: // VMBANK
+            return memMapBank(vm, vm->r[0], vm->r[1]);
+        case 0x08: // VMCHOPEN
+            return chanOpen(vm);
+        case 0x09: // VMCHSEND
+            return chanSend(vm);
+        case 0x0a: // VMCHRECV
+            return chanReceive(vm);
         default:
             return 0;
     }
@@ -137,67 +298,463 @@ int hypervisorCall(VM *vm, uint8_t operation, uint16_t operand) {
 
 
 void printState(VM *vm) {
+    uint8_t f = flagByte(vm);
     printf("Current state: \n"
         "r0=0x%04x r1=0x%04x r2=0x%04x r3=0x%04x r4=0x%04x\nSP=0x%04x BP=0x%04x PC=0x%04x F=0x%d%d%d%d%d%d%d%d\n",
-        vm->r[0], vm->r[1], vm->r[2], vm->r[3], vm->r[4], vm->sp, vm->bp, vm->pc, vm->flags[7], vm->flags[6], vm->flags[5], vm->flags[4], vm->flags[3], vm->flags[2], vm->flags[1], vm->flags[0]
+        vm->r[0], vm->r[1], vm->r[2], vm->r[3], vm->r[4], vm->sp, vm->bp, vm->pc, f >> 7 & 1, f >> 6 & 1, f >> 5 & 1, f >> 4 & 1, f >> 3 & 1, f >> 2 & 1, f >> 1 & 1, f & 1
     );
 }
 
-void loadProgram(VM *vm,FILE *file, uint8_t *program) {
-    uint8_t line[3];
-    int i = 0;
-    while (fgets(line, sizeof(line), file)) {
-        if (line[0] == '\n') break;
-        program[i++] = (uint8_t)strtol(line, NULL, 16);
+// Map a program file read-only, data is NULL for an empty file
+static int mapFile(const char *filename, uint8_t **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+#ifdef LANVM_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 1;
+    struct stat st;
+    int err = fstat(fd, &st);
+    if (!err && st.st_size > 0) {
+        *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*data == MAP_FAILED) {
+            *data = NULL;
+            err = 1;
+        }
+        *size = st.st_size;
     }
-    vm->progSize = i;
-    memcpy(vm->memory, program, vm->progSize);
-    /*for (int j = 0; j < i; j++) { // Debug
-        printf("%02x ", program[j]);
+    close(fd);
+    return err;
+#else
+    FILE *file = fopen(filename, "rb");
+    if (!file) return 1;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    if (length > 0 && (*data = malloc(length))) *size = fread(*data, 1, length, file);
+    fclose(file);
+    return length > 0 && *size != (size_t)length;
+#endif
+}
+
+static void unmapFile(uint8_t *data, size_t size) {
+    if (!data) return;
+#ifdef LANVM_MMAP
+    munmap(data, size);
+#else
+    (void)size;
+    free(data);
+#endif
+}
+
+static int hexDigit(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Size memory for a program of extent bytes. Without a declared size it
+ * gets the default memory, or exactly the program if that is larger.
+ */
+static int fitProgram(VM *vm, uint64_t extent, uint32_t declared) {
+    uint64_t memSize = declared ? declared : extent > DEFAULT_MEMORY_SIZE ? extent : DEFAULT_MEMORY_SIZE;
+    if (extent > memSize || memSize > WORD_MAX) {
+        printf("Program does not fit in %u bytes of memory\n", (unsigned)(memSize > WORD_MAX ? WORD_MAX : memSize));
+        return 1;
+    }
+    if (memSize != vm->memSize && memResize(vm, memSize)) {
+        printf("Memory allocation failed\n");
+        return 1;
     }
-    printf("\n");*/
+    vm->sp = vm->baseMemSize = memSize;
+    vm->progSize = extent;
+    return 0;
+}
+
+// Give a Harvard mode program a code space for size bytes of code
+static int fitCode(VM *vm, uint64_t size) {
+    if (size > WORD_MAX) {
+        printf("Program does not fit in %u bytes of code space\n", (unsigned)WORD_MAX);
+        return 1;
+    }
+    if (memCodeSpace(vm, size)) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    vm->progSize = size;
+    return 0;
 }
 
-int main(int argc, char **argv) {
-    printf("LanVM v%s\n", VM_VERSION_STR);
+#define WORD_FLAG (WORD_BITS == 32 ? IMG_WIDE : 0) // Header flag of the images this VM runs
 
-    if (argc < 2) {
-        printf("Usage: %s <filename>\n", argv[0]);
+// Images of the other word width are for the other VM, returns 1 for those
+static int checkWidth(const Image *img) {
+    if ((img->flags & IMG_WIDE) == WORD_FLAG) return 0;
+    printf("%d-bit program, run it with %s\n", img->flags & IMG_WIDE ? 32 : 16, img->flags & IMG_WIDE ? "lanvm32" : "lanvm");
+    return 1;
+}
+
+// The older hex text format, two digits per byte up to the first newline
+static int loadHex(VM *vm, const uint8_t *text, size_t size) {
+    size_t length = 0;
+    while (length < size && text[length] != '\n') length++;
+    if (vm->harvard ? fitProgram(vm, 0, 0) || fitCode(vm, (length + 1) / 2) : fitProgram(vm, (length + 1) / 2, 0)) return 1;
+    uint8_t *code = vm->codeSpace ? vm->codeSpace : vm->memory;
+    for (size_t i = 0; i < length; i += 2) {
+        int high = hexDigit(text[i]), low = i + 1 < length ? hexDigit(text[i + 1]) : -1;
+        code[i / 2] = high < 0 ? 0 : low < 0 ? high : high << 4 | low;
+    }
+    return 0;
+}
+
+static int loadImage(VM *vm, const uint8_t *file, size_t size) {
+    Image img;
+    const char *error = imgParse(file, size, &img);
+    if (error) {
+        printf("Invalid program image: %s\n", error);
+        return 1;
+    }
+    if (checkWidth(&img)) return 1;
+    bool harvard = vm->harvard || img.flags & IMG_HARVARD;
+    if (harvard ? fitProgram(vm, imgExtentOf(&img, IMG_DATA), img.memSize) || fitCode(vm, imgExtentOf(&img, IMG_CODE))
+        : fitProgram(vm, imgExtent(&img), img.memSize)) {
         return 1;
     }
+    // Code lives in guest memory, where programs may write it, so only the
+    // loaded sections are copied out of the mapping and debug info is never
+    // read. In Harvard mode code sections go to the code space instead.
+    for (int i = 0; i < img.sectionCount; i++) {
+        const ImgSection *s = &img.sections[i];
+        if (!imgLoaded(s)) continue;
+        memcpy((harvard && s->type == IMG_CODE ? vm->codeSpace : vm->memory) + s->addr, s->data, s->size);
+    }
+    vm->pc = vm->entry = img.entry;
+    return 0;
+}
 
-    VM vm;
+// Load a LanCode image, or a program in the older hex text format, from size bytes at data
+int vm_load_image(VM *vm, const uint8_t *data, size_t size) {
+    int err = imgIsImage(data, size) ? loadImage(vm, data, size) : loadHex(vm, data, size);
+    if (!err && memSnapshot(vm)) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    return err;
+}
 
-    FILE *file = fopen(argv[1], "rb"); // Open the program file
-    if (!file) {
+// Load the program in filename, as vm_load_image() does
+int vm_load_file(VM *vm, const char *filename) {
+    uint8_t *file;
+    size_t size;
+    if (mapFile(filename, &file, &size)) {
         printf("Error opening file\n");
         return 1;
     }
-    uint8_t *program = calloc(DEFAULT_PROGRAM_SIZE, sizeof(uint8_t));
-    if (!program) {
-        printf("Memory allocation failed\n");
-        fclose(file);
+    int err = vm_load_image(vm, file, size);
+    unmapFile(file, size);
+    return err;
+}
+
+// Bytes in the page bitmap of size bytes of memory, which covers the 16-bit
+// address space whatever the size, or just the memory in wide snapshots
+static size_t bitmapBytes(size_t size) {
+#ifdef LANVM_WORD32
+    return (size + IMG_PAGE_SIZE * 8 - 1) / (IMG_PAGE_SIZE * 8);
+#else
+    (void)size;
+    return IMG_PAGE_BITMAP;
+#endif
+}
+
+// Bitmap of the pages of mem that are not all zero, returns how many there are
+static size_t usedPages(const uint8_t *mem, size_t size, uint8_t *bitmap) {
+    size_t count = 0;
+    memset(bitmap, 0, bitmapBytes(size));
+    for (size_t start = 0; start < size; start += IMG_PAGE_SIZE) {
+        size_t end = size - start < IMG_PAGE_SIZE ? size : start + IMG_PAGE_SIZE;
+        for (size_t addr = start; addr < end; addr++) {
+            if (mem[addr]) {
+                bitmap[start / IMG_PAGE_SIZE / 8] |= 1 << (start / IMG_PAGE_SIZE % 8);
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+static void writePages(FILE *file, const uint8_t *mem, size_t size, const uint8_t *bitmap) {
+    static const uint8_t zeros[IMG_PAGE_SIZE];
+    fwrite(bitmap, 1, bitmapBytes(size), file);
+    for (size_t start = 0; start < size; start += IMG_PAGE_SIZE) {
+        if (!(bitmap[start / IMG_PAGE_SIZE / 8] >> (start / IMG_PAGE_SIZE % 8) & 1)) continue;
+        size_t length = size - start < IMG_PAGE_SIZE ? size - start : IMG_PAGE_SIZE;
+        fwrite(mem + start, 1, length, file);
+        fwrite(zeros, 1, IMG_PAGE_SIZE - length, file); // The last page is padded
+    }
+}
+
+// Fill mem from a sparse memory section, returns 1 if the section is truncated
+static int readPages(const ImgSection *s, uint8_t *mem, size_t size) {
+    size_t bitmap = bitmapBytes(size);
+    if (s->size < bitmap) return 1;
+    memset(mem, 0, size);
+    size_t offset = bitmap;
+    for (size_t page = 0; page < bitmap * 8; page++) {
+        if (!(s->data[page / 8] >> (page % 8) & 1)) continue;
+        if (s->size - offset < IMG_PAGE_SIZE) return 1;
+        size_t start = page * IMG_PAGE_SIZE;
+        if (start < size) memcpy(mem + start, s->data + offset, size - start < IMG_PAGE_SIZE ? size - start : IMG_PAGE_SIZE);
+        offset += IMG_PAGE_SIZE;
+    }
+    return 0;
+}
+
+#define BANK_BITMAP (MAX_BANKS / 8)
+#define BANK_BYTES (BANK_SIZE + MEMORY_SLACK) // Per bank in a snapshot
+
+static void writeBanks(FILE *file, const VM *vm) {
+    uint8_t bytes[BANK_WINDOWS * 2 + BANK_BITMAP] = {0};
+    for (int slot = 0; slot < BANK_WINDOWS; slot++) imgPut16(bytes + 2 * slot, vm->windowBank[slot]);
+    for (int i = 0; i < MAX_BANKS; i++) {
+        if (vm->banks[i]) bytes[BANK_WINDOWS * 2 + i / 8] |= 1 << (i % 8);
+    }
+    fwrite(bytes, 1, sizeof(bytes), file);
+    for (int i = 0; i < MAX_BANKS; i++) {
+        if (vm->banks[i]) fwrite(vm->banks[i], 1, BANK_BYTES, file);
+    }
+}
+
+// Restore extended memory after memory itself, returns 1 if the section is invalid
+static int readBanks(VM *vm, const ImgSection *s) {
+    memFreeBanks(vm);
+    if (!s) return 0;
+    if (s->size < BANK_WINDOWS * 2 + BANK_BITMAP) return 1;
+    const uint8_t *bitmap = s->data + BANK_WINDOWS * 2;
+    uint32_t offset = BANK_WINDOWS * 2 + BANK_BITMAP;
+    for (int i = 0; i < MAX_BANKS; i++) {
+        if (!(bitmap[i / 8] >> (i % 8) & 1)) continue;
+        uint8_t *bank = memBank(vm, i);
+        if (!bank || s->size - offset < BANK_BYTES) return 1;
+        memcpy(bank, s->data + offset, BANK_BYTES);
+        offset += BANK_BYTES;
+    }
+    for (int slot = 0; slot < BANK_WINDOWS; slot++) {
+        uint16_t bank = imgGet16(s->data + 2 * slot);
+        if (bank != NO_BANK && memMapBank(vm, bank, slot << BANK_SHIFT)) return 1;
+    }
+    return 0;
+}
+
+// Bytes of memory a snapshot covers, the slack past memSize included
+static size_t snapshotBytes(word_t memSize) {
+    return (size_t)memSize + MEMORY_SLACK < ADDRESS_SPACE ? (size_t)memSize + MEMORY_SLACK : ADDRESS_SPACE;
+}
+
+// Words in the state section are as wide as the VM's
+#define STATE_SIZE (WORD_BITS == 32 ? IMG_WIDE_STATE_SIZE : IMG_STATE_SIZE)
+#define STATE_FLAGS (9 * WORD_BYTES) // Offset of the flags, the words after it follow a reserved byte
+
+static void putWord(uint8_t *p, word_t value) {
+#ifdef LANVM_WORD32
+    imgPut32(p, value);
+#else
+    imgPut16(p, value);
+#endif
+}
+
+static word_t getWord(const uint8_t *p) {
+#ifdef LANVM_WORD32
+    return imgGet32(p);
+#else
+    return imgGet16(p);
+#endif
+}
+
+/*
+ * Write the state of vm to filename, in the snapshot form of a LanCode image
+ * (see lanimg.h). Memory is stored sparsely, so pages that were never
+ * written take no space. Call it between vm_run() calls.
+ */
+int vm_snapshot(VM *vm, const char *filename) {
+    uint8_t state[STATE_SIZE] = {0};
+    for (int i = 0; i < 7; i++) putWord(state + WORD_BYTES * i, vm->regs[i]);
+    putWord(state + 7 * WORD_BYTES, vm->pc);
+    putWord(state + 8 * WORD_BYTES, vm->iv);
+    state[STATE_FLAGS] = flagByte(vm);
+    putWord(state + STATE_FLAGS + 2, vm->baseMemSize);
+    putWord(state + STATE_FLAGS + 2 + WORD_BYTES, vm->progSize);
+    imgPut32(state + STATE_SIZE - 8, vm->icount & 0xFFFFFFFF);
+    imgPut32(state + STATE_SIZE - 4, vm->icount >> 32);
+
+    size_t memoryBytes = snapshotBytes(vm->memSize), pristineBytes = snapshotBytes(vm->baseMemSize);
+    uint8_t *memoryMap = malloc(bitmapBytes(memoryBytes)), *pristineMap = malloc(bitmapBytes(pristineBytes));
+    if (!memoryMap || !pristineMap) {
+        free(memoryMap);
+        free(pristineMap);
         return 1;
     }
-    vm_init(&vm, program);
-    loadProgram(&vm, file, program);
-    fclose(file);
+    uint8_t types[6] = {IMG_STATE, IMG_MEMORY};
+    uint64_t sizes[6] = {STATE_SIZE, bitmapBytes(memoryBytes) + (uint64_t)usedPages(vm->memory, memoryBytes, memoryMap) * IMG_PAGE_SIZE};
+    uint16_t count = 2;
+    if (vm->pristine) {
+        types[count] = IMG_PRISTINE;
+        sizes[count++] = bitmapBytes(pristineBytes) + (uint64_t)usedPages(vm->pristine, pristineBytes, pristineMap) * IMG_PAGE_SIZE;
+    }
+    if (vm->framebuffer) {
+        types[count] = IMG_FRAMEBUFFER;
+        sizes[count++] = 8 + (uint32_t)vm->screenWidth * vm->screenHeight * 4;
+    }
+    if (vm->banks) {
+        types[count] = IMG_BANKS;
+        sizes[count++] = BANK_WINDOWS * 2 + BANK_BITMAP + (uint32_t)vm->bankCount * BANK_BYTES;
+    }
+    if (vm->codeSpace) {
+        types[count] = IMG_CODE;
+        sizes[count++] = vm->codeSize;
+    }
 
-    free(program);
+    uint32_t flags = (vm->codeSpace ? IMG_HARVARD : 0) | WORD_FLAG;
+    uint8_t header[IMG_WIDE_HEADER_SIZE + 6 * IMG_WIDE_SECTION_SIZE];
+    size_t headerSize = imgHeaderSize(flags) + count * imgSectionSize(flags);
+    uint64_t offset = headerSize;
+    imgPutHeader(header, flags, vm->entry, vm->memSize, count);
+    for (int i = 0; i < count; i++) {
+        imgPutSection(header, flags, i, types[i], 0, offset, sizes[i]);
+        offset += sizes[i];
+    }
+    FILE *file = offset > UINT32_MAX ? NULL : fopen(filename, "wb"); // Sections are found by u32 offsets
+    if (!file) {
+        free(memoryMap);
+        free(pristineMap);
+        return 1;
+    }
+    fwrite(header, 1, headerSize, file);
 
-    while (vm.pc < DEFAULT_PROGRAM_SIZE && !vm.flags[HALT_FLAG]) {
-        //printf("Instruction: 0x%02x PC: 0x%04x SP: 0x%04x R0: 0x%04x\n", vm.memory[vm.pc], vm.pc, vm.sp, vm.r[0]); // Debug
-        execute(&vm);
-        if (GRAPHICS){ // TODO: Implement graphics rendering on a separate thread for performance
-            if (glfwWindowShouldClose(vm.window) || vm.flags[HALT_FLAG]) break;
-            langlRender(&vm);
-            glfwPollEvents();
+    fwrite(state, 1, sizeof(state), file);
+    writePages(file, vm->memory, memoryBytes, memoryMap);
+    if (vm->pristine) writePages(file, vm->pristine, pristineBytes, pristineMap);
+    if (vm->framebuffer) {
+        uint8_t bytes[8];
+        imgPut16(bytes, vm->screenWidth);
+        imgPut16(bytes + 2, vm->screenHeight);
+        imgPut32(bytes + 4, vm->currentColor);
+        fwrite(bytes, 1, 8, file);
+        for (int i = 0; i < vm->screenWidth * vm->screenHeight; i++) {
+            imgPut32(bytes, vm->framebuffer[i]);
+            fwrite(bytes, 1, 4, file);
         }
     }
+    if (vm->banks) writeBanks(file, vm);
+    if (vm->codeSpace) fwrite(vm->codeSpace, 1, vm->codeSize, file);
+    free(memoryMap);
+    free(pristineMap);
+    int err = ferror(file);
+    return fclose(file) || err;
+}
 
-    // If program didn't stop correctly, print state and exit with code 1
-    printState(&vm);
-    vm_exit(&vm, 1);
+// Sections of a snapshot, NULL for those it doesn't have
+static const ImgSection *snapshotSection(const Image *img, uint8_t type) {
+    for (int i = 0; i < img->sectionCount; i++) {
+        if (img->sections[i].type == type) return &img->sections[i];
+    }
+    return NULL;
+}
 
+static int restoreFramebuffer(VM *vm, const ImgSection *s) {
+    if (s->size < 8) return 1;
+    int width = imgGet16(s->data), height = imgGet16(s->data + 2);
+    if (s->size - 8 < (uint32_t)width * height * 4) return 1;
+    if (!vm->framebuffer) {
+        vm->screenWidth = width;
+        vm->screenHeight = height;
+        if (langlInit(vm)) return 1;
+    } else if (vm->screenWidth != width || vm->screenHeight != height) {
+        return 1;
+    }
+    for (int i = 0; i < width * height; i++) vm->framebuffer[i] = imgGet32(s->data + 8 + 4 * i);
+    vm->currentColor = imgGet32(s->data + 4);
     return 0;
-}
\ No newline at end of file
+}
+
+static int restoreSnapshot(VM *vm, const uint8_t *file, size_t size) {
+    Image img;
+    const char *error = imgParse(file, size, &img);
+    if (!error && checkWidth(&img)) return 1;
+    const ImgSection *state = error ? NULL : snapshotSection(&img, IMG_STATE);
+    const ImgSection *memory = error ? NULL : snapshotSection(&img, IMG_MEMORY);
+    const ImgSection *pristine = error ? NULL : snapshotSection(&img, IMG_PRISTINE);
+    const ImgSection *framebuffer = error ? NULL : snapshotSection(&img, IMG_FRAMEBUFFER);
+    const ImgSection *banks = error ? NULL : snapshotSection(&img, IMG_BANKS);
+    const ImgSection *code = error ? NULL : snapshotSection(&img, IMG_CODE);
+    if (!error && (!state || state->size < STATE_SIZE || !memory)) error = "not a snapshot";
+    if (!error && code && (code->addr || code->size > WORD_MAX)) error = "bad code space";
+    if (error) {
+        printf("Invalid snapshot: %s\n", error);
+        return 1;
+    }
+    const uint8_t *s = state->data;
+    word_t memSize = img.memSize ? img.memSize : DEFAULT_MEMORY_SIZE;
+    word_t baseMemSize = getWord(s + STATE_FLAGS + 2);
+    if (memSize != vm->memSize && memResize(vm, memSize)) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    if (pristine) {
+        uint8_t *copy = realloc(vm->sharedPristine ? NULL : vm->pristine, (size_t)baseMemSize + MEMORY_SLACK);
+        if (!copy) {
+            printf("Memory allocation failed\n");
+            return 1;
+        }
+        vm->pristine = copy;
+        vm->sharedPristine = false;
+    }
+    if (readPages(memory, vm->memory, snapshotBytes(memSize)) ||
+        (pristine && readPages(pristine, vm->pristine, snapshotBytes(baseMemSize)))) {
+        printf("Invalid snapshot: truncated memory\n");
+        return 1;
+    }
+    if (readBanks(vm, banks)) {
+        printf("Invalid snapshot: bad extended memory\n");
+        return 1;
+    }
+    if (framebuffer && restoreFramebuffer(vm, framebuffer)) {
+        printf("Invalid snapshot: framebuffer does not match\n");
+        return 1;
+    }
+    if (!code) {
+        memFreeCode(vm);
+    } else if (memCodeSpace(vm, code->size)) {
+        printf("Memory allocation failed\n");
+        return 1;
+    } else {
+        memcpy(vm->codeSpace, code->data, code->size);
+    }
+
+    for (int i = 0; i < 7; i++) vm->regs[i] = getWord(s + WORD_BYTES * i);
+    vm->pc = getWord(s + 7 * WORD_BYTES);
+    vm->iv = getWord(s + 8 * WORD_BYTES);
+    vm->flags = s[STATE_FLAGS];
+    vm->lazyFlags = false;
+    vm->baseMemSize = baseMemSize;
+    vm->progSize = getWord(s + STATE_FLAGS + 2 + WORD_BYTES);
+    vm->icount = imgGet32(s + STATE_SIZE - 8) | (uint64_t)imgGet32(s + STATE_SIZE - 4) << 32;
+    vm->entry = img.entry;
+    memset(vm->dirty, 1, sizeof(vm->dirty)); // Unknown, the next restart compares every page
+    vm->code.flushPending = true;
+    return 0;
+}
+
+// Resume the VM saved by vm_snapshot()
+int vm_restore(VM *vm, const char *filename) {
+    uint8_t *file;
+    size_t size;
+    if (mapFile(filename, &file, &size)) {
+        printf("Error opening file\n");
+        return 1;
+    }
+    int err = restoreSnapshot(vm, file, size);
+    unmapFile(file, size);
+    return err;
+}
@@ -0,0 +1,537 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "../include/lanvm.h"
+
+/*
+ * Lockstep execution of VMs, the lanes, that run the same program on
+ * different inputs. The registers, PC and flags of the lanes are kept as
+ * structure of arrays, each one for every lane side by side, so a vector
+ * operation works on a register of LANES lanes at once. Each step takes the
+ * lowest PC any lane is at, so lanes that took the short way past a branch
+ * wait there for the others, and runs the block at it for every lane at
+ * it. Its leading register-only instructions, and its exit if they reach
+ * it, run as vector operations masked to those lanes. Whatever they leave
+ * of the block, and blocks starting with anything else, run lane by lane
+ * with vm_run().
+ *
+ * Lanes share a block when their own decode of it, in their own block
+ * cache, is identical. A store into the code retires the lane's block and
+ * changes its epoch, after which it runs alone until its new decode is
+ * found identical again.
+ */
+
+#ifdef __GNUC__
+
+#define LANE_BYTES 32 // An AVX2 register
+#define LANES (LANE_BYTES / WORD_BYTES) // Lanes per vector
+#define STOP_INTERVAL 1024 // Steps between looking for vm_stop()
+
+// Picked by the CPU the program runs on, without AVX2 vectors are done in halves
+#if defined(__x86_64__) && defined(__linux__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+typedef word_t LaneVec __attribute__((vector_size(LANE_BYTES))); // Masks are all ones or zero per lane
+typedef sword_t LaneMask __attribute__((vector_size(LANE_BYTES))); // What comparisons give
+typedef uint64_t CountVec __attribute__((vector_size(LANES * sizeof(uint64_t))));
+typedef int64_t CountMask __attribute__((vector_size(LANES * sizeof(uint64_t))));
+
+// A block as each lane sharing it decoded it
+typedef struct {
+  word_t pc;
+  uint16_t count, length; // As in the Block
+  uint16_t vector; // Leading records run as vector operations
+  bool whole; // insns[vector] is the exit and runs as vector operations too
+  int flagsAt; // Last vector record setting the flags, -1 if none
+  word_t *shared; // Per lane, all ones once its block was found identical
+  Insn insns[]; // count + 1 records
+} SharedBlock;
+
+typedef struct {
+  VM **vms;
+  VMStop *stops;
+  int count, running;
+  size_t chunks; // Vectors per lane array
+  word_t *regs[7], *pc, *flags, *flagResult; // Lane state while the lanes run
+  word_t *lazy, *active; // Masks
+  uint64_t *icount, *limit, *fusions[FUSE_COUNT];
+  uint64_t slack; // At most what any running lane has left of its budget
+  uint64_t *epoch; // Blocks a lane decoded and retired, changes when its code may have
+  word_t *in; // Lanes running the shared block of this step
+  int *alone, aloneCount; // Lanes running this step on their own
+  SharedBlock **table; // Open addressing by PC
+  size_t tableSize, tableUsed;
+} Lockstep;
+
+static inline LaneVec lanes(const word_t *p) {
+  LaneVec v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void setLanes(word_t *p, LaneVec v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline CountVec counts(const uint64_t *p) {
+  CountVec v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void setCounts(uint64_t *p, CountVec v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+// a where mask is set, b elsewhere
+static inline LaneVec blend(LaneVec mask, LaneVec a, LaneVec b) {
+  return (a & mask) | (b & ~mask);
+}
+
+static inline bool anyLane(LaneVec v) {
+  uint64_t w[LANE_BYTES / 8];
+  memcpy(w, &v, sizeof(w));
+  return w[0] | w[1] | w[2] | w[3];
+}
+
+static inline bool vectorOp(uint16_t op) {
+  return (op >= OP_LD_RR && op <= OP_DEC_R) || op == NOP;
+}
+
+static inline bool exitOp(uint16_t op) {
+  return op == OP_END || (op >= JMP_addr16 && op <= JG_addr16) || (op >= OP_CMP_JZ && op <= OP_OR_JNZ);
+}
+
+static inline bool setsFlags(uint16_t op) {
+  return vectorOp(op) && op != OP_LD_RR && op != OP_LD_RI && op != NOP;
+}
+
+static inline uint64_t codeEpoch(VM *vm) {
+  return vm->code.decoded + vm->code.invalidated;
+}
+
+// Move lane i's state from its VM to the arrays
+static void gather(Lockstep *ls, int i) {
+  VM *vm = ls->vms[i];
+  for (int k = 0; k < 7; k++) ls->regs[k][i] = vm->regs[k];
+  ls->pc[i] = vm->pc;
+  ls->flags[i] = vm->flags;
+  ls->flagResult[i] = vm->flagResult;
+  ls->lazy[i] = vm->lazyFlags ? WORD_MAX : 0;
+  ls->icount[i] = vm->icount;
+  for (int f = 0; f < FUSE_COUNT; f++) ls->fusions[f][i] = vm->fusions[f];
+}
+
+// And back
+static void scatter(Lockstep *ls, int i) {
+  VM *vm = ls->vms[i];
+  for (int k = 0; k < 7; k++) vm->regs[k] = ls->regs[k][i];
+  vm->pc = ls->pc[i];
+  vm->flags = ls->flags[i];
+  vm->flagResult = ls->flagResult[i];
+  vm->lazyFlags = ls->lazy[i] != 0;
+  vm->icount = ls->icount[i];
+  for (int f = 0; f < FUSE_COUNT; f++) vm->fusions[f] = ls->fusions[f][i];
+}
+
+static void retire(Lockstep *ls, int i, VMStop stop) {
+  ls->active[i] = 0;
+  ls->stops[i] = stop;
+  ls->running--;
+}
+
+static SharedBlock *lookup(Lockstep *ls, word_t pc) {
+  size_t mask = ls->tableSize - 1;
+  for (size_t h = (pc * 2654435761u) & mask;; h = (h + 1) & mask) {
+      if (!ls->table[h] || ls->table[h]->pc == pc) return ls->table[h];
+  }
+}
+
+static void freeShared(SharedBlock *sb) {
+  if (!sb) return;
+  free(sb->shared);
+  free(sb);
+}
+
+// Add sb to the table, kept at most half full, returns 1 if out of memory
+static int insert(Lockstep *ls, SharedBlock *sb) {
+  if (2 * (ls->tableUsed + 1) > ls->tableSize) {
+      SharedBlock **old = ls->table;
+      size_t oldSize = ls->tableSize;
+      ls->table = calloc(oldSize * 2, sizeof(*ls->table));
+      if (!ls->table) {
+          ls->table = old;
+          return 1;
+      }
+      ls->tableSize = oldSize * 2;
+      ls->tableUsed = 0;
+      for (size_t h = 0; h < oldSize; h++) {
+          if (old[h]) insert(ls, old[h]);
+      }
+      free(old);
+  }
+  size_t mask = ls->tableSize - 1, h = (sb->pc * 2654435761u) & mask;
+  while (ls->table[h]) h = (h + 1) & mask;
+  ls->table[h] = sb;
+  ls->tableUsed++;
+  return 0;
+}
+
+// Share b, the block of a lane at its start, with the lanes that decode it the same
+static void share(Lockstep *ls, const Block *b) {
+  SharedBlock *sb = malloc(sizeof(*sb) + (b->count + 1) * sizeof(Insn));
+  if (!sb) return;
+  sb->pc = b->start;
+  sb->count = b->count;
+  sb->length = b->length;
+  memcpy(sb->insns, b->insns, (b->count + 1) * sizeof(Insn));
+  sb->flagsAt = -1;
+  for (sb->vector = 0; vectorOp(sb->insns[sb->vector].op); sb->vector++) {
+      if (setsFlags(sb->insns[sb->vector].op)) sb->flagsAt = sb->vector;
+  }
+  sb->whole = exitOp(sb->insns[sb->vector].op);
+  sb->shared = calloc(ls->chunks * LANES, sizeof(word_t));
+  if (!sb->shared || insert(ls, sb)) freeShared(sb);
+}
+
+// Whether lane i's own block at sb's PC is identical, and so can run with the others
+static bool sameBlock(Lockstep *ls, SharedBlock *sb, int i) {
+  VM *vm = ls->vms[i];
+  if (vm->code.flushPending) return false; // Its blocks may not match memory any more
+  Block *b = findBlock(vm, sb->pc);
+  if (!b || b->count != sb->count || memcmp(b->insns, sb->insns, (sb->count + 1) * sizeof(Insn))) return false;
+  sb->shared[i] = WORD_MAX;
+  return true;
+}
+
+// Run one block of lane i with the interpreter
+static void runAlone(Lockstep *ls, int i) {
+  VM *vm = ls->vms[i];
+  scatter(ls, i);
+  VMStop stop = vm_run(vm, 1);
+  gather(ls, i);
+  uint64_t epoch = codeEpoch(vm);
+  if (epoch != ls->epoch[i]) { // Blocks it shared may have changed
+      ls->epoch[i] = epoch;
+      for (size_t h = 0; h < ls->tableSize; h++) {
+          if (ls->table[h]) ls->table[h]->shared[i] = 0;
+      }
+  }
+  switch (stop) {
+      case VM_HALTED:
+      case VM_STOPPED:
+      case VM_EXITED:
+          retire(ls, i, stop);
+          break;
+      default: // Warnings are reported already, the lane carries on as lanvm would
+          if (ls->icount[i] >= ls->limit[i]) retire(ls, i, VM_BUDGET);
+          else if (ls->limit[i] - ls->icount[i] < ls->slack) ls->slack = ls->limit[i] - ls->icount[i];
+          break;
+  }
+}
+
+// Outcome of condition cond (the Jcc order), per lane as in flagByte()
+static inline LaneVec condition(int cond, LaneVec flags, LaneVec result, LaneVec lazy) {
+  LaneVec zero = {0};
+  LaneVec z = blend(lazy, (LaneVec)(result == zero), (LaneVec)((flags & FLAG_BIT(ZERO_FLAG)) != zero));
+  LaneVec o = blend(lazy, (LaneVec)((result >> (WORD_BITS - 1)) != zero), (LaneVec)((flags & FLAG_BIT(OVERFLOW_FLAG)) != zero));
+  LaneVec s = ~lazy & (LaneVec)((flags & FLAG_BIT(SIGN_FLAG)) != zero);
+  LaneVec c = ~lazy & (LaneVec)((flags & FLAG_BIT(CARRY_FLAG)) != zero);
+  switch (cond) {
+      case COND_Z: return z;
+      case COND_NZ: return ~z;
+      case COND_C: return c;
+      case COND_NC: return ~c;
+      case COND_JLE: return o | (s ^ z);
+      case COND_JGE: return ~zero;
+      case COND_L: return s ^ o;
+      default: return z & ~(s ^ o); // COND_G
+  }
+}
+
+static uint64_t leastSlack(const Lockstep *ls) {
+  uint64_t slack = UINT64_MAX;
+  for (int i = 0; i < ls->count; i++) {
+      if (ls->active[i] && ls->limit[i] - ls->icount[i] < slack) slack = ls->limit[i] - ls->icount[i];
+  }
+  return slack;
+}
+
+SIMD_CLONES static word_t lowestPc(const Lockstep *ls) {
+  LaneVec low = (LaneVec){0} + WORD_MAX;
+  for (size_t c = 0; c < ls->chunks; c++) {
+      LaneVec pc = lanes(ls->pc + c * LANES) | ~lanes(ls->active + c * LANES);
+      low = blend((LaneVec)(pc < low), pc, low);
+  }
+  word_t pc = WORD_MAX;
+  for (int j = 0; j < LANES; j++) {
+      if (low[j] < pc) pc = low[j];
+  }
+  return pc;
+}
+
+// Each vector of lanes from first to last, with in the mask of those running
+#define EACH_VECTOR(...) \
+  for (size_t c = first; c <= last; c++) { \
+      size_t o = c * LANES; \
+      LaneVec in = lanes(ls->in + o); \
+      __VA_ARGS__ \
+  }
+
+// Store v to the destination register of the running lanes, and as their flag result if this record sets it
+#define SET_DEST(v) do { \
+    LaneVec value = (v); \
+    setLanes(d + o, blend(in, value, lanes(d + o))); \
+    if (flags) setLanes(ls->flagResult + o, blend(in, value, lanes(ls->flagResult + o))); \
+  } while (0)
+
+#define VECTOR_ALU(name, op) \
+    case OP_##name##_RR: EACH_VECTOR(SET_DEST(lanes(d + o) op lanes(s + o));) break; \
+    case OP_##name##_RI: EACH_VECTOR(SET_DEST(lanes(d + o) op ins->imm);) break;
+
+/*
+ * Run the vector records of sb, and its exit if they include it, for the
+ * lanes at its PC that share it. Lanes at the PC that don't are listed in
+ * alone.
+ */
+SIMD_CLONES static void runShared(Lockstep *ls, SharedBlock *sb) {
+  size_t first = SIZE_MAX, last = 0;
+  LaneVec at = (LaneVec){0} + sb->pc;
+  for (size_t c = 0; c < ls->chunks; c++) {
+      size_t o = c * LANES;
+      LaneVec in = lanes(ls->active + o) & (LaneVec)(lanes(ls->pc + o) == at);
+      LaneVec pending = in & ~lanes(sb->shared + o);
+      if (anyLane(pending)) {
+          for (int j = 0; j < LANES; j++) {
+              if (pending[j] && !sameBlock(ls, sb, o + j)) ls->alone[ls->aloneCount++] = o + j;
+          }
+          in &= lanes(sb->shared + o);
+      }
+      setLanes(ls->in + o, in);
+      if (anyLane(in)) {
+          if (first == SIZE_MAX) first = c;
+          last = c;
+      }
+  }
+  if (first == SIZE_MAX) return;
+
+  for (int n = 0; n < sb->vector; n++) {
+      const Insn *ins = &sb->insns[n];
+      word_t *d = ls->regs[ins->dest], *s = ls->regs[ins->src];
+      bool flags = n == sb->flagsAt; // Earlier results are overwritten before anything reads them
+      switch (ins->op) {
+          case OP_LD_RR: flags = false; EACH_VECTOR(SET_DEST(lanes(s + o));) break;
+          case OP_LD_RI: flags = false; EACH_VECTOR(SET_DEST((LaneVec){0} + ins->imm);) break;
+          case OP_CMP_RR:
+              if (flags) EACH_VECTOR(setLanes(ls->flagResult + o, blend(in, lanes(d + o) - lanes(s + o), lanes(ls->flagResult + o)));)
+              break;
+          case OP_CMP_RI:
+              if (flags) EACH_VECTOR(setLanes(ls->flagResult + o, blend(in, lanes(d + o) - ins->imm, lanes(ls->flagResult + o)));)
+              break;
+          REG_ALU_OPS(VECTOR_ALU)
+          case OP_NOT_R: EACH_VECTOR(SET_DEST(~lanes(d + o));) break;
+          case OP_INC_R: EACH_VECTOR(SET_DEST(lanes(d + o) + 1);) break;
+          case OP_DEC_R: EACH_VECTOR(SET_DEST(lanes(d + o) - 1);) break;
+          default: break; // NOP
+      }
+  }
+
+  const Insn *branch = &sb->insns[sb->vector];
+  uint64_t length = sb->whole ? sb->length : sb->vector;
+  int fused = -1;
+  bool exitFlags = false;
+  if (sb->whole) {
+      switch (branch->op) {
+          case OP_CMP_JZ: case OP_CMP_JNZ: fused = FUSE_CMP_JCC; break;
+          case OP_DEC_JNZ: fused = FUSE_DEC_JNZ; break;
+          case OP_OR_JZ: case OP_OR_JNZ: fused = FUSE_OR_JCC; break;
+      }
+      exitFlags = fused >= 0;
+  }
+  bool flagsSet = sb->flagsAt >= 0 || exitFlags;
+  bool budget = length >= ls->slack; // Lanes may run out, otherwise none can
+  ls->slack -= budget ? 0 : length;
+  word_t *d = ls->regs[branch->dest];
+  word_t next = sb->whole ? branch->next : sb->insns[sb->vector - 1].next;
+  word_t target = branch->op >= OP_CMP_JZ ? branch->target : branch->imm;
+  EACH_VECTOR(
+      LaneVec zero = {0}, take = zero;
+      if (sb->whole) {
+          LaneVec result = lanes(ls->flagResult + o);
+          switch (branch->op) {
+              case OP_END: break;
+              case JMP_addr16: take = ~zero; break;
+              case OP_CMP_JZ:
+              case OP_CMP_JNZ:
+                  result = blend(in, lanes(d + o) - branch->imm, result);
+                  take = (LaneVec)(result == zero);
+                  if (branch->op == OP_CMP_JNZ) take = ~take;
+                  break;
+              case OP_DEC_JNZ:
+                  result = blend(in, lanes(d + o) - 1, result);
+                  setLanes(d + o, blend(in, result, lanes(d + o)));
+                  take = (LaneVec)(result != zero);
+                  break;
+              case OP_OR_JZ:
+              case OP_OR_JNZ:
+                  result = blend(in, lanes(d + o), result);
+                  take = (LaneVec)(result == zero);
+                  if (branch->op == OP_OR_JNZ) take = ~take;
+                  break;
+              default: // Jcc, on the flags of the block's own flag-setting instruction if it has one
+                  take = condition(branch->op - JZ_addr16, lanes(ls->flags + o), result,
+                      lanes(ls->lazy + o) | (sb->flagsAt >= 0 ? in : zero));
+                  break;
+          }
+          if (exitFlags) setLanes(ls->flagResult + o, result);
+      }
+      setLanes(ls->pc + o, blend(in, blend(take, zero + target, zero + next), lanes(ls->pc + o)));
+      if (flagsSet) setLanes(ls->lazy + o, lanes(ls->lazy + o) | in);
+
+      CountVec ran = (CountVec)__builtin_convertvector((LaneMask)in, CountMask); // Widened, still all ones or zero
+      CountVec icount = counts(ls->icount + o) + (ran & length);
+      setCounts(ls->icount + o, icount);
+      if (fused >= 0) setCounts(ls->fusions[fused] + o, counts(ls->fusions[fused] + o) - ran);
+      LaneVec spent = budget ? in & (LaneVec)__builtin_convertvector(icount >= counts(ls->limit + o), LaneMask) : zero;
+      if (anyLane(spent)) {
+          for (int j = 0; j < LANES; j++) {
+              if (spent[j]) retire(ls, o + j, VM_BUDGET);
+          }
+      }
+  )
+  if (budget) ls->slack = leastSlack(ls);
+}
+
+static int lockstepAlloc(Lockstep *ls) {
+  size_t n = ls->chunks * LANES;
+  for (int k = 0; k < 7; k++) {
+      if (!(ls->regs[k] = calloc(n, sizeof(word_t)))) return 1;
+  }
+  ls->pc = calloc(n, sizeof(word_t));
+  ls->flags = calloc(n, sizeof(word_t));
+  ls->flagResult = calloc(n, sizeof(word_t));
+  ls->lazy = calloc(n, sizeof(word_t));
+  ls->active = calloc(n, sizeof(word_t));
+  ls->in = calloc(n, sizeof(word_t));
+  ls->icount = calloc(n, sizeof(uint64_t));
+  ls->limit = calloc(n, sizeof(uint64_t));
+  ls->epoch = calloc(n, sizeof(uint64_t));
+  for (int f = 0; f < FUSE_COUNT; f++) {
+      if (!(ls->fusions[f] = calloc(n, sizeof(uint64_t)))) return 1;
+  }
+  ls->alone = calloc(n, sizeof(int));
+  ls->tableSize = 64;
+  ls->table = calloc(ls->tableSize, sizeof(*ls->table));
+  return !ls->pc || !ls->flags || !ls->flagResult || !ls->lazy || !ls->active || !ls->in || !ls->icount
+      || !ls->limit || !ls->epoch || !ls->alone || !ls->table;
+}
+
+static void lockstepFree(Lockstep *ls) {
+  for (int k = 0; k < 7; k++) free(ls->regs[k]);
+  free(ls->pc);
+  free(ls->flags);
+  free(ls->flagResult);
+  free(ls->lazy);
+  free(ls->active);
+  free(ls->in);
+  free(ls->icount);
+  free(ls->limit);
+  free(ls->epoch);
+  for (int f = 0; f < FUSE_COUNT; f++) free(ls->fusions[f]);
+  free(ls->alone);
+  for (size_t h = 0; ls->table && h < ls->tableSize; h++) freeShared(ls->table[h]);
+  free(ls->table);
+}
+
+/*
+ * Run count VMs in lockstep until each has exited, halted, been stopped or
+ * run max more instructions, and store why in stops. Warnings are reported
+ * and the lane carries on, as lanvm does. Every lane ends as it would
+ * running alone, but lanes that print do so in turns, and the output of
+ * lanes interleaves. Returns 1 if out of memory, before running anything.
+ */
+int vm_run_lockstep(VM **vms, int count, uint64_t max, VMStop *stops) {
+  Lockstep ls = {.vms = vms, .stops = stops, .count = count, .chunks = (count + LANES - 1) / LANES};
+  if (lockstepAlloc(&ls)) {
+      lockstepFree(&ls);
+      return 1;
+  }
+  for (int i = 0; i < count; i++) {
+      VM *vm = vms[i];
+      gather(&ls, i);
+      ls.epoch[i] = codeEpoch(vm);
+      ls.limit[i] = max > UINT64_MAX - vm->icount ? UINT64_MAX : vm->icount + max;
+      ls.active[i] = vm->exited ? 0 : WORD_MAX;
+      if (vm->exited) stops[i] = VM_EXITED;
+      else ls.running++;
+  }
+  ls.slack = leastSlack(&ls);
+
+  for (uint64_t steps = 1; ls.running; steps++) {
+      if (steps % STOP_INTERVAL == 0) {
+          for (int i = 0; i < count; i++) {
+              if (ls.active[i] && vms[i]->stop) retire(&ls, i, VM_STOPPED);
+          }
+          if (!ls.running) break;
+      }
+      word_t pc = lowestPc(&ls);
+      SharedBlock *sb = lookup(&ls, pc);
+      ls.aloneCount = 0;
+      if (sb && (sb->vector || sb->whole)) {
+          runShared(&ls, sb);
+      } else {
+          for (int i = 0; i < count; i++) {
+              if (ls.active[i] && ls.pc[i] == pc) ls.alone[ls.aloneCount++] = i;
+          }
+      }
+      for (int n = 0; n < ls.aloneCount; n++) runAlone(&ls, ls.alone[n]);
+      for (int n = 0; !sb && n < ls.aloneCount; n++) { // Share what the first of them decoded
+          Block *b = findBlock(vms[ls.alone[n]], pc);
+          if (b) {
+              share(&ls, b);
+              break;
+          }
+      }
+  }
+
+  for (int i = 0; i < count; i++) scatter(&ls, i);
+  lockstepFree(&ls);
+  return 0;
+}
+
+#else
+
+// Without vector extensions each lane runs on its own, one after the other
+int vm_run_lockstep(VM **vms, int count, uint64_t max, VMStop *stops) {
+  for (int i = 0; i < count; i++) {
+      VM *vm = vms[i];
+      uint64_t limit = max > UINT64_MAX - vm->icount ? UINT64_MAX : vm->icount + max;
+      VMStop stop;
+      do {
+          stop = vm_run(vm, limit - vm->icount);
+      } while ((stop == VM_EXCEPTION || stop == VM_IO_WAIT || stop == VM_BUDGET) && vm->icount < limit);
+      stops[i] = stop == VM_EXCEPTION || stop == VM_IO_WAIT ? VM_BUDGET : stop;
+  }
+  return 0;
+}
+
+#endif
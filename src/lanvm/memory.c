@@ -17,47 +17,399 @@
  * You should have received a copy of the GNU General Public License  
  * along with this program. If not, see <https://www.gnu.org/licenses/>.  
  */
-#include "../include/lanvm.h"
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create()
+#define LANVM_CLONE_MAP // Clones map a memory file, see memClone()
+#endif
 
-uint8_t fByte(VM *vm) {
-  return vm->memory[vm->pc++];
-}
+#include "../include/lanvm.h"
 
-uint16_t fWord(VM *vm) {
-  uint16_t temp = vm->memory[vm->pc++];
-  temp |= vm->memory[vm->pc++] << 8;
-  return temp;
-}
+#ifdef LANVM_GUARDED
+#include <signal.h>
+#endif
+#if defined(LANVM_GUARDED) || defined(LANVM_CLONE_MAP)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 void push8(VM *vm, uint8_t value) {
-  if (vm->sp == 0) {
+  if (vm->sp > vm->memSize || vm->sp == 0) {
       vm_exception(vm, ERR_STACK_OVERFLOW, EXC_SEVERE, 0);
       return;
   }
-  vm->memory[--vm->sp] = value;
+  *memAt(vm, --vm->sp) = value;
+  memWritten(vm, vm->sp, 1);
 }
 
 uint8_t pop8(VM *vm) {
   if (vm->sp > vm->memSize) {
       return vm_exception(vm, ERR_STACK_UNDERFLOW, EXC_SEVERE, 0);
   }
-  return vm->memory[vm->sp++];
+  return *memAt(vm, vm->sp++);
 }
 
-void push16(VM *vm, uint16_t value) {
-  if (vm->sp > vm->memSize) {
+// Words on the stack are big-endian, the low byte is pushed first
+void pushWord(VM *vm, word_t value) {
+  if (vm->sp > vm->memSize || vm->sp < WORD_BYTES) { // Below a word the stack pointer would wrap
       vm_exception(vm, ERR_STACK_OVERFLOW, EXC_SEVERE, 0);
       return;
   }
-  vm->memory[--vm->sp] = value & 0xff;
-  vm->memory[--vm->sp] = value >> 8;
+  for (int i = 0; i < WORD_BYTES; i++, value >>= 8) *memAt(vm, --vm->sp) = value & 0xff;
+  memWritten(vm, vm->sp, WORD_BYTES);
 }
 
-uint16_t pop16(VM *vm) {
+word_t popWord(VM *vm) {
   if (vm->sp > vm->memSize) {
       return vm_exception(vm, ERR_STACK_UNDERFLOW, EXC_SEVERE, 0);
   }
-  uint16_t temp = vm->memory[vm->sp++] << 8;
-  temp |= vm->memory[vm->sp++];
+  word_t temp = 0;
+  for (int i = 0; i < WORD_BYTES; i++) temp = temp << 8 | *memAt(vm, vm->sp++);
   return temp;
-}
\ No newline at end of file
+}
+
+// Show bank in window slot, NO_BANK for memory. Bases are biased by the
+// slot's address so memAt() is one load and an add.
+static void setWindow(VM *vm, int slot, uint16_t bank) {
+  uintptr_t data = bank == NO_BANK ? (uintptr_t)vm->memory : (uintptr_t)vm->banks[bank];
+  vm->windowBank[slot] = bank;
+  vm->windowBase[slot] = bank == NO_BANK ? data : data - ((uintptr_t)slot << BANK_SHIFT);
+}
+
+// Memory moved, follow it in the windows that show it
+static void rebaseWindows(VM *vm) {
+  for (int slot = 0; slot < BANK_WINDOWS; slot++) setWindow(vm, slot, vm->windowBank[slot]);
+}
+
+/*
+ * Clones share their template's memory until they write to it. The template
+ * keeps a copy of its memory in an anonymous memory file (its image) and
+ * each clone maps that file privately, so reads come from the file's pages
+ * and the kernel copies a page on the first store to it. A file is never
+ * written again once mapped, as clones would see the change in pages they
+ * haven't written, so a template whose memory moved on gets a new one.
+ * Elsewhere a clone gets a copy of the memory.
+ */
+#ifdef LANVM_CLONE_MAP
+
+static size_t imageBytes(void) { // The address space and the page past it, see memResize()
+  return ADDRESS_SPACE + sysconf(_SC_PAGESIZE);
+}
+
+static void dropImage(VM *vm) {
+  if (!vm->image) return;
+  munmap(vm->image, (size_t)vm->imageSize + MEMORY_SLACK);
+  close(vm->imageFd);
+  vm->image = NULL;
+  vm->imageFd = -1;
+}
+
+// Bring the image of vm up to date with its memory
+static int memImage(VM *vm) {
+  size_t size = (size_t)vm->memSize + MEMORY_SLACK;
+  if (vm->image && vm->imageSize == vm->memSize && memcmp(vm->image, vm->memory, size) == 0) return 0;
+  dropImage(vm);
+  int fd = memfd_create("lanvm-image", MFD_CLOEXEC);
+  if (fd < 0) return 1;
+  if (ftruncate(fd, imageBytes()) || pwrite(fd, vm->memory, size, 0) != (ssize_t)size) {
+      close(fd);
+      return 1;
+  }
+  uint8_t *image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED) {
+      close(fd);
+      return 1;
+  }
+  vm->image = image;
+  vm->imageFd = fd;
+  vm->imageSize = vm->memSize;
+  return 0;
+}
+
+#else
+
+static void dropImage(VM *vm) {
+  (void)vm;
+}
+
+#endif
+
+/*
+ * Guest RAM. By default it is a heap buffer of memSize bytes and every
+ * operand access is checked against memSize. With LANVM_GUARDED the whole
+ * 16-bit address space is reserved up front between two guard pages, and
+ * only the first memSize bytes (rounded up to pages) are accessible.
+ * VMMALLOC and VMFREE move that limit with mprotect, so memory never moves,
+ * and operand accesses go unchecked: one that lands outside the limit
+ * faults, and the dispatch loop reports it as ERR_OOB_OFF/ERR_OOB_REG and
+ * skips the instruction. Limits are then enforced at page granularity.
+ */
+#ifdef LANVM_GUARDED
+
+static size_t pageSize;
+static _Thread_local VM *faultVM; // VM whose dispatch loop catches faults
+static _Thread_local sigjmp_buf *faultJump;
+
+static size_t pageAlign(size_t size) {
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+static void onFault(int sig, siginfo_t *info, void *context) {
+  (void)context;
+  VM *vm = faultVM;
+  if (vm && faultJump) {
+      intptr_t addr = (uint8_t *)info->si_addr - vm->memory;
+      if (addr >= -(intptr_t)pageSize && addr < ADDRESS_SPACE + (intptr_t)pageSize) {
+          vm->faultAddress = addr;
+          siglongjmp(*faultJump, 1);
+      }
+  }
+  signal(sig, SIG_DFL); // Not a guest access, fault again without the handler
+}
+
+// Arm (jump != NULL) or disarm fault recovery for vm on this thread
+void memCatchFaults(VM *vm, sigjmp_buf *jump) {
+  faultVM = vm;
+  faultJump = jump;
+}
+
+int memInit(VM *vm, word_t size) {
+  if (!pageSize) {
+      pageSize = sysconf(_SC_PAGESIZE);
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = onFault;
+      sa.sa_flags = SA_SIGINFO | SA_NODEFER; // The handler leaves by siglongjmp
+      sigemptyset(&sa.sa_mask);
+      sigaction(SIGSEGV, &sa, NULL);
+      sigaction(SIGBUS, &sa, NULL);
+  }
+  uint8_t *base = mmap(NULL, ADDRESS_SPACE + 2 * pageSize, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) return 1;
+  vm->memory = base + pageSize;
+  vm->committed = 0;
+  vm->memSize = 0;
+  return memResize(vm, size);
+}
+
+int memResize(VM *vm, word_t size) {
+  size_t committed = pageAlign(size + MEMORY_SLACK);
+  if (committed > vm->committed) {
+      if (mprotect(vm->memory + vm->committed, committed - vm->committed, PROT_READ | PROT_WRITE)) return 1;
+  } else if (committed < vm->committed) { // Released pages read as zero once committed again
+      mmap(vm->memory + committed, vm->committed - committed, PROT_NONE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  vm->committed = committed;
+  vm->memSize = size;
+  rebaseWindows(vm);
+  return 0;
+}
+
+void memFree(VM *vm) {
+  dropImage(vm);
+  if (!vm->memory) return;
+  munmap(vm->memory - pageSize, ADDRESS_SPACE + 2 * pageSize);
+  vm->memory = NULL;
+}
+
+#ifdef LANVM_CLONE_MAP
+static int mapClone(VM *vm, VM *template) { // The image goes over the reserved range, guard pages and all
+  if (memInit(vm, 0)) return 1;
+  if (mmap(vm->memory, imageBytes(), PROT_NONE, MAP_PRIVATE | MAP_FIXED, template->imageFd, 0) == MAP_FAILED) {
+      return 1;
+  }
+  vm->committed = 0;
+  vm->mapped = true;
+  return memResize(vm, template->memSize);
+}
+#endif
+
+#else
+
+int memInit(VM *vm, word_t size) {
+  vm->memory = calloc((size_t)size + MEMORY_SLACK, sizeof(uint8_t));
+  vm->memSize = size;
+  rebaseWindows(vm);
+  return vm->memory ? 0 : 1;
+}
+
+int memResize(VM *vm, word_t size) {
+  if (codeResize(vm, size)) return 1; // Stores check the tables for every address of memory
+  if (vm->mapped) { // The mapping covers every size
+      vm->memSize = size;
+      return 0;
+  }
+  uint8_t *memory = realloc(vm->memory, (size_t)size + MEMORY_SLACK);
+  if (!memory) return 1;
+  vm->memory = memory;
+  vm->memSize = size;
+  rebaseWindows(vm);
+  return 0;
+}
+
+void memFree(VM *vm) {
+  dropImage(vm);
+#ifdef LANVM_CLONE_MAP
+  if (vm->mapped) munmap(vm->memory, imageBytes());
+  else
+#endif
+  free(vm->memory);
+  vm->memory = NULL;
+  vm->mapped = false;
+}
+
+#ifdef LANVM_CLONE_MAP
+static int mapClone(VM *vm, VM *template) {
+  uint8_t *memory = mmap(NULL, imageBytes(), PROT_READ | PROT_WRITE, MAP_PRIVATE, template->imageFd, 0);
+  if (memory == MAP_FAILED) return 1;
+  vm->memory = memory;
+  vm->memSize = template->memSize;
+  vm->mapped = true;
+  rebaseWindows(vm);
+  return 0;
+}
+#endif
+
+#endif
+
+// Give vm the memory of template, shared until written where possible
+int memClone(VM *vm, VM *template) {
+  vm->memory = NULL;
+  vm->mapped = false;
+#ifdef LANVM_CLONE_MAP
+  if (!memImage(template)) return mapClone(vm, template);
+#endif
+  if (memInit(vm, template->memSize)) return 1;
+  memcpy(vm->memory, template->memory, (size_t)template->memSize + MEMORY_SLACK);
+  return 0;
+}
+
+/*
+ * Harvard mode. The program is loaded into a code space of its own, size
+ * bytes, and memory only holds data and the stack. No instruction
+ * addresses the code space, so stores never reach code and a restart
+ * leaves it as loaded. Clones share their template's.
+ */
+int memCodeSpace(VM *vm, word_t size) {
+  memFreeCode(vm);
+  vm->codeSpace = calloc((size_t)size + MEMORY_SLACK, 1);
+  vm->codeSize = size;
+  if (!vm->codeSpace) return 1;
+  return codeResize(vm, size);
+}
+
+void memFreeCode(VM *vm) {
+  if (!vm->sharedCode) free(vm->codeSpace);
+  vm->codeSpace = NULL;
+  vm->codeSize = 0;
+  vm->sharedCode = false;
+}
+
+/*
+ * VMRESTART puts memory back the way the program was loaded. Stores mark
+ * the pages they touch dirty (see memWritten()), so only those are compared
+ * with the pristine copy and copied back, and only the bytes that actually
+ * changed retire decoded blocks. Restarting a program that keeps its data
+ * in a few pages costs a few hundred bytes of copying. Extended memory is
+ * not part of the program and is dropped.
+ */
+int memSnapshot(VM *vm) {
+  size_t size = (size_t)vm->baseMemSize + MEMORY_SLACK;
+  uint8_t *pristine = realloc(vm->sharedPristine ? NULL : vm->pristine, size);
+  if (!pristine) return 1;
+  memcpy(pristine, vm->memory, size);
+  vm->pristine = pristine;
+  vm->sharedPristine = false;
+  memset(vm->dirty, 0, sizeof(vm->dirty));
+  return 0;
+}
+
+int memReset(VM *vm) {
+  memFreeBanks(vm);
+  bool resized = vm->memSize != vm->baseMemSize;
+  if (resized) { // Set stack size back to what the program was loaded with
+      if (memResize(vm, vm->baseMemSize)) return 1;
+      vm->code.flushPending = !vm->codeSpace;
+  }
+  if (!vm->pristine) return 0;
+  size_t size = (size_t)vm->baseMemSize + MEMORY_SLACK;
+  for (size_t page = 0; page << DIRTY_PAGE_SHIFT < size; page++) {
+      if (!resized && !vm->dirty[page]) continue; // Memory that moved or shrank is restored whole
+      size_t start = page << DIRTY_PAGE_SHIFT;
+      size_t end = start + (1 << DIRTY_PAGE_SHIFT) < size ? start + (1 << DIRTY_PAGE_SHIFT) : size;
+      while (start < end && vm->memory[start] == vm->pristine[start]) start++;
+      while (end > start && vm->memory[end - 1] == vm->pristine[end - 1]) end--;
+      if (start == end) continue;
+      memcpy(vm->memory + start, vm->pristine + start, end - start);
+      if (!resized) invalidateCode(vm, start, end - start);
+      vm->restoredPages++;
+  }
+  memset(vm->dirty, 0, sizeof(vm->dirty));
+  return 0;
+}
+
+/*
+ * Extended memory. MAX_BANKS banks of BANK_SIZE bytes live outside the
+ * address space, and VMBANK shows one in a window: any BANK_SIZE-aligned
+ * part of memory. vm->windowBase has a slot per window, so a data access
+ * costs a table lookup (memAt()) and switching banks is storing a pointer.
+ * Banks are allocated, zeroed, when first used.
+ */
+
+// Bank number bank, allocated on first use, NULL if there is no such bank or no memory for it
+uint8_t *memBank(VM *vm, uint16_t bank) {
+  if (bank >= MAX_BANKS) return NULL;
+  if (!vm->banks && !(vm->banks = calloc(MAX_BANKS, sizeof(uint8_t *)))) return NULL;
+  if (!vm->banks[bank]) {
+      if (!(vm->banks[bank] = calloc(BANK_SIZE + MEMORY_SLACK, 1))) return NULL;
+      vm->bankCount++;
+  }
+  return vm->banks[bank];
+}
+
+// Show bank (NO_BANK for memory) in the window at addr, returns 1 if either is invalid
+int memMapBank(VM *vm, uint16_t bank, word_t addr) {
+#ifdef LANVM_WORD32
+  (void)vm;
+  (void)bank;
+  (void)addr;
+  return 1; // Memory reaches 4 GiB without banks
+#else
+  if (addr & (BANK_SIZE - 1) || (uint32_t)addr + BANK_SIZE - 1 > vm->memSize) return 1;
+  if (bank != NO_BANK && !memBank(vm, bank)) return 1;
+  setWindow(vm, addr >> BANK_SHIFT, bank);
+  return 0;
+#endif
+}
+
+// Close the windows that no longer fit in memory after it shrank
+void memUnmapBanks(VM *vm) {
+  for (uint32_t slot = 0; slot < BANK_WINDOWS; slot++) {
+      if ((slot + 1) * BANK_SIZE - 1 > vm->memSize) setWindow(vm, slot, NO_BANK);
+  }
+}
+
+void memFreeBanks(VM *vm) {
+  for (int slot = 0; slot < BANK_WINDOWS; slot++) setWindow(vm, slot, NO_BANK);
+  if (!vm->banks) return;
+  for (int i = 0; i < MAX_BANKS; i++) free(vm->banks[i]);
+  free(vm->banks);
+  vm->banks = NULL;
+  vm->bankCount = 0;
+}
+
+// Give vm copies of the banks of template, its windows follow once it has memory
+int memCloneBanks(VM *vm, const VM *template) {
+  vm->banks = NULL;
+  vm->bankCount = 0;
+  if (!template->banks) return 0;
+  if (!(vm->banks = calloc(MAX_BANKS, sizeof(uint8_t *)))) return 1;
+  for (int i = 0; i < MAX_BANKS; i++) {
+      if (!template->banks[i]) continue;
+      if (!(vm->banks[i] = malloc(BANK_SIZE + MEMORY_SLACK))) return 1;
+      memcpy(vm->banks[i], template->banks[i], BANK_SIZE + MEMORY_SLACK);
+      vm->bankCount++;
+  }
+  return 0;
+}
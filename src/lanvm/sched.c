@@ -0,0 +1,363 @@
+/*
+ * Lanskern ByteCode - A Virtual Machine & Assembler
+ * Copyright (c) 2025 Benjamin Helle
+ *
+ * This file is part of Lanskern ByteCode.
+ *
+ * Lanskern ByteCode is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Lanskern ByteCode is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "../include/lanvm.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define SCHED_EPOLL
+#endif
+
+/*
+ * Scheduler for running many guest VMs on a pool of worker threads. Each
+ * worker has a deque of runnable guests. It takes the guest at the front,
+ * runs it for a quantum of instructions and puts it back at the end, so the
+ * guests of a deque take turns. A worker whose deque is empty steals the
+ * guest at the back of another one, the one that would wait longest there,
+ * and sleeps when there is nothing to steal either. A guest whose vm_run()
+ * returns VM_IO_WAIT is parked, in no deque, until sched_wake() queues it
+ * again. Deques are guarded by a lock each: a worker takes it once per
+ * quantum, which is thousands of instructions, so it is never contended
+ * for long.
+ *
+ * On Linux a guest waiting for the descriptor it reads its input from (see
+ * input.c) is parked by the scheduler: the descriptor is added to an epoll
+ * set, one-shot, and a poller thread wakes the guest once it is readable.
+ * Idle interactive guests then take no worker and no thread of their own.
+ * Guests waiting on a channel (see channel.c) are parked the same way, and
+ * woken by the guest at its other end.
+ */
+
+#define DEFAULT_QUANTUM 10000 // Instructions a guest runs before the next one's turn
+#define DEQUE_MIN 16 // Initial capacity, deques double when full
+#define POLL_EVENTS 64 // Readable descriptors taken per epoll_wait()
+
+// VM.schedState, see sched_wake()
+enum {
+  GUEST_QUEUED,
+  GUEST_RUNNING,
+  GUEST_PARKED,
+  GUEST_WOKEN // Woken while running, queued again instead of parked
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  VM **ring; // count guests from head, wrapping around capacity
+  size_t capacity, head, count;
+} Deque;
+
+typedef struct {
+  Scheduler *sched;
+  int index;
+  pthread_t thread;
+} Worker;
+
+struct Scheduler {
+  SchedConfig config;
+  int workers;
+  Worker *pool;
+  Deque *deques; // One per worker
+  atomic_size_t queued; // Guests in every deque
+  atomic_uint next; // Deque the next guest from outside the pool goes to
+  pthread_mutex_t lock; // For sleeping, and for waiting on live
+  pthread_cond_t work, idle;
+  atomic_int sleepers;
+  size_t live; // Guests submitted and not yet finished, parked ones included
+  atomic_bool shutdown;
+#ifdef SCHED_EPOLL
+  int epoll; // Input descriptors of parked guests, -1 if there is no poller
+  int quit; // eventfd in the set, written to stop the poller
+  pthread_t poller;
+#endif
+};
+
+static int pushBack(Deque *d, VM *vm) {
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity) {
+      size_t capacity = d->capacity ? d->capacity * 2 : DEQUE_MIN;
+      VM **ring = malloc(capacity * sizeof(*ring));
+      if (!ring) {
+          pthread_mutex_unlock(&d->lock);
+          return 1;
+      }
+      for (size_t i = 0; i < d->count; i++) ring[i] = d->ring[(d->head + i) % d->capacity];
+      free(d->ring);
+      d->ring = ring;
+      d->capacity = capacity;
+      d->head = 0;
+  }
+  d->ring[(d->head + d->count++) % d->capacity] = vm;
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+static VM *popFront(Deque *d) {
+  pthread_mutex_lock(&d->lock);
+  VM *vm = NULL;
+  if (d->count) {
+      vm = d->ring[d->head];
+      d->head = (d->head + 1) % d->capacity;
+      d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return vm;
+}
+
+static VM *popBack(Deque *d) {
+  pthread_mutex_lock(&d->lock);
+  VM *vm = d->count ? d->ring[(d->head + --d->count) % d->capacity] : NULL;
+  pthread_mutex_unlock(&d->lock);
+  return vm;
+}
+
+// Queue vm on deque index and wake a sleeping worker to take it, returns 1 if out of memory
+static int enqueue(Scheduler *s, int index, VM *vm) {
+  atomic_store(&vm->schedState, GUEST_QUEUED);
+  if (pushBack(&s->deques[index], vm)) return 1;
+  atomic_fetch_add(&s->queued, 1);
+  if (atomic_load(&s->sleepers)) { // Paired with the check in waitForWork()
+      pthread_mutex_lock(&s->lock);
+      pthread_cond_signal(&s->work);
+      pthread_mutex_unlock(&s->lock);
+  }
+  return 0;
+}
+
+// Own guests first, then the other deques starting with the next one
+static VM *takeGuest(Scheduler *s, int self) {
+  VM *vm = popFront(&s->deques[self]);
+  for (int i = 1; !vm && i < s->workers; i++) vm = popBack(&s->deques[(self + i) % s->workers]);
+  if (vm) atomic_fetch_sub(&s->queued, 1);
+  return vm;
+}
+
+// Sleep until a guest is queued anywhere, returns false on shutdown
+static bool waitForWork(Scheduler *s) {
+  pthread_mutex_lock(&s->lock);
+  atomic_fetch_add(&s->sleepers, 1);
+  while (!atomic_load(&s->shutdown) && !atomic_load(&s->queued)) pthread_cond_wait(&s->work, &s->lock);
+  atomic_fetch_sub(&s->sleepers, 1);
+  bool running = !atomic_load(&s->shutdown);
+  pthread_mutex_unlock(&s->lock);
+  return running;
+}
+
+#ifdef SCHED_EPOLL
+// Park vm until its input descriptor is readable, returns 1 if it can't be watched
+static int watchInput(Scheduler *s, VM *vm) {
+  if (s->epoll < 0 || vm->waiting != WAIT_INPUT) return 1;
+  struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = vm};
+  if (!epoll_ctl(s->epoll, EPOLL_CTL_MOD, vm->input.fd, &event)) return 0; // Watched before, armed again
+  return errno != ENOENT || epoll_ctl(s->epoll, EPOLL_CTL_ADD, vm->input.fd, &event);
+}
+
+static void *pollerMain(void *arg) {
+  Scheduler *s = arg;
+  struct epoll_event events[POLL_EVENTS];
+  for (;;) {
+      int n = epoll_wait(s->epoll, events, POLL_EVENTS, -1);
+      if (n < 0 && errno != EINTR) return NULL;
+      for (int i = 0; i < n; i++) {
+          if (events[i].data.ptr == s) return NULL; // quit
+          sched_wake(s, events[i].data.ptr);
+      }
+  }
+}
+
+// Start the poller, without it input waits go the way of other I/O waits
+static void startPoller(Scheduler *s) {
+  s->epoll = epoll_create1(EPOLL_CLOEXEC);
+  s->quit = eventfd(0, EFD_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = s};
+  if (s->epoll < 0 || s->quit < 0 || epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->quit, &event)
+      || pthread_create(&s->poller, NULL, pollerMain, s)) {
+      if (s->epoll >= 0) close(s->epoll);
+      if (s->quit >= 0) close(s->quit);
+      s->epoll = s->quit = -1;
+  }
+}
+
+static void stopPoller(Scheduler *s) {
+  if (s->epoll < 0) return;
+  uint64_t one = 1;
+  while (write(s->quit, &one, sizeof(one)) < 0 && errno == EINTR) {}
+  pthread_join(s->poller, NULL);
+  close(s->epoll);
+  close(s->quit);
+}
+#else
+static int watchInput(Scheduler *s, VM *vm) {
+  (void)s;
+  (void)vm;
+  return 1;
+}
+#endif
+
+static void finish(Scheduler *s, VM *vm, VMStop stop) {
+#ifdef SCHED_EPOLL
+  if (s->epoll >= 0 && vm->input.fd >= 0) epoll_ctl(s->epoll, EPOLL_CTL_DEL, vm->input.fd, NULL);
+#endif
+  atomic_store(&vm->sched, NULL);
+  if (s->config.finished) s->config.finished(s, vm, stop, s->config.user);
+  pthread_mutex_lock(&s->lock);
+  if (!--s->live) pthread_cond_broadcast(&s->idle);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *workerMain(void *arg) {
+  Worker *w = arg;
+  Scheduler *s = w->sched;
+  while (!atomic_load(&s->shutdown)) {
+      VM *vm = takeGuest(s, w->index);
+      if (!vm) {
+          if (!waitForWork(s)) return NULL;
+          continue;
+      }
+      atomic_store(&vm->schedState, GUEST_RUNNING);
+      VMStop stop = vm_run(vm, s->config.quantum);
+      int running = GUEST_RUNNING;
+      switch (stop) {
+          case VM_BUDGET:
+          case VM_EXCEPTION: // Reported already, the guest carries on as it would alone
+              if (enqueue(s, w->index, vm)) finish(s, vm, stop);
+              break;
+          case VM_IO_WAIT: // Parked unless a wake came first, see sched_wake()
+              if (vm->waiting != WAIT_CHANNEL && watchInput(s, vm)) { // The other end wakes channel waits
+                  if (!s->config.parked) {
+                      if (enqueue(s, w->index, vm)) finish(s, vm, stop);
+                      break;
+                  }
+                  s->config.parked(s, vm, s->config.user);
+              }
+              if (!atomic_compare_exchange_strong(&vm->schedState, &running, GUEST_PARKED) && enqueue(s, w->index, vm)) {
+                  finish(s, vm, stop);
+              }
+              break;
+          default:
+              finish(s, vm, stop);
+              break;
+      }
+  }
+  return NULL;
+}
+
+static int onlineCores(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+// Start the worker threads, NULL if they can't be
+Scheduler *sched_create(const SchedConfig *config) {
+  Scheduler *s = calloc(1, sizeof(*s));
+  if (!s) return NULL;
+  if (config) s->config = *config;
+  if (!s->config.quantum) s->config.quantum = DEFAULT_QUANTUM;
+  s->workers = s->config.workers > 0 ? s->config.workers : onlineCores();
+  s->pool = calloc(s->workers, sizeof(*s->pool));
+  s->deques = calloc(s->workers, sizeof(*s->deques));
+  if (!s->pool || !s->deques) {
+      free(s->pool);
+      free(s->deques);
+      free(s);
+      return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->idle, NULL);
+  for (int i = 0; i < s->workers; i++) pthread_mutex_init(&s->deques[i].lock, NULL);
+#ifdef SCHED_EPOLL
+  startPoller(s);
+#endif
+  for (int i = 0; i < s->workers; i++) {
+      s->pool[i] = (Worker){.sched = s, .index = i};
+      if (pthread_create(&s->pool[i].thread, NULL, workerMain, &s->pool[i])) {
+          s->workers = i; // sched_destroy() joins the ones that started
+          sched_destroy(s);
+          return NULL;
+      }
+  }
+  return s;
+}
+
+/*
+ * Run vm on the scheduler until it finishes, which the finished callback
+ * reports. Guests are spread over the deques in turn. Returns 1 if vm
+ * can't be queued.
+ */
+int sched_submit(Scheduler *s, VM *vm) {
+  pthread_mutex_lock(&s->lock);
+  s->live++;
+  pthread_mutex_unlock(&s->lock);
+  atomic_store(&vm->sched, s);
+  if (!enqueue(s, atomic_fetch_add(&s->next, 1) % s->workers, vm)) return 0;
+  atomic_store(&vm->sched, NULL);
+  pthread_mutex_lock(&s->lock);
+  if (!--s->live) pthread_cond_broadcast(&s->idle);
+  pthread_mutex_unlock(&s->lock);
+  return 1;
+}
+
+/*
+ * Queue a parked guest again, once whatever it waits for is there. A guest
+ * woken while it still runs, before the worker has parked it, is queued
+ * again right away, so a wake is never lost. Guests that are queued
+ * already are left alone.
+ */
+void sched_wake(Scheduler *s, VM *vm) {
+  int state = atomic_load(&vm->schedState);
+  for (;;) {
+      if (state == GUEST_PARKED) {
+          if (!atomic_compare_exchange_weak(&vm->schedState, &state, GUEST_QUEUED)) continue;
+          if (enqueue(s, atomic_fetch_add(&s->next, 1) % s->workers, vm)) finish(s, vm, VM_IO_WAIT);
+          return;
+      }
+      if (state != GUEST_RUNNING || atomic_compare_exchange_weak(&vm->schedState, &state, GUEST_WOKEN)) return;
+  }
+}
+
+// Wait until every guest submitted has finished
+void sched_wait(Scheduler *s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->live) pthread_cond_wait(&s->idle, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Stop the workers and free s, guests still queued or parked are left to their owner
+void sched_destroy(Scheduler *s) {
+  if (!s) return;
+  pthread_mutex_lock(&s->lock);
+  atomic_store(&s->shutdown, true);
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  for (int i = 0; i < s->workers; i++) pthread_join(s->pool[i].thread, NULL);
+#ifdef SCHED_EPOLL
+  stopPoller(s);
+#endif
+  for (int i = 0; i < s->workers; i++) free(s->deques[i].ring);
+  free(s->pool);
+  free(s->deques);
+  free(s);
+}
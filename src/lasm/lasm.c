@@ -24,6 +24,7 @@
 
 #include "../include/lasm.h"
 #include "../include/lanvm.h"
+#include "../include/lanimg.h"
 
 Instruction instructions[] = {
     {"NOP", NOP, 1}, {"LD", LD_dest_src, 2}, {"PUSH", PUSH_src, 2}, {"POP", POP_dest, 2},
@@ -37,7 +38,8 @@ Instruction instructions[] = {
     {"IN", IN_dest, 2}, {"OUT", OUT_src, 2}, {"GETS", GETS_r4, 1}, {"PRINTS", PRINTS_r3, 1},
     {"SETZ", SETZ_dest, 2}, {"SETNZ", SETNZ_dest, 2}, {"SETL", SETL_dest, 2}, {"SETLE", SETLE_dest, 2},
     {"SETG", SETG_dest, 2}, {"SETGE", SETGE_dest, 2}, {"SETB", SETB_dest, 2}, {"SETBE", SETBE_dest, 2}, {"SETA", SETA_dest, 2}, {"SETAE", SETAE_dest, 2},
-    {"VMEXIT", VMEXIT, 2}, {"VMRESTART", VMRESTART, 1}, {"VMGETMEMSIZE", VMGETMEMSIZE, 1}, {"VMSTATE", VMSTATE, 1}, {"VMMALLOC", VMMALLOC, 3}, {"VMFREE", VMFREE, 3},
+    {"VMEXIT", VMEXIT, 2}, {"VMRESTART", VMRESTART, 1}, {"VMGETMEMSIZE", VMGETMEMSIZE, 1}, {"VMSTATE", VMSTATE, 1}, {"VMMALLOC", VMMALLOC, 3}, {"VMFREE", VMFREE, 3}, {"VMBANK", VMBANK, 1},
+    {"VMCHOPEN", VMCHOPEN, 1}, {"VMCHSEND", VMCHSEND, 1}, {"VMCHRECV", VMCHRECV, 1},
     {"GLINIT", GLINIT, 1}, {"GLCLEAR", GLCLEAR, 1}, {"GLSETCOLOR", GLSETCOLOR, 1}, {"GLPLOT", GLPLOT, 1}, {"GLRECT", GLRECT, 1}, {"GLLINE", GLLINE, 1},
     {"LIV", LIV_addr16, 3}, {"LEA", LEA_dest_bpoff, 4}
 };
@@ -46,7 +48,14 @@ Instruction instructions[] = {
 
 Label labels[MAX_LABELS];
 int label_count = 0;
-uint16_t current_address = 0;
+uint32_t current_address = 0;
+
+uint8_t code[0x100000]; // Code section, filled in pass 2
+uint32_t code_size = 0;
+char entry_label[32] = ""; // Set by .entry, the program starts at 0 otherwise
+uint32_t mem_size = 0; // Set by .memsize, 0 leaves it to the VM
+uint32_t image_flags = 0; // Set by .harvard and .bits
+int word_bytes = 2; // Size of immediates and addresses, 4 after .bits 32
 
 
 // Custom functions for the assembler
@@ -83,13 +92,13 @@ void LowerToCap(char *str) {
     }
 }
 
-void store_label(const char *name, uint16_t address) {
+void store_label(const char *name, uint32_t address) {
     strcpy(labels[label_count].name, name);
     labels[label_count].address = address;
     label_count++;
 }
 
-uint16_t resolve_label(const char *operand) {
+uint32_t resolve_label(const char *operand) {
     for (int i = 0; i < label_count; i++) {
         if (strcmp(labels[i].name, operand) == 0) {
             return labels[i].address;
@@ -100,6 +109,28 @@ uint16_t resolve_label(const char *operand) {
 }
 
 
+void emit_byte(uint8_t byte) {
+    if (code_size == sizeof(code)) {
+        fprintf(stderr, "Error: Program is larger than %zu bytes\n", sizeof(code));
+        exit(1);
+    }
+    code[code_size++] = byte;
+}
+
+void emit_word(uint32_t word) {
+    for (int i = 0; i < word_bytes; i++) emit_byte(word >> 8 * i & 0xFF);
+}
+
+// Immediate or address operand, the instruction sizes count two bytes for it
+void word_operand(uint32_t value, int pass) {
+    current_address += word_bytes - 2;
+    if (pass == 2) emit_word(value);
+}
+
+uint32_t parse_number(const char *str) {
+    return strtoul(str, NULL, 10);
+}
+
 uint8_t get_opcode(const char *mnemonic) {
     for (size_t i = 0; i < INSTRUCTION_COUNT; i++) {
         if (strcmp(mnemonic, instructions[i].mnemonic) == 0) {
@@ -146,24 +177,55 @@ uint8_t encode_operand(const char *operand, int8_t *offset) {
     return 0; // Return 0x0 if no match, defaults to r0
 }
 
-void genInsOffs(FILE *output, uint8_t opcode, char *operand1, char *operand2, int pass) { // Generate the instruction and offset bytes
+void genInsOffs(uint8_t opcode, char *operand1, char *operand2, int pass) { // Generate the instruction and offset bytes
     int8_t offset = 0;
     uint8_t ds_byte = (encode_operand(operand1, &offset) << 4) | encode_operand(operand2, &offset);
     if (pass == 2) {
-        fprintf(output, "%02x%02x", opcode, ds_byte);
+        emit_byte(opcode);
+        emit_byte(ds_byte);
     }
     if (offset != 0 && pass == 2) {
-        fprintf(output, "%02x", (offset & 0xFF));
+        emit_byte(offset & 0xFF);
     } if (offset != 0) current_address += 1;
 }
 
-void assemble_line(char *line, FILE *output, int pass) {
+// .entry <label> sets the entry point, .memsize <bytes> the memory the program asks for,
+// .harvard runs it with code in an address space of its own, .bits 32 makes it a 32-bit program
+void assemble_directive(char *line, int pass) {
+    char name[16], value[32] = "";
+    sscanf(line, "%15s %31s", name, value);
+    if (strcmp(name, ".entry") == 0) {
+        strcpy(entry_label, value);
+        if (pass == 2) resolve_label(entry_label); // Undefined labels are an error
+    } else if (strcmp(name, ".memsize") == 0) {
+        mem_size = parse_number(value);
+    } else if (strcmp(name, ".harvard") == 0) {
+        image_flags |= IMG_HARVARD;
+    } else if (strcmp(name, ".bits") == 0) {
+        if (strcmp(value, "16") != 0 && strcmp(value, "32") != 0) {
+            if (pass == 1) fprintf(stderr, "Error: .bits takes 16 or 32\n");
+        } else if (current_address != 0) {
+            if (pass == 1) fprintf(stderr, "Error: .bits must come before the first instruction\n");
+        } else {
+            word_bytes = atoi(value) / 8;
+            image_flags = word_bytes == 4 ? image_flags | IMG_WIDE : image_flags & ~IMG_WIDE;
+        }
+    } else if (pass == 1) {
+        fprintf(stderr, "Error: Unknown directive '%s'\n", name);
+    }
+}
+
+void assemble_line(char *line, int pass) {
     if (line[strlen(line) - 2] == ':') {
         line[strlen(line) - 2] = '\0';  // Remove ':'
         if (pass == 1) store_label(line, current_address);
         return;
     } else if (line[0] == '\n') return;
     remove_leading_tabs_and_spaces(line); // Remove leading tabs and spaces
+    if (line[0] == '.') {
+        assemble_directive(line, pass);
+        return;
+    }
     char mnemonic[16], operand1[16], operand2[16] = "";
 
     int count = sscanf(line, "%s %[^,], %s", mnemonic, operand1, operand2);
@@ -188,71 +250,93 @@ void assemble_line(char *line, FILE *output, int pass) {
         if (opcode == LD_dest_src || opcode == LD_dest_imm16) { // ld
             if (isdigit(operand2[0])) { // ld dest, imm16
                 current_address += 2;
-                genInsOffs(output, LD_dest_imm16, operand1, NULL, pass);
-                if (pass == 2) {
-                    fprintf(output, "%02x%02x", (atoi(operand2) & 0xFF), (atoi(operand2) >> 8) & 0xFF);
-                }
+                genInsOffs(LD_dest_imm16, operand1, NULL, pass);
+                word_operand(parse_number(operand2), pass);
 
             } else {
-                genInsOffs(output, opcode, operand1, operand2, pass);
+                genInsOffs(opcode, operand1, operand2, pass);
             }
         } else if (opcode >= ADD_dest_src && opcode <= DIV_dest_imm16) {
             if (isdigit(operand2[0])) {// op dest, imm16
                 current_address += 2;
-                genInsOffs(output, opcode+1, operand1, NULL, pass); // opcode +1 = opcode with imm16
-                if (pass == 2) {
-                    fprintf(output, "%02x%02x", (atoi(operand2) & 0xFF), (atoi(operand2) >> 8) & 0xFF);
-                }
+                genInsOffs(opcode+1, operand1, NULL, pass); // opcode +1 = opcode with imm16
+                word_operand(parse_number(operand2), pass);
             } else { // op dest, src
-                genInsOffs(output, opcode, operand1, operand2, pass);
+                genInsOffs(opcode, operand1, operand2, pass);
             }
 
         } else if (opcode == LEA_dest_bpoff) {
-            genInsOffs(output, opcode, operand1, operand2, pass);
+            genInsOffs(opcode, operand1, operand2, pass);
         }
     }
 
     else if (count == 2) { // push, pop, jmp, etc..
         if (opcode >= JMP_addr16 && opcode <= CALL_addr16) { // Jump and call
-            uint16_t addr = (pass == 2) ? resolve_label(operand1) : 0;
-            if (pass == 2) fprintf(output, "%02x%02x%02x", opcode, addr & 0xFF, (addr >> 8) & 0xFF);
+            uint32_t addr = (pass == 2) ? resolve_label(operand1) : 0;
+            if (pass == 2) emit_byte(opcode);
+            word_operand(addr, pass);
         } else if (opcode == PUSH_imm16 || opcode == PUSH_src) { // Push
             if (isdigit(operand1[0])) { // Immediate
                 current_address += 1;
-                if (pass == 2) fprintf(output, "%02x%02x%02x", PUSH_imm16, atoi(operand1) & 0xFF, (atoi(operand1) >> 8) & 0xFF);
+                if (pass == 2) emit_byte(PUSH_imm16);
+                word_operand(parse_number(operand1), pass);
             } else { // Reg/mem
-                genInsOffs(output, opcode, operand1, NULL, pass);
+                genInsOffs(opcode, operand1, NULL, pass);
             }
         } else if (opcode == POP_dest || opcode >= NOT_dest && opcode <= DEC_dest || opcode == IN_dest) { // Instructions that have a destination 
-            genInsOffs(output, opcode, operand1, NULL, pass);
+            genInsOffs(opcode, operand1, NULL, pass);
         }else if (opcode == OUT_src) {
-            genInsOffs(output, opcode, NULL, operand1, pass);
+            genInsOffs(opcode, NULL, operand1, pass);
         } else if (opcode == VMEXIT || opcode >= VMMALLOC && opcode <= VMFREE) { // Hypervisor calls
             if (opcode == VMEXIT) {
-                if (pass == 2) fprintf(output, "%02x%02x", opcode, atoi(operand1));
+                if (pass == 2) { emit_byte(opcode); emit_byte(atoi(operand1)); }
             } else {
-                if (pass == 2) fprintf(output, "%02x%02x%02x", opcode, atoi(operand1) & 0xFF, (atoi(operand1) >> 8) & 0xFF);
+                if (pass == 2) emit_byte(opcode);
+                word_operand(parse_number(operand1), pass);
             }
         } else if (opcode == LIV_addr16) {
-            uint16_t addr = (pass == 2) ? resolve_label(operand1) : 0;
-            if (pass == 2) fprintf(output, "%02x%02x%02x", opcode, addr & 0xFF, (addr >> 8) & 0xFF);
+            uint32_t addr = (pass == 2) ? resolve_label(operand1) : 0;
+            if (pass == 2) emit_byte(opcode);
+            word_operand(addr, pass);
         } else if (opcode >= SETZ_dest && opcode <= SETA_dest) {
-            genInsOffs(output, opcode, operand1, NULL, pass);
+            genInsOffs(opcode, operand1, NULL, pass);
         }
 
     }
 
     else if (count == 1) { // ei, di, hlt..
-        if (opcode >= RET && opcode <= POPF || opcode >= VMRESTART && opcode <= VMSTATE || opcode >= GETS_r4 && opcode <= PRINTS_r3 || opcode >= GLINIT && opcode <= GLLINE) {
-            if (pass == 2) {
-                fprintf(output, "%02x", opcode);
-            }
+        if ((opcode >= RET && opcode <= POPF) || (opcode >= VMRESTART && opcode <= VMSTATE) || (opcode >= VMBANK && opcode <= VMCHRECV)
+            || (opcode >= GETS_r4 && opcode <= PRINTS_r3) || (opcode >= GLINIT && opcode <= GLLINE)) {
+            if (pass == 2) emit_byte(opcode);
         }
     }
 
     current_address += get_opcode_size(mnemonic);
 }
 
+// Write the image, a code section loaded at 0 and a debug section with the labels
+int write_image(FILE *output) {
+    static uint8_t debug[MAX_LABELS * (4 + sizeof(labels[0].name))];
+    uint32_t debug_size = 0;
+    for (int i = 0; i < label_count; i++) {
+        size_t length = strlen(labels[i].name) + 1;
+        if (word_bytes == 4) imgPut32(debug + debug_size, labels[i].address);
+        else imgPut16(debug + debug_size, labels[i].address);
+        memcpy(debug + debug_size + word_bytes, labels[i].name, length);
+        debug_size += word_bytes + length;
+    }
+
+    uint8_t header[IMG_WIDE_HEADER_SIZE + 2 * IMG_WIDE_SECTION_SIZE];
+    uint32_t header_size = imgHeaderSize(image_flags) + 2 * imgSectionSize(image_flags);
+    imgPutHeader(header, image_flags, entry_label[0] ? resolve_label(entry_label) : 0, mem_size, 2);
+    imgPutSection(header, image_flags, 0, IMG_CODE, 0, header_size, code_size);
+    imgPutSection(header, image_flags, 1, IMG_DEBUG, 0, header_size + code_size, debug_size);
+
+    return fwrite(header, 1, header_size, output) != header_size ||
+        fwrite(code, 1, code_size, output) != code_size ||
+        fwrite(debug, 1, debug_size, output) != debug_size;
+}
+
 int main(int argc, char **argv) {
     printf("LASM v%s\n", LASM_VERSION_STR);
 
@@ -271,7 +355,7 @@ int main(int argc, char **argv) {
     char line[64];
 
     // First pass: Collect labels
-    while (fgets(line, sizeof(line), input)) assemble_line(line, NULL, 1);
+    while (fgets(line, sizeof(line), input)) assemble_line(line, 1);
     
     rewind(input);
     current_address = 0;
@@ -287,10 +371,13 @@ int main(int argc, char **argv) {
     }
 
     // Second pass: Code generation
-    while (fgets(line, sizeof(line), input)) assemble_line(line, output, 2);
+    while (fgets(line, sizeof(line), input)) assemble_line(line, 2);
 
     fclose(input);
-    fclose(output);
+    if (write_image(output) | fclose(output)) {
+        fprintf(stderr, "Error writing %s\n", argv[2]);
+        return 1;
+    }
     printf("Assembled successfully!\n");
     return 0;
 }